@@ -17,17 +17,212 @@ bool AbstractLearner::isInitialized()
     return _initialized;
 }
 
+const FeatureLayout& AbstractLearner::currentLayout()
+{
+    if (!layoutReady) {
+        layout = featureLayout();
+        layoutReady = true;
+    }
+    return layout;
+}
+
+boost::optional<dlib::matrix<double,0,1>> AbstractLearner::getFeatureVector(GazeHyp& ghyp)
+{
+    auto result = boost::optional<dlib::matrix<double,0,1>>();
+    const FeatureLayout& fl = currentLayout();
+    if (fl.available(ghyp.features)) {
+        sample_type fv(fl.size(ghyp.features));
+        fl.gather(ghyp.features, &fv(0));
+        result = fv;
+    }
+    return result;
+}
+
+// the feature vector in a reused per thread buffer, null if features are missing
+const double* AbstractLearner::gatherFeatures(const GazeHyp& ghyp)
+{
+    static thread_local std::vector<double> buffer;
+    const FeatureLayout& fl = currentLayout();
+    if (!fl.available(ghyp.features)) return nullptr;
+    buffer.resize(fl.size(ghyp.features));
+    if (compiled && buffer.size() != compiled->inputSize()) {
+        throw std::runtime_error(getId() + ": feature vector does not match the compiled model");
+    }
+    fl.gather(ghyp.features, buffer.data());
+    return buffer.data();
+}
+
 void AbstractLearner::accumulate(GazeHyp &ghyp)
 {
-    auto fv = getFeatureVector(ghyp);
-    if (!ghyp.parentHyp.label.empty() && fv.is_initialized()) {
-        samples.push_back(fv.get());
-        double lbl = boost::lexical_cast<int>(ghyp.parentHyp.label);
+    accumulate(ghyp.features, ghyp.parentHyp.label);
+}
+
+void AbstractLearner::accumulate(const FeatureBlock& features, const std::string& label)
+{
+    const FeatureLayout& fl = currentLayout();
+    if (!label.empty() && fl.available(features)) {
+        sample_type fv(fl.size(features));
+        fl.gather(features, &fv(0));
+        samples.push_back(fv);
+        double lbl = boost::lexical_cast<int>(label);
         labels.push_back(lbl);
     }
 }
 
+void AbstractLearner::appendSamples(AbstractLearner& other)
+{
+    samples.insert(samples.end(), std::make_move_iterator(other.samples.begin()),
+                   std::make_move_iterator(other.samples.end()));
+    labels.insert(labels.end(), other.labels.begin(), other.labels.end());
+    other.samples.clear();
+    other.labels.clear();
+}
+
 size_t AbstractLearner::sampleCount()
 {
     return samples.size();
 }
+
+dlib::matrix<double> AbstractLearner::normalizeBatch(const std::vector<GazeHyp*>& ghyps, std::vector<GazeHyp*>& valid, bool pca)
+{
+    const sample_type& means = pca ? normalizer_pca.means() : normalizer.means();
+    const sample_type& sd = pca ? normalizer_pca.std_devs() : normalizer.std_devs();
+    const FeatureLayout& fl = currentLayout();
+    for (GazeHyp* ghyp : ghyps) {
+        if (!fl.available(ghyp->features)) continue;
+        if (fl.size(ghyp->features) != means.size()) {
+            throw std::runtime_error(getId() + ": feature vector does not match the normalizer");
+        }
+        valid.push_back(ghyp);
+    }
+    // samples are the columns, so the projection of the whole batch is a single product.
+    // they are normalized straight from the segments of the feature blocks
+    dlib::matrix<double> x(means.size(), valid.size());
+    for (size_t i = 0; i < valid.size(); i++) {
+        long row = 0;
+        for (const auto& r : fl.ranges) {
+            const double* src = valid[i]->features.data(r.segment);
+            const long end = valid[i]->features.size(r.segment) - r.dropLast;
+            for (long k = r.begin; k < end; k++, row++) {
+                x(row, i) = (src[k] - means(row)) * sd(row);
+            }
+        }
+    }
+    if (pca && valid.size()) {
+        return normalizer_pca.pca_matrix() * x;
+    }
+    return x;
+}
+
+const dlib::matrix<double>& AbstractLearner::basisMatrix(const dlib::matrix<sample_type,0,1>& basis_vectors)
+{
+    if (batchBasis.nc() != basis_vectors.size()) {
+        batchBasis.set_size(basis_vectors(0).size(), basis_vectors.size());
+        for (long i = 0; i < basis_vectors.size(); i++) {
+            dlib::set_colm(batchBasis, i) = basis_vectors(i);
+        }
+        batchBasisNorms = dlib::trans(dlib::sum_rows(dlib::squared(batchBasis)));
+    }
+    return batchBasis;
+}
+
+dlib::matrix<double,0,1> AbstractLearner::decisionBatch(const dlib::decision_function<dlib::linear_kernel<sample_type>>& df,
+                                                        const dlib::matrix<double>& z)
+{
+    dlib::matrix<double> products = dlib::trans(basisMatrix(df.basis_vectors)) * z;
+    dlib::matrix<double,0,1> result = dlib::trans(dlib::trans(df.alpha) * products);
+    return result - df.b;
+}
+
+dlib::matrix<double,0,1> AbstractLearner::decisionBatch(const dlib::decision_function<dlib::radial_basis_kernel<sample_type>>& df,
+                                                        const dlib::matrix<double>& z)
+{
+    // squared distances from the products: |b|^2 + |z|^2 - 2 b.z
+    dlib::matrix<double> products = dlib::trans(basisMatrix(df.basis_vectors)) * z;
+    dlib::matrix<double> sampleNorms = dlib::sum_rows(dlib::squared(z));
+    const double gamma = df.kernel_function.gamma;
+    dlib::matrix<double,0,1> result(z.nc());
+    for (long j = 0; j < z.nc(); j++) {
+        double sum = 0;
+        for (long i = 0; i < products.nr(); i++) {
+            double dist = std::max(0.0, batchBasisNorms(i) + sampleNorms(j) - 2*products(i, j));
+            sum += df.alpha(i) * std::exp(-gamma*dist);
+        }
+        result(j) = sum - df.b;
+    }
+    return result;
+}
+
+bool AbstractLearner::_loadCompiled(const std::string& filename)
+{
+    if (!CompiledModel::isCompiled(filename)) return false;
+    compiled = std::make_shared<CompiledModel>(filename);
+    if (compiled->featureSet() >= 0) {
+        if (trainParams.featureSet.is_initialized()) {
+            std::cerr << "Warning: Overriding featureset for " << getId()
+                 << " due to classifier loading from " << filename << std::endl;
+        }
+        trainParams.featureSet = static_cast<FeatureSetConfig>(compiled->featureSet());
+    }
+    layoutReady = false;
+    batchBasis.set_size(0, 0);
+    _initialized = true;
+    return true;
+}
+
+bool AbstractLearner::_classifyCompiled(GazeHyp& ghyp, boost::optional<double>& target)
+{
+    if (!compiled) return false;
+    const double* fv = gatherFeatures(ghyp);
+    if (fv) {
+        target = (*compiled)(fv);
+    }
+    return true;
+}
+
+CompiledModel::Definition AbstractLearner::_compile(const dlib::decision_function<dlib::linear_kernel<sample_type>>& df, bool pca)
+{
+    if (compiled || !df.basis_vectors.size()) throw std::runtime_error(getId() + ": no dlib model to compile");
+    CompiledModel::Definition def;
+    def.kernel = CompiledModel::Kernel::LINEAR;
+    def.featureSet = trainParams.featureSet.is_initialized() ? static_cast<int>(trainParams.featureSet.get()) : -1;
+    // the expansion collapses to one weight vector in normalized space, which is then
+    // pulled back through the projection and the scaling to the raw features
+    sample_type weights = df.alpha(0) * df.basis_vectors(0);
+    for (long i = 1; i < df.basis_vectors.size(); i++) {
+        weights += df.alpha(i) * df.basis_vectors(i);
+    }
+    if (pca) {
+        weights = dlib::trans(normalizer_pca.pca_matrix()) * weights;
+        def.offset = normalizer_pca.means();
+        def.weights = dlib::pointwise_multiply(weights, normalizer_pca.std_devs());
+    } else {
+        def.offset = normalizer.means();
+        def.weights = dlib::pointwise_multiply(weights, normalizer.std_devs());
+    }
+    def.bias = df.b;
+    return def;
+}
+
+CompiledModel::Definition AbstractLearner::_compile(const dlib::decision_function<dlib::radial_basis_kernel<sample_type>>& df, bool pca)
+{
+    if (compiled || !df.basis_vectors.size()) throw std::runtime_error(getId() + ": no dlib model to compile");
+    CompiledModel::Definition def;
+    def.kernel = CompiledModel::Kernel::RBF;
+    def.featureSet = trainParams.featureSet.is_initialized() ? static_cast<int>(trainParams.featureSet.get()) : -1;
+    if (pca) {
+        def.offset = normalizer_pca.means();
+        def.projection = normalizer_pca.pca_matrix() * dlib::diagm(normalizer_pca.std_devs());
+    } else {
+        def.offset = normalizer.means();
+        def.scale = normalizer.std_devs();
+    }
+    def.basis.set_size(df.basis_vectors.size(), df.basis_vectors(0).size());
+    for (long i = 0; i < df.basis_vectors.size(); i++) {
+        dlib::set_rowm(def.basis, i) = dlib::trans(df.basis_vectors(i));
+    }
+    def.weights = df.alpha;
+    def.bias = df.b;
+    def.gamma = df.kernel_function.gamma;
+    return def;
+}
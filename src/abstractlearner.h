@@ -5,6 +5,8 @@
 #include <dlib/serialize.h>
 #include <dlib/svm.h>
 #include "gazehyps.h"
+#include "compiledmodel.h"
+#include "featureblock.h"
 
 enum class FeatureSetConfig {POSITIONAL, RELATIONAL, HOG, POSREL, HOGREL, HOGPOS, ALL};
 static std::vector<std::string> featureSetNames = {"POSITIONAL", "RELATIONAL", "HOG", "POSREL", "HOGREL", "HOGPOS", "ALL"};
@@ -15,6 +17,12 @@ struct TrainingParameters {
     boost::optional<double> c;
     boost::optional<double> pca_epsilon;
     boost::optional<FeatureSetConfig> featureSet;
+    // parameter search of the gaze classifier
+    std::vector<double> gammaGrid;
+    boost::optional<int> cSteps;
+    boost::optional<int> folds;
+    boost::optional<int> threads;
+    bool successiveHalving = false;
 };
 
 class AbstractLearner
@@ -23,13 +31,17 @@ public:
     AbstractLearner(TrainingParameters params);
     virtual ~AbstractLearner();
     virtual bool isInitialized();
-    virtual boost::optional<dlib::matrix<double,0,1>> getFeatureVector(GazeHyp& ghyp) = 0;
+    boost::optional<dlib::matrix<double,0,1>> getFeatureVector(GazeHyp& ghyp);
     virtual void accumulate(GazeHyp &ghyp);
+    void accumulate(const FeatureBlock& features, const std::string& label);
     virtual size_t sampleCount();
+    // moves the samples accumulated by other behind the own ones
+    void appendSamples(AbstractLearner& other);
     virtual std::string getId() = 0;
 
 protected:
     typedef dlib::matrix<double,0,1> sample_type;
+    typedef std::vector<std::pair<GazeHyp*, double>> batch_result_type;
     typedef std::vector<double> label_type;
     std::vector<sample_type> samples;
     label_type labels;
@@ -38,10 +50,33 @@ protected:
     bool _initialized = false;
     bool use_pca;
     TrainingParameters trainParams;
+    dlib::matrix<double> batchBasis;
+    dlib::matrix<double,0,1> batchBasisNorms;
+    std::shared_ptr<CompiledModel> compiled;
+    FeatureLayout layout;
+    bool layoutReady = false;
+
+    // segments of the feature block that form the feature vector for the current feature set
+    virtual FeatureLayout featureLayout() = 0;
+    const FeatureLayout& currentLayout();
+    const double* gatherFeatures(const GazeHyp& ghyp);
+
+    bool _loadCompiled(const std::string& filename);
+    bool _classifyCompiled(GazeHyp& ghyp, boost::optional<double>& target);
+    CompiledModel::Definition _compile(const dlib::decision_function<dlib::linear_kernel<sample_type>>& df, bool pca);
+    CompiledModel::Definition _compile(const dlib::decision_function<dlib::radial_basis_kernel<sample_type>>& df, bool pca);
+
+    dlib::matrix<double> normalizeBatch(const std::vector<GazeHyp*>& ghyps, std::vector<GazeHyp*>& valid, bool pca);
+    const dlib::matrix<double>& basisMatrix(const dlib::matrix<sample_type,0,1>& basis_vectors);
+    dlib::matrix<double,0,1> decisionBatch(const dlib::decision_function<dlib::linear_kernel<sample_type>>& df,
+                                           const dlib::matrix<double>& z);
+    dlib::matrix<double,0,1> decisionBatch(const dlib::decision_function<dlib::radial_basis_kernel<sample_type>>& df,
+                                           const dlib::matrix<double>& z);
 
     template<typename T>
     void _loadClassifier(const std::string &filename, T& learned_function)
     {
+        if (_loadCompiled(filename)) return;
         std::ifstream infile(filename, std::ios::in | std::ios::binary);
         if (!infile.is_open()) throw dlib::serialization_error("Error: Cannot open " + filename);
         dlib::deserialize(use_pca, infile);
@@ -51,6 +86,8 @@ protected:
             deserialize(normalizer, infile);
         }
         deserialize(learned_function, infile);
+        batchBasis.set_size(0, 0);
+        compiled.reset();
         int fsc;
         dlib::deserialize(fsc, infile);
         if (trainParams.featureSet.is_initialized()) {
@@ -58,11 +95,13 @@ protected:
                  << " due to classifier loading from " << filename << std::endl;
         }
         trainParams.featureSet = static_cast<FeatureSetConfig>(fsc);
+        layoutReady = false;
         _initialized = true;
     }
 
     template<typename T1, typename T2>
     void _classify(GazeHyp& ghyp, T1& learned_function, T2& target) {
+        if (_classifyCompiled(ghyp, target)) return;
         auto fv = getFeatureVector(ghyp);
         if (learned_function.basis_vectors.size() && fv.is_initialized()) {
             if (use_pca) {
@@ -73,6 +112,30 @@ protected:
         }
     }
 
+    // batched counterpart of _classify, all samples are normalized and evaluated against
+    // the basis vectors as matrix products
+    template<typename T1>
+    batch_result_type _classifyBatch(const std::vector<GazeHyp*>& ghyps, T1& learned_function, bool pca) {
+        batch_result_type result;
+        std::vector<GazeHyp*> valid;
+        if (compiled) {
+            // compiled models evaluate a face with a single pass over contiguous memory
+            for (GazeHyp* ghyp : ghyps) {
+                const double* fv = gatherFeatures(*ghyp);
+                if (fv) result.push_back(std::make_pair(ghyp, (*compiled)(fv)));
+            }
+            return result;
+        }
+        if (!learned_function.basis_vectors.size()) return result;
+        dlib::matrix<double> z = normalizeBatch(ghyps, valid, pca);
+        if (valid.empty()) return result;
+        dlib::matrix<double,0,1> values = decisionBatch(learned_function, z);
+        for (size_t i = 0; i < valid.size(); i++) {
+            result.push_back(std::make_pair(valid[i], values(i)));
+        }
+        return result;
+    }
+
     template<typename T1, typename T2>
     void _train(const std::string &outfilename, T1& learned_function, T2& trainer, bool samplerandomization = false)
     {
@@ -109,6 +172,8 @@ protected:
                   << "svr eps: " << trainer.get_epsilon() << std::endl
                   << "svr eps-insens: " << trainer.get_epsilon_insensitivity() << std::endl;
         learned_function = trainer.train(samples, labels);
+        batchBasis.set_size(0, 0);
+        compiled.reset();
         std::cout << "Basis vectors: " << learned_function.basis_vectors.size() << std::endl;
         std::ofstream outfile(outfilename, std::ios::out | std::ios::binary);
         dlib::serialize(use_pca, outfile);
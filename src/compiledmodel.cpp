@@ -0,0 +1,206 @@
+#include "compiledmodel.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include <dlib/serialize.h>
+
+using namespace std;
+
+static const char MAGIC[8] = {'G', 'Z', 'M', 'O', 'D', 'E', 'L', '\0'};
+static constexpr uint32_t VERSION = 1;
+static constexpr size_t ALIGNMENT = 64;
+
+static size_t alignedPos(size_t pos) {
+    return (pos + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+// rows of float32 sections are padded with zeros to full cache lines
+static size_t floatStride(size_t n) {
+    return alignedPos(n * sizeof(float)) / sizeof(float);
+}
+
+// eight independent partial sums, so the loops vectorize without reassociating
+static float dot(const float* a, const float* b, size_t n) {
+    float acc[8] = {0};
+    for (size_t i = 0; i < n; i += 8) {
+        for (int k = 0; k < 8; k++) acc[k] += a[i+k] * b[i+k];
+    }
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+static float squaredDistance(const float* a, const float* b, size_t n) {
+    float acc[8] = {0};
+    for (size_t i = 0; i < n; i += 8) {
+        for (int k = 0; k < 8; k++) {
+            float d = a[i+k] - b[i+k];
+            acc[k] += d * d;
+        }
+    }
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+bool CompiledModel::isCompiled(const string& filename)
+{
+    ifstream infile(filename, ios::in | ios::binary);
+    char magic[sizeof(MAGIC)];
+    return infile.read(magic, sizeof(magic)) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+CompiledModel::CompiledModel(const string& filename)
+{
+    try {
+        file = make_shared<MappedFile>(filename);
+    } catch (runtime_error& e) {
+        throw dlib::serialization_error(e.what());
+    }
+    if (file->size() < sizeof(Header)) throw dlib::serialization_error("Error: Truncated model " + filename);
+    header = reinterpret_cast<const Header*>(file->data());
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION) {
+        throw dlib::serialization_error("Error: Unsupported compiled model " + filename);
+    }
+    auto section = [this, &filename](uint64_t pos, size_t bytes) {
+        if (pos % ALIGNMENT || pos + bytes > file->size()) {
+            throw dlib::serialization_error("Error: Corrupt compiled model " + filename);
+        }
+        return file->data() + pos;
+    };
+    offset = reinterpret_cast<const double*>(section(header->offsetPos, header->inDim * sizeof(double)));
+    if (header->kernel == static_cast<uint32_t>(Kernel::LINEAR)) {
+        weights = reinterpret_cast<const double*>(section(header->weightsPos, header->inDim * sizeof(double)));
+    } else if (header->kernel == static_cast<uint32_t>(Kernel::RBF)) {
+        if (header->projectionPos) {
+            size_t bytes = header->outDim * floatStride(header->inDim) * sizeof(float);
+            projection = reinterpret_cast<const float*>(section(header->projectionPos, bytes));
+        } else {
+            scale = reinterpret_cast<const double*>(section(header->scalePos, header->inDim * sizeof(double)));
+        }
+        size_t bytes = header->basisCount * floatStride(header->outDim) * sizeof(float);
+        basis = reinterpret_cast<const float*>(section(header->basisPos, bytes));
+        weights = reinterpret_cast<const double*>(section(header->weightsPos, header->basisCount * sizeof(double)));
+    } else {
+        throw dlib::serialization_error("Error: Unknown kernel in " + filename);
+    }
+}
+
+void CompiledModel::write(const string& filename, const Definition& def)
+{
+    bool rbf = def.kernel == Kernel::RBF;
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.kernel = static_cast<uint32_t>(def.kernel);
+    header.output = static_cast<uint32_t>(def.output);
+    header.featureSet = def.featureSet;
+    header.inDim = def.offset.size();
+    header.outDim = rbf ? (def.projection.size() ? def.projection.nr() : def.offset.size()) : 1;
+    header.basisCount = rbf ? def.basis.nr() : 0;
+    header.bias = def.bias;
+    header.gamma = def.gamma;
+    header.sigmoidA = def.sigmoidA;
+    header.sigmoidB = def.sigmoidB;
+
+    // the header is filled in once all section positions are known
+    vector<char> content(alignedPos(sizeof(Header)), 0);
+    auto append = [&content](const void* data, size_t bytes) {
+        size_t start = content.size();
+        content.resize(alignedPos(start + bytes), 0);
+        memcpy(content.data() + start, data, bytes);
+        return start;
+    };
+    auto appendDoubles = [&append](const dlib::matrix<double,0,1>& v) {
+        vector<double> values(v.size());
+        for (long i = 0; i < v.size(); i++) values[i] = v(i);
+        return append(values.data(), values.size() * sizeof(double));
+    };
+    auto appendFloatRows = [&append](const dlib::matrix<double>& m) {
+        size_t stride = floatStride(m.nc());
+        vector<float> values(m.nr() * stride, 0.0f);
+        for (long r = 0; r < m.nr(); r++) {
+            for (long c = 0; c < m.nc(); c++) {
+                values[r*stride + c] = m(r, c);
+            }
+        }
+        return append(values.data(), values.size() * sizeof(float));
+    };
+    header.offsetPos = appendDoubles(def.offset);
+    header.weightsPos = appendDoubles(def.weights);
+    if (rbf) {
+        if (def.projection.size()) {
+            header.projectionPos = appendFloatRows(def.projection);
+        } else {
+            header.scalePos = appendDoubles(def.scale);
+        }
+        header.basisPos = appendFloatRows(def.basis);
+    }
+
+    ofstream outfile(filename, ios::out | ios::binary);
+    if (!outfile.is_open()) throw runtime_error("Error: Cannot write " + filename);
+    memcpy(content.data(), &header, sizeof(header));
+    outfile.write(content.data(), content.size());
+}
+
+double CompiledModel::operator()(const dlib::matrix<double,0,1>& x) const
+{
+    if (x.size() != header->inDim) {
+        throw runtime_error("feature vector does not match the compiled model");
+    }
+    return (*this)(&x(0));
+}
+
+double CompiledModel::operator()(const double* x) const
+{
+    double value = header->kernel == static_cast<uint32_t>(Kernel::LINEAR) ? linear(x) : rbf(x);
+    if (header->output == static_cast<uint32_t>(Output::SIGMOID)) {
+        value = 1/(1 + exp(header->sigmoidA*value + header->sigmoidB));
+    }
+    return value;
+}
+
+int CompiledModel::featureSet() const
+{
+    return header->featureSet;
+}
+
+size_t CompiledModel::inputSize() const
+{
+    return header->inDim;
+}
+
+double CompiledModel::linear(const double* x) const
+{
+    double sum = 0;
+    for (size_t i = 0; i < header->inDim; i++) {
+        sum += weights[i] * (x[i] - offset[i]);
+    }
+    return sum - header->bias;
+}
+
+double CompiledModel::rbf(const double* x) const
+{
+    static thread_local vector<float> centered, z;
+    size_t inStride = floatStride(header->inDim);
+    size_t outStride = floatStride(header->outDim);
+    z.assign(outStride, 0.0f);
+    if (projection) {
+        centered.assign(inStride, 0.0f);
+        for (size_t i = 0; i < header->inDim; i++) {
+            centered[i] = x[i] - offset[i];
+        }
+        for (size_t r = 0; r < header->outDim; r++) {
+            z[r] = dot(projection + r*inStride, centered.data(), inStride);
+        }
+    } else {
+        for (size_t i = 0; i < header->inDim; i++) {
+            z[i] = scale[i] * (x[i] - offset[i]);
+        }
+    }
+    double sum = 0;
+    for (size_t j = 0; j < header->basisCount; j++) {
+        float dist = squaredDistance(basis + j*outStride, z.data(), outStride);
+        sum += weights[j] * exp(-header->gamma * dist);
+    }
+    return sum - header->bias;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <dlib/matrix.h>
+
+#include "mappedfile.h"
+
+/**
+ * @brief Flat, memory mapped form of a normalizer plus decision function.
+ *
+ * Normalization and PCA are folded into one affine transform z = P (x - offset).
+ * Linear models are collapsed further into a single weight vector over the raw
+ * features, RBF models keep their basis vectors as contiguous float32 rows.
+ * All sections are 64 byte aligned, so the file is used in place after mmap.
+ */
+class CompiledModel
+{
+public:
+    enum class Kernel : uint32_t {LINEAR = 0, RBF = 1};
+    enum class Output : uint32_t {RAW = 0, SIGMOID = 1};
+
+    // the model in dlib terms, as collected by the learners before writing
+    struct Definition {
+        Kernel kernel = Kernel::LINEAR;
+        Output output = Output::RAW;
+        int featureSet = -1;
+        dlib::matrix<double,0,1> offset;
+        // RBF: projection rows are the normalized dimensions, scale is used instead if empty
+        dlib::matrix<double> projection;
+        dlib::matrix<double,0,1> scale;
+        // RBF: basis vectors as rows with their weights, linear: weights of the raw features
+        dlib::matrix<double> basis;
+        dlib::matrix<double,0,1> weights;
+        double bias = 0;
+        double gamma = 0;
+        double sigmoidA = 0;
+        double sigmoidB = 0;
+    };
+
+    CompiledModel(const std::string& filename);
+    static bool isCompiled(const std::string& filename);
+    static void write(const std::string& filename, const Definition& def);
+
+    double operator()(const dlib::matrix<double,0,1>& x) const;
+    // x holds inputSize() raw features
+    double operator()(const double* x) const;
+    int featureSet() const;
+    size_t inputSize() const;
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t kernel;
+        uint32_t output;
+        int32_t featureSet;
+        uint32_t inDim;
+        uint32_t outDim;
+        uint32_t basisCount;
+        uint32_t reserved;
+        double bias;
+        double gamma;
+        double sigmoidA;
+        double sigmoidB;
+        uint64_t offsetPos;
+        uint64_t scalePos;
+        uint64_t weightsPos;
+        uint64_t projectionPos;
+        uint64_t basisPos;
+    };
+
+    std::shared_ptr<MappedFile> file;
+    const Header* header;
+    const double* offset;
+    const double* scale = nullptr;
+    const double* weights;
+    const float* projection = nullptr;
+    const float* basis = nullptr;
+
+    double linear(const double* x) const;
+    double rbf(const double* x) const;
+};
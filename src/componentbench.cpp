@@ -0,0 +1,174 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <dlib/image_processing.h>
+#include <dlib/opencv.h>
+
+#include "gazehyps.h"
+#include "imageprovider.h"
+#include "flatshapepredictor.h"
+#include "pupilfinder.h"
+#include "eyepatcher.h"
+#include "featureextractor.h"
+#include "verticalgazelearner.h"
+#include "relativeeyelidlearner.h"
+#include "relativegazelearner.h"
+
+using namespace std;
+
+// every benchmark is repeated, the median and the fastest run are reported
+static constexpr int RUNS = 5;
+static constexpr double MIN_RUN_SECONDS = 0.2;
+
+typedef function<void(const vector<GazeHyp*>&)> Pass;
+
+// the faces of all images with the features the pipeline computes, every benchmark works on the same faces
+struct Fixture {
+    vector<GazeHypsPtr> frames;
+    vector<GazeHyp*> faces;
+};
+
+static Fixture prepareFaces(const string& batchfile, const string& modelfile) {
+    dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+    FlatShapePredictor shapePredictor(modelfile);
+    FeatureExtractor extractor;
+    BatchImageProvider images(batchfile);
+    Fixture fixture;
+    cv::Mat frame;
+    while (images.get(frame)) {
+        GazeHypsPtr gazehyps = make_shared<GazeHypList>();
+        frame.copyTo(gazehyps->frame);
+        ImageProvider::toGray(gazehyps->frame, gazehyps->grayframe);
+        const dlib::cv_image<unsigned char> img(gazehyps->grayframe);
+        for (const auto& facerect : detector(img)) {
+            GazeHyp ghyp(*gazehyps);
+            ghyp.faceDetection = facerect;
+            ghyp.shape = shapePredictor(img, facerect);
+            ghyp.faceParts = FaceParts(ghyp.shape);
+            gazehyps->addGazeHyp(ghyp);
+        }
+        for (auto& ghyp : *gazehyps) {
+            ghyp.features.allocate(gazehyps->featureArena, extractor.segmentSizes(ghyp));
+            ghyp.pupils = PupilFinder(gazehyps->grayframe, ghyp.faceParts);
+            extractor.extractLidFeatures(ghyp);
+            extractor.extractEyeHogFeatures(ghyp);
+            extractor.extractFaceFeatures(ghyp);
+            extractor.extractHorizGazeFeatures(ghyp);
+            extractor.extractVertGazeFeatures(ghyp);
+            fixture.faces.push_back(&ghyp);
+        }
+        fixture.frames.push_back(gazehyps);
+    }
+    return fixture;
+}
+
+static Pass eachFace(function<void(GazeHyp&)> op) {
+    return [op](const vector<GazeHyp*>& faces) {
+        for (GazeHyp* ghyp : faces) op(*ghyp);
+    };
+}
+
+// Runs passes over all faces until MIN_RUN_SECONDS have passed, after one warmup pass.
+static void bench(const string& name, const string& filter, const vector<GazeHyp*>& faces, const Pass& pass) {
+    if (name.find(filter) == string::npos || faces.empty()) return;
+    pass(faces);
+    vector<double> perFace;
+    long operations = 0;
+    for (int run = 0; run < RUNS; run++) {
+        long runOperations = 0;
+        double elapsed = 0;
+        auto tstart = chrono::steady_clock::now();
+        do {
+            pass(faces);
+            runOperations += faces.size();
+            elapsed = chrono::duration<double>(chrono::steady_clock::now() - tstart).count();
+        } while (elapsed < MIN_RUN_SECONDS);
+        perFace.push_back(1e6*elapsed/runOperations);
+        operations += runOperations;
+    }
+    sort(perFace.begin(), perFace.end());
+    cout << name << "\t" << faces.size() << "\t" << operations << "\t" << perFace[RUNS/2] << "\t" << perFace[0] << endl;
+}
+
+// models missing in the directory are skipped together with their benchmarks
+template<typename T>
+static bool loadModel(T& learner, const string& filename) {
+    if (!ifstream(filename).good()) {
+        cerr << "skipping " << filename << ": not found" << endl;
+        return false;
+    }
+    learner.loadClassifier(filename);
+    return learner.isInitialized();
+}
+
+template<typename T>
+static void benchLearner(const string& name, const string& filter, const vector<GazeHyp*>& faces,
+                         const string& filename, TrainingParameters& params) {
+    if ((name + "/classify_batch").find(filter) == string::npos) return;
+    T learner(params);
+    if (!loadModel(learner, filename)) return;
+    bench(name + "/classify", filter, faces, eachFace([&learner](GazeHyp& ghyp) { learner.classify(ghyp); }));
+    bench(name + "/classify_batch", filter, faces, [&learner](const vector<GazeHyp*>& faces) {
+        learner.classifyBatch(faces);
+    });
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 5) {
+        cerr << "usage: " << argv[0] << " <batchfile> <shape model> [model directory] [filter]" << endl;
+        return 1;
+    }
+    const string modeldir = argc > 3 ? argv[3] : ".";
+    const string filter = argc > 4 ? argv[4] : "";
+    Fixture fixture = prepareFaces(argv[1], argv[2]);
+    const vector<GazeHyp*>& faces = fixture.faces;
+    vector<GazeHyp*> facesWithPupils;
+    copy_if(faces.begin(), faces.end(), back_inserter(facesWithPupils),
+            [](GazeHyp* ghyp) { return ghyp->pupils.pupilsFound() == 2; });
+    //eye patches are empty when an eye rectangle crosses the frame border
+    vector<GazeHyp*> facesWithEyePatch;
+    copy_if(faces.begin(), faces.end(), back_inserter(facesWithEyePatch),
+            [](GazeHyp* ghyp) { return !ghyp->eyePatch.empty(); });
+    cerr << faces.size() << " faces, " << facesWithPupils.size() << " with both pupils, "
+         << facesWithEyePatch.size() << " with eye patches" << endl;
+
+    FeatureExtractor extractor;
+    EyePatcher lidPatcher(24, 24);
+    cv::Mat patch, mask;
+    PupilFinder pupils;
+    cout << "benchmark\tfaces\toperations\tmedian_us_per_face\tmin_us_per_face" << endl;
+    bench("pupilfinder/exhaustive", filter, faces, eachFace([&pupils](GazeHyp& ghyp) {
+        pupils = PupilFinder(ghyp.parentHyp.grayframe, ghyp.faceParts, PupilFinder::SearchStrategy::EXHAUSTIVE);
+    }));
+    bench("pupilfinder/coarse", filter, faces, eachFace([&pupils](GazeHyp& ghyp) {
+        pupils = PupilFinder(ghyp.parentHyp.grayframe, ghyp.faceParts, PupilFinder::SearchStrategy::COARSE_TO_FINE);
+    }));
+    bench("eyepatcher/patch", filter, faces, eachFace([&](GazeHyp& ghyp) {
+        lidPatcher(ghyp.parentHyp.frame, ghyp.faceParts, patch);
+    }));
+    bench("eyepatcher/masked", filter, facesWithEyePatch, eachFace([&](GazeHyp& ghyp) {
+        lidPatcher.getMasked(ghyp.parentHyp.frame, ghyp.faceParts, patch, mask);
+    }));
+    bench("features/lid", filter, faces, eachFace([&extractor](GazeHyp& ghyp) {
+        extractor.extractLidFeatures(ghyp);
+    }));
+    bench("features/eye_hog", filter, faces, eachFace([&extractor](GazeHyp& ghyp) {
+        extractor.extractEyeHogFeatures(ghyp);
+    }));
+    bench("features/face", filter, facesWithPupils, eachFace([&extractor](GazeHyp& ghyp) {
+        extractor.extractFaceFeatures(ghyp);
+    }));
+
+    TrainingParameters params;
+    benchLearner<RelativeGazeLearner>("gaze_est_deg", filter, faces, modeldir + "/gaze_est_deg.dat", params);
+    benchLearner<VerticalGazeLearner>("vertgaze_est_deg", filter, faces, modeldir + "/vertgaze_est_deg.dat", params);
+    benchLearner<RelativeEyeLidLearner>("lid_est", filter, faces, modeldir + "/lid_est.dat", params);
+    return 0;
+}
@@ -0,0 +1,409 @@
+#include "estimatewriter.h"
+#include "gazehyps.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+static const char MAGIC[8] = {'G', 'Z', 'E', 'S', 'T', '\0', '\0', '\0'};
+static const char COLUMNAR_MAGIC[8] = {'G', 'Z', 'E', 'C', 'O', 'L', 'S', '\0'};
+static constexpr uint32_t VERSION = 1;
+static constexpr size_t STREAM_BUFFER_BYTES = 1 << 20;
+// faces per row group of the columnar format
+static constexpr uint64_t ROW_GROUP_ROWS = 65536;
+
+static const double NOT_SET = numeric_limits<double>::quiet_NaN();
+
+EstimateFace::EstimateFace()
+    : leftPupilX(NOT_SET), leftPupilY(NOT_SET), rightPupilX(NOT_SET), rightPupilY(NOT_SET),
+      lid(NOT_SET), lidRaw(NOT_SET), horizGaze(NOT_SET), horizGazeRaw(NOT_SET),
+      vertGaze(NOT_SET), vertGazeRaw(NOT_SET)
+{
+}
+
+EstimateFrame EstimateFrame::fromHyps(GazeHypList& gazehyps)
+{
+    EstimateFrame frame;
+    frame.frame = gazehyps.frameCounter;
+    frame.id = gazehyps.id;
+    frame.label = gazehyps.label;
+    int index = 0;
+    for (auto& ghyp : gazehyps) {
+        EstimateFace face;
+        face.face = index++;
+        face.trackId = ghyp.trackId;
+        face.left = ghyp.faceDetection.left();
+        face.top = ghyp.faceDetection.top();
+        face.right = ghyp.faceDetection.right();
+        face.bottom = ghyp.faceDetection.bottom();
+        if (ghyp.pupils.leftCandidate()) {
+            face.leftPupilX = ghyp.pupils.leftCandidate()->center.x;
+            face.leftPupilY = ghyp.pupils.leftCandidate()->center.y;
+        }
+        if (ghyp.pupils.rightCandidate()) {
+            face.rightPupilX = ghyp.pupils.rightCandidate()->center.x;
+            face.rightPupilY = ghyp.pupils.rightCandidate()->center.y;
+        }
+        face.lid = ghyp.eyeLidClassification.get_value_or(NOT_SET);
+        face.lidRaw = ghyp.rawEyeLidClassification.get_value_or(NOT_SET);
+        face.horizGaze = ghyp.horizontalGazeEstimation.get_value_or(NOT_SET);
+        face.horizGazeRaw = ghyp.rawHorizontalGazeEstimation.get_value_or(NOT_SET);
+        face.vertGaze = ghyp.verticalGazeEstimation.get_value_or(NOT_SET);
+        face.vertGazeRaw = ghyp.rawVerticalGazeEstimation.get_value_or(NOT_SET);
+        if (ghyp.isMutualGaze) face.mutualGaze = ghyp.isMutualGaze.get();
+        if (ghyp.isLidClosed) face.lidClosed = ghyp.isLidClosed.get();
+        face.landmarks.reserve(2*ghyp.shape.num_parts());
+        for (unsigned long p = 0; p < ghyp.shape.num_parts(); p++) {
+            face.landmarks.push_back(ghyp.shape.part(p).x());
+            face.landmarks.push_back(ghyp.shape.part(p).y());
+        }
+        frame.faces.push_back(std::move(face));
+    }
+    return frame;
+}
+
+unique_ptr<EstimateWriter> EstimateWriter::create(const string& filename, const string& format)
+{
+    if (format == "tsv") return unique_ptr<EstimateWriter>(new TsvEstimateWriter(filename));
+    if (format == "binary") return unique_ptr<EstimateWriter>(new BinaryEstimateWriter(filename));
+    if (format == "columnar") return unique_ptr<EstimateWriter>(new ColumnarEstimateWriter(filename));
+    throw runtime_error("Error: Unknown estimate format " + format);
+}
+
+bool EstimateWriter::isFormat(const string& format)
+{
+    return format == "tsv" || format == "binary" || format == "columnar";
+}
+
+/**
+ * @brief TsvEstimateWriter
+ */
+
+TsvEstimateWriter::TsvEstimateWriter(const string& filename)
+    : buffer(STREAM_BUFFER_BYTES), filename(filename)
+{
+    // the buffer has to be set before the file is opened
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(filename, ios::out | ios::trunc);
+    if (!out.is_open()) throw runtime_error("Error: Cannot write " + filename);
+    out << "Frame\tId\tLabel\tLid\tHorizGaze\tVertGaze\tMutualGaze\tTrackId"
+        << "\tFace\tLeft\tTop\tRight\tBottom"
+        << "\tLeftPupilX\tLeftPupilY\tRightPupilX\tRightPupilY"
+        << "\tLidRaw\tHorizGazeRaw\tVertGazeRaw\tLidClosed\tLandmarks\n";
+}
+
+void TsvEstimateWriter::write(const EstimateFrame& frame)
+{
+    static const EstimateFace noFace;
+    const size_t rows = max<size_t>(1, frame.faces.size());
+    for (size_t i = 0; i < rows; i++) {
+        const EstimateFace& face = frame.faces.empty() ? noFace : frame.faces[i];
+        out << frame.frame << "\t" << frame.id << "\t" << frame.label << "\t"
+            << face.lid << "\t" << face.horizGaze << "\t" << face.vertGaze << "\t"
+            << (face.mutualGaze > 0) << "\t" << face.trackId << "\t"
+            << face.face << "\t" << face.left << "\t" << face.top << "\t" << face.right << "\t" << face.bottom << "\t"
+            << face.leftPupilX << "\t" << face.leftPupilY << "\t" << face.rightPupilX << "\t" << face.rightPupilY << "\t"
+            << face.lidRaw << "\t" << face.horizGazeRaw << "\t" << face.vertGazeRaw << "\t"
+            << (int)face.lidClosed << "\t";
+        for (size_t p = 0; p < face.landmarks.size(); p++) {
+            out << (p ? "," : "") << face.landmarks[p];
+        }
+        out << "\n";
+    }
+}
+
+void TsvEstimateWriter::finish()
+{
+    out.close();
+    if (out.fail()) throw runtime_error("Error: Cannot write " + filename);
+}
+
+/**
+ * @brief BinaryEstimateWriter
+ */
+
+template<typename T>
+static void put(string& record, T value) {
+    record.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void putString(string& record, const string& value) {
+    put<uint32_t>(record, value.size());
+    record.append(value);
+}
+
+BinaryEstimateWriter::BinaryEstimateWriter(const string& filename)
+    : buffer(STREAM_BUFFER_BYTES), filename(filename)
+{
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(filename, ios::out | ios::binary | ios::trunc);
+    if (!out.is_open()) throw runtime_error("Error: Cannot write " + filename);
+    out.write(MAGIC, sizeof(MAGIC));
+    out.write(reinterpret_cast<const char*>(&VERSION), sizeof(VERSION));
+}
+
+void BinaryEstimateWriter::write(const EstimateFrame& frame)
+{
+    record.clear();
+    put<uint32_t>(record, 0);
+    put<int64_t>(record, frame.frame);
+    putString(record, frame.id);
+    putString(record, frame.label);
+    put<uint32_t>(record, frame.faces.size());
+    for (const EstimateFace& face : frame.faces) {
+        for (int32_t value : {face.face, face.trackId, face.left, face.top, face.right, face.bottom}) {
+            put(record, value);
+        }
+        for (double value : {face.leftPupilX, face.leftPupilY, face.rightPupilX, face.rightPupilY,
+                             face.lid, face.lidRaw, face.horizGaze, face.horizGazeRaw,
+                             face.vertGaze, face.vertGazeRaw}) {
+            put(record, value);
+        }
+        put(record, face.mutualGaze);
+        put(record, face.lidClosed);
+        put<uint32_t>(record, face.landmarks.size()/2);
+        record.append(reinterpret_cast<const char*>(face.landmarks.data()), face.landmarks.size()*sizeof(int32_t));
+    }
+    const uint32_t bytes = record.size() - sizeof(uint32_t);
+    memcpy(&record[0], &bytes, sizeof(bytes));
+    out.write(record.data(), record.size());
+}
+
+void BinaryEstimateWriter::finish()
+{
+    out.close();
+    if (out.fail()) throw runtime_error("Error: Cannot write " + filename);
+}
+
+void BinaryEstimateWriter::readHeader(istream& in, const string& filename)
+{
+    char magic[sizeof(MAGIC)];
+    uint32_t version = 0;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&version), sizeof(version));
+    if (!in || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || version != VERSION) {
+        throw runtime_error("Error: Unsupported estimate file " + filename);
+    }
+}
+
+template<typename T>
+static T get(const string& record, size_t& pos) {
+    if (pos + sizeof(T) > record.size()) throw runtime_error("Error: Truncated estimate record");
+    T value;
+    memcpy(&value, record.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+static string getString(const string& record, size_t& pos) {
+    const uint32_t length = get<uint32_t>(record, pos);
+    if (pos + length > record.size()) throw runtime_error("Error: Truncated estimate record");
+    string value = record.substr(pos, length);
+    pos += length;
+    return value;
+}
+
+bool BinaryEstimateWriter::read(istream& in, EstimateFrame& frame)
+{
+    uint32_t bytes;
+    if (!in.read(reinterpret_cast<char*>(&bytes), sizeof(bytes))) return false;
+    string record(bytes, '\0');
+    if (!in.read(&record[0], bytes)) throw runtime_error("Error: Truncated estimate record");
+    size_t pos = 0;
+    frame.frame = get<int64_t>(record, pos);
+    frame.id = getString(record, pos);
+    frame.label = getString(record, pos);
+    frame.faces.resize(get<uint32_t>(record, pos));
+    for (EstimateFace& face : frame.faces) {
+        for (int32_t* value : {&face.face, &face.trackId, &face.left, &face.top, &face.right, &face.bottom}) {
+            *value = get<int32_t>(record, pos);
+        }
+        for (double* value : {&face.leftPupilX, &face.leftPupilY, &face.rightPupilX, &face.rightPupilY,
+                              &face.lid, &face.lidRaw, &face.horizGaze, &face.horizGazeRaw,
+                              &face.vertGaze, &face.vertGazeRaw}) {
+            *value = get<double>(record, pos);
+        }
+        face.mutualGaze = get<int8_t>(record, pos);
+        face.lidClosed = get<int8_t>(record, pos);
+        face.landmarks.resize(2*get<uint32_t>(record, pos));
+        for (int32_t& value : face.landmarks) {
+            value = get<int32_t>(record, pos);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief ColumnarEstimateWriter
+ */
+
+ColumnarEstimateWriter::ColumnarEstimateWriter(const string& filename)
+    : filename(filename)
+{
+    out.open(filename, ios::out | ios::binary | ios::trunc);
+    if (!out.is_open()) throw runtime_error("Error: Cannot write " + filename);
+    out.write(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+    out.write(reinterpret_cast<const char*>(&VERSION), sizeof(VERSION));
+    const vector<pair<string, Type>> layout = {
+        {"frame", Type::INT64}, {"id", Type::STRING}, {"label", Type::STRING},
+        {"face", Type::INT32}, {"track_id", Type::INT32},
+        {"left", Type::INT32}, {"top", Type::INT32}, {"right", Type::INT32}, {"bottom", Type::INT32},
+        {"left_pupil_x", Type::FLOAT64}, {"left_pupil_y", Type::FLOAT64},
+        {"right_pupil_x", Type::FLOAT64}, {"right_pupil_y", Type::FLOAT64},
+        {"lid", Type::FLOAT64}, {"lid_raw", Type::FLOAT64},
+        {"horiz_gaze", Type::FLOAT64}, {"horiz_gaze_raw", Type::FLOAT64},
+        {"vert_gaze", Type::FLOAT64}, {"vert_gaze_raw", Type::FLOAT64},
+        {"mutual_gaze", Type::INT8}, {"lid_closed", Type::INT8},
+        {"landmarks", Type::INT32_LIST}
+    };
+    for (const auto& column : layout) {
+        columns.push_back(Column{column.first, column.second, string(), vector<int64_t>()});
+    }
+}
+
+template<typename T>
+static void append(string& data, T value) {
+    data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void ColumnarEstimateWriter::addRow(const EstimateFrame& frame, const EstimateFace& face)
+{
+    size_t c = 0;
+    append<int64_t>(columns[c++].data, frame.frame);
+    for (const string* value : {&frame.id, &frame.label}) {
+        Column& column = columns[c++];
+        column.data.append(*value);
+        column.ends.push_back(column.data.size());
+    }
+    for (int32_t value : {face.face, face.trackId, face.left, face.top, face.right, face.bottom}) {
+        append(columns[c++].data, value);
+    }
+    for (double value : {face.leftPupilX, face.leftPupilY, face.rightPupilX, face.rightPupilY,
+                         face.lid, face.lidRaw, face.horizGaze, face.horizGazeRaw, face.vertGaze, face.vertGazeRaw}) {
+        append(columns[c++].data, value);
+    }
+    append(columns[c++].data, face.mutualGaze);
+    append(columns[c++].data, face.lidClosed);
+    Column& landmarks = columns[c++];
+    landmarks.data.append(reinterpret_cast<const char*>(face.landmarks.data()), face.landmarks.size()*sizeof(int32_t));
+    landmarks.ends.push_back(landmarks.data.size());
+    rows++;
+}
+
+void ColumnarEstimateWriter::write(const EstimateFrame& frame)
+{
+    static const EstimateFace noFace;
+    if (frame.faces.empty()) addRow(frame, noFace);
+    for (const EstimateFace& face : frame.faces) {
+        addRow(frame, face);
+    }
+    if (rows >= ROW_GROUP_ROWS) flushRowGroup();
+}
+
+void ColumnarEstimateWriter::flushRowGroup()
+{
+    if (!rows) return;
+    RowGroup group;
+    group.rows = rows;
+    for (Column& column : columns) {
+        Chunk chunk;
+        chunk.pos = out.tellp();
+        if (!column.ends.empty()) {
+            out.write(reinterpret_cast<const char*>(column.ends.data()), column.ends.size()*sizeof(int64_t));
+            column.ends.clear();
+        }
+        out.write(column.data.data(), column.data.size());
+        chunk.bytes = static_cast<uint64_t>(out.tellp()) - chunk.pos;
+        column.data.clear();
+        group.chunks.push_back(chunk);
+    }
+    rowGroups.push_back(group);
+    rows = 0;
+}
+
+void ColumnarEstimateWriter::finish()
+{
+    flushRowGroup();
+    string footer;
+    append<uint32_t>(footer, columns.size());
+    for (const Column& column : columns) {
+        append<uint8_t>(footer, static_cast<uint8_t>(column.type));
+        append<uint32_t>(footer, column.name.size());
+        footer.append(column.name);
+    }
+    append<uint32_t>(footer, rowGroups.size());
+    for (const RowGroup& group : rowGroups) {
+        append<uint64_t>(footer, group.rows);
+        for (const Chunk& chunk : group.chunks) {
+            append<uint64_t>(footer, chunk.pos);
+            append<uint64_t>(footer, chunk.bytes);
+        }
+    }
+    append<uint64_t>(footer, footer.size());
+    footer.append(COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+    out.write(footer.data(), footer.size());
+    out.close();
+    if (out.fail()) throw runtime_error("Error: Cannot write " + filename);
+}
+
+/**
+ * @brief AsyncEstimateWriter
+ */
+
+AsyncEstimateWriter::AsyncEstimateWriter(unique_ptr<EstimateWriter> writer, size_t capacity)
+    : writer(std::move(writer)), queue(capacity)
+{
+    writerThread = std::thread(&AsyncEstimateWriter::run, this);
+}
+
+AsyncEstimateWriter::~AsyncEstimateWriter()
+{
+    if (!finished) {
+        try {
+            finish();
+        } catch (std::exception& e) {
+            cerr << e.what() << endl;
+        }
+    }
+}
+
+void AsyncEstimateWriter::write(const EstimateFrame& frame)
+{
+    queue.push(make_shared<EstimateFrame>(frame));
+}
+
+void AsyncEstimateWriter::finish()
+{
+    if (finished) return;
+    finished = true;
+    // an empty frame ends the writer thread
+    queue.push(nullptr);
+    writerThread.join();
+    if (error) rethrow_exception(error);
+}
+
+void AsyncEstimateWriter::run()
+{
+    while (true) {
+        shared_ptr<EstimateFrame> frame = queue.pop();
+        if (!frame) break;
+        // after an error the queue is still drained, so the pipeline never waits for a dead writer
+        if (error) continue;
+        try {
+            writer->write(*frame);
+        } catch (...) {
+            error = current_exception();
+        }
+    }
+    if (error) return;
+    try {
+        writer->finish();
+    } catch (...) {
+        error = current_exception();
+    }
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blockingqueue.h"
+
+class GazeHypList;
+
+/**
+ * @brief Estimates of one face, missing values are NaN.
+ */
+struct EstimateFace {
+    int32_t face = -1;
+    int32_t trackId = -1;
+    // face detection in frame pixels
+    int32_t left = 0, top = 0, right = 0, bottom = 0;
+    double leftPupilX, leftPupilY, rightPupilX, rightPupilY;
+    double lid, lidRaw;
+    double horizGaze, horizGazeRaw;
+    double vertGaze, vertGazeRaw;
+    // -1 if unknown
+    int8_t mutualGaze = -1;
+    int8_t lidClosed = -1;
+    // x and y of every landmark
+    std::vector<int32_t> landmarks;
+    EstimateFace();
+};
+
+/**
+ * @brief Estimates of all faces of a frame.
+ */
+struct EstimateFrame {
+    int64_t frame = 0;
+    std::string id;
+    std::string label;
+    std::vector<EstimateFace> faces;
+    // raw estimates are the estimates before temporal smoothing
+    static EstimateFrame fromHyps(GazeHypList& gazehyps);
+};
+
+/**
+ * @brief Output of the per frame estimates.
+ *
+ * All writers store every face of a frame. In the formats with a row per face a frame without
+ * faces is stored as a single row with face -1, so every frame appears in the output.
+ */
+class EstimateWriter
+{
+public:
+    virtual ~EstimateWriter() {}
+    virtual void write(const EstimateFrame& frame) = 0;
+    // flushes and closes the output, errors of earlier writes are thrown here
+    virtual void finish() = 0;
+
+    // format is tsv, binary or columnar
+    static std::unique_ptr<EstimateWriter> create(const std::string& filename, const std::string& format);
+    static bool isFormat(const std::string& format);
+};
+
+/**
+ * @brief Tab separated values, one row per face, through a large stream buffer.
+ *
+ * The first eight columns are those of the per frame output of earlier versions.
+ */
+class TsvEstimateWriter : public EstimateWriter
+{
+public:
+    TsvEstimateWriter(const std::string& filename);
+    virtual void write(const EstimateFrame& frame);
+    virtual void finish();
+
+private:
+    std::vector<char> buffer;
+    std::ofstream out;
+    std::string filename;
+};
+
+/**
+ * @brief Length prefixed binary records, one per frame, in host byte order.
+ *
+ * The file starts with the magic "GZEST" padded to 8 bytes and a uint32 version. Every frame is
+ *   uint32 record bytes following this field, int64 frame,
+ *   uint32 id length, id, uint32 label length, label, uint32 face count,
+ * and for every face
+ *   int32 face, int32 track id, int32 left, top, right, bottom,
+ *   float64 left pupil x, y, right pupil x, y, lid, raw lid, horizontal gaze, raw horizontal gaze,
+ *   vertical gaze, raw vertical gaze, int8 mutual gaze, int8 lid closed,
+ *   uint32 landmark count, int32 x and y of every landmark.
+ */
+class BinaryEstimateWriter : public EstimateWriter
+{
+public:
+    BinaryEstimateWriter(const std::string& filename);
+    virtual void write(const EstimateFrame& frame);
+    virtual void finish();
+    // reads the next frame of a binary estimate file, false at its end
+    static bool read(std::istream& in, EstimateFrame& frame);
+    static void readHeader(std::istream& in, const std::string& filename);
+
+private:
+    std::vector<char> buffer;
+    std::ofstream out;
+    std::string filename;
+    std::string record;
+};
+
+/**
+ * @brief Columnar file in the spirit of Parquet, one row per face.
+ *
+ * Rows are collected into row groups. Each row group is written as one contiguous chunk per
+ * column: one value per row, or for the strings and the landmark list the int64 byte end offset
+ * of every row followed by the bytes. The footer lists the columns (uint8 type, uint32 name
+ * length, name) and the rows and chunk positions and sizes of every row group, followed by the
+ * uint64 footer size and the magic, so a reader starts at the end of the file and reads only
+ * the columns it needs.
+ */
+class ColumnarEstimateWriter : public EstimateWriter
+{
+public:
+    ColumnarEstimateWriter(const std::string& filename);
+    virtual void write(const EstimateFrame& frame);
+    virtual void finish();
+
+    enum class Type : uint8_t {INT8, INT32, INT64, FLOAT64, STRING, INT32_LIST};
+
+private:
+    struct Column {
+        std::string name;
+        Type type;
+        std::string data;
+        std::vector<int64_t> ends;
+    };
+    struct Chunk {
+        uint64_t pos;
+        uint64_t bytes;
+    };
+    struct RowGroup {
+        uint64_t rows;
+        std::vector<Chunk> chunks;
+    };
+    std::ofstream out;
+    std::string filename;
+    std::vector<Column> columns;
+    std::vector<RowGroup> rowGroups;
+    uint64_t rows = 0;
+    void addRow(const EstimateFrame& frame, const EstimateFace& face);
+    void flushRowGroup();
+};
+
+/**
+ * @brief Hands frames to another writer on a dedicated thread.
+ *
+ * write() only queues the frame, it blocks only while the given number of frames is pending.
+ * Errors of the writer thread are thrown by finish().
+ */
+class AsyncEstimateWriter : public EstimateWriter
+{
+public:
+    AsyncEstimateWriter(std::unique_ptr<EstimateWriter> writer, size_t capacity);
+    virtual ~AsyncEstimateWriter();
+    virtual void write(const EstimateFrame& frame);
+    virtual void finish();
+
+private:
+    std::unique_ptr<EstimateWriter> writer;
+    BlockingQueue<std::shared_ptr<EstimateFrame>> queue;
+    std::exception_ptr error;
+    bool finished = false;
+    std::thread writerThread;
+    void run();
+};
@@ -18,27 +18,39 @@ EyeLidLearner::~EyeLidLearner()
 
 
 void EyeLidLearner::loadClassifier(const string &filename) {
+    if (_loadCompiled(filename)) return;
     ifstream infile(filename, ios::in | ios::binary);
     if (!infile.is_open()) throw dlib::serialization_error("Error: Cannot open " + filename);
     deserialize(normalizer_pca, infile);
     deserialize(decision_function, infile);
+    batchBasis.set_size(0, 0);
+    compiled.reset();
     _initialized = true;
 }
 
-boost::optional<dlib::matrix<double,0,1>> EyeLidLearner::getFeatureVector(GazeHyp& ghyp) {
-    auto result = boost::optional<dlib::matrix<double,0,1>>();
-    if (ghyp.faceFeatures.size() && ghyp.lidFeatures.size()) {
-        result = dlib::join_cols(dlib::rowm(ghyp.faceFeatures, dlib::range(0, ghyp.faceFeatures.nr()-3)), ghyp.lidFeatures);
-    }
-    return result;
+FeatureLayout EyeLidLearner::featureLayout() {
+    FeatureLayout fl;
+    //face features without the pupils
+    fl.ranges = {{FeatureSegment::FACE, 0, 2}, {FeatureSegment::LID, 0, 0}};
+    return fl;
 }
 
 void EyeLidLearner::classify(GazeHyp& ghyp) {
+    if (_classifyCompiled(ghyp, ghyp.eyeLidClassification)) return;
     auto fv = getFeatureVector(ghyp);
     if (!fv.is_initialized() || !decision_function.decision_funct.basis_vectors.size()) return;
     ghyp.eyeLidClassification = decision_function(normalizer_pca(fv.get()));
 }
 
+void EyeLidLearner::classifyBatch(const std::vector<GazeHyp*>& ghyps)
+{
+    for (auto& r : _classifyBatch(ghyps, decision_function.decision_funct, true)) {
+        // same sigmoid as probabilistic_decision_function, compiled models apply it themselves
+        r.first->eyeLidClassification = compiled ? r.second
+                                                 : 1/(1 + std::exp(decision_function.alpha*r.second + decision_function.beta));
+    }
+}
+
 
 void EyeLidLearner::train(const string &outfilename) {
     cerr << "EyeOpenCloseLearner train...." << endl;
@@ -64,6 +76,8 @@ void EyeLidLearner::train(const string &outfilename) {
     cerr << "cross validation accuracy: " << cross_validate_trainer(trainer, samples, labels, 3);
 
     decision_function = train_probabilistic_decision_function(trainer, samples, labels, 3);
+    batchBasis.set_size(0, 0);
+    compiled.reset();
     cerr << "number of support vectors: " << decision_function.decision_funct.basis_vectors.size() << endl;
     ofstream outfile(outfilename, ios::out | ios::binary);
     serialize(normalizer_pca, outfile);
@@ -71,9 +85,21 @@ void EyeLidLearner::train(const string &outfilename) {
 }
 
 
+void EyeLidLearner::compileClassifier(const string &outfilename)
+{
+    CompiledModel::Definition def = _compile(decision_function.decision_funct, true);
+    def.featureSet = -1;
+    def.output = CompiledModel::Output::SIGMOID;
+    def.sigmoidA = decision_function.alpha;
+    def.sigmoidB = decision_function.beta;
+    CompiledModel::write(outfilename, def);
+}
+
+
 void EyeLidLearner::visualize(GazeHyp& ghyp)
 {
-    if (!ghyp.eyeLidClassification.is_initialized() || !decision_function.decision_funct.basis_vectors.size()) return;
+    if (!ghyp.eyeLidClassification.is_initialized()) return;
+    if (!compiled && !decision_function.decision_funct.basis_vectors.size()) return;
     auto eoclass = ghyp.eyeLidClassification.get();
     int color = eoclass > 0.5 ? 255 : 127;
     cv::rectangle(ghyp.eyePatch, cv::Rect(cv::Point(eoclass*(ghyp.eyePatch.cols-1)-1), cv::Size(2, 2)),
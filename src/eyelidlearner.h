@@ -15,7 +15,9 @@ public:
     virtual ~EyeLidLearner();
     virtual void loadClassifier(const std::string& filename);
     virtual void classify(GazeHyp &ghyp);
+    virtual void classifyBatch(const std::vector<GazeHyp*>& ghyps);
     virtual void train(const std::string &outfilename);
+    virtual void compileClassifier(const std::string& outfilename);
     virtual void visualize(GazeHyp& ghyp);
     virtual std::string getId();
 
@@ -24,5 +26,5 @@ protected:
     typedef dlib::decision_function<kernel_type> dec_funct_type;
     typedef dlib::probabilistic_decision_function<kernel_type> probabilistic_funct_type;
     probabilistic_funct_type decision_function;
-    boost::optional<dlib::matrix<double,0,1>> getFeatureVector(GazeHyp& ghyp);
+    FeatureLayout featureLayout();
 };
@@ -1,17 +1,71 @@
 #include "facedetectionworker.h"
+#include "trace.h"
 
 #include <dlib/threads.h>
 #include <dlib/image_processing/frontal_face_detector.h>
 #include <dlib/image_processing.h>
+#include <dlib/opencv.h>
 #include <iostream>
 #include <thread>
 #include <future>
 #include <memory>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
 
 using namespace std;
 
-FaceDetectionWorker::FaceDetectionWorker(std::unique_ptr<ImageProvider> imgprovider, int threadcount)
-    : _detector(dlib::get_frontal_face_detector()), imgprovider(std::move(imgprovider)), _hypsqueue(threadcount), _workqueue(threadcount) {
+//region searched around a tracked face, relative to its size
+static constexpr double TRACKING_PADDING = 0.5;
+
+//split detection: pyramid levels per band and number of bands, the last band scans all remaining levels
+static constexpr int LEVELS_PER_BAND = 2;
+static constexpr int SPLIT_BANDS = 3;
+//fhog cell size, strips start on the cell grid of the full frame
+static constexpr long CELL_SIZE = 8;
+//frames held by the consumer and the gui, in addition to the frames queued in the stages
+static constexpr int FRAME_POOL_SLACK = 4;
+//scale step between the levels of the detector's image pyramid
+static constexpr double LEVEL_SCALE = 6.0/5.0;
+
+FaceDetectionWorker::FaceDetectionWorker(std::unique_ptr<ImageProvider> imgprovider, int threadcount,
+                                         int keyframeInterval, double minTrackingConfidence, int detectionSplit,
+                                         int detectionScale, int minFaceSize, int maxFaceSize)
+    : _detector(dlib::get_frontal_face_detector()), imgprovider(std::move(imgprovider)),
+      framePool(FRAME_POOL_SLACK + 4*threadcount), _hypsqueue(threadcount), _workqueue(threadcount),
+      keyframeInterval(keyframeInterval), minTrackingConfidence(minTrackingConfidence), detectionSplit(detectionSplit) {
+    while ((2 << halvings) <= detectionScale) halvings++;
+    //face size found on pyramid level 0 of the detection image, measured in frame pixels
+    const double levelFaceSize = (1 << halvings) * _detector.get_scanner().get_detection_window_width();
+    if (minFaceSize > levelFaceSize) {
+        skippedLevels = std::floor(std::log(minFaceSize/levelFaceSize) / std::log(LEVEL_SCALE));
+    }
+    //0 keeps the scanner's own limit
+    unsigned long levelCount = 0;
+    if (maxFaceSize > 0) {
+        long lastLevel = std::ceil(std::log(maxFaceSize/levelFaceSize) / std::log(LEVEL_SCALE));
+        levelCount = std::max(1L, lastLevel - static_cast<long>(skippedLevels) + 1);
+    }
+    std::vector<dlib::frontal_face_detector::feature_vector_type> w;
+    for (unsigned long i = 0; i < _detector.num_detectors(); i++) {
+        w.push_back(_detector.get_w(i));
+    }
+    auto limitedDetector = [this, &w](unsigned long levels) {
+        auto scanner = _detector.get_scanner();
+        if (levels) scanner.set_max_pyramid_levels(levels);
+        return dlib::frontal_face_detector(scanner, _detector.get_overlap_tester(), w);
+    };
+    if (levelCount) _detector = limitedDetector(levelCount);
+    if (detectionSplit > 0) {
+        for (int band = 0; band < SPLIT_BANDS; band++) {
+            unsigned long first = band*LEVELS_PER_BAND;
+            if (levelCount && first >= levelCount) break;
+            unsigned long levels = band < SPLIT_BANDS - 1 ? LEVELS_PER_BAND : 0;
+            if (levelCount) levels = std::min(levelCount - first, levels ? levels : levelCount);
+            bandDetectors.push_back(limitedDetector(levels));
+        }
+        splitScheduler.reset(new TaskScheduler(threadcount));
+    }
     register_thread(*this, &FaceDetectionWorker::thread);
     for (int i = 0; i < threadcount; i++) {
         register_thread(*this, &FaceDetectionWorker::detectfaces);
@@ -26,40 +80,220 @@ FaceDetectionWorker::~FaceDetectionWorker() {
     wait();
 }
 
-BlockingQueue<GazeHypsPtr>& FaceDetectionWorker::hypsqueue()
+GazeHypsQueue& FaceDetectionWorker::hypsqueue()
 {
     return _hypsqueue;
 }
 
+// Re-detects the most recently tracked faces in padded regions around their last position.
+// Returns false if a face was lost or its confidence dropped, a full detection is required then.
+// New faces are only picked up by the next keyframe.
+bool FaceDetectionWorker::trackfaces(dlib::frontal_face_detector& detector, const cv::Mat& img,
+                                     std::vector<dlib::rectangle>& faces) {
+    std::vector<FaceTracker::Track> tracks;
+    {
+        lock_guard<mutex> lock(trackermutex);
+        tracks = tracker.tracks();
+    }
+    const dlib::rectangle imgrect(img.cols, img.rows);
+    for (const auto& track : tracks) {
+        if (track.missed) continue;
+        const dlib::rectangle roi = imgrect.intersect(toDetection(dlib::grow_rect(track.rect,
+                                    TRACKING_PADDING*std::max(track.rect.width(), track.rect.height()))));
+        if (roi.is_empty()) return false;
+        const cv::Rect roirect(roi.left(), roi.top(), roi.width(), roi.height());
+        std::vector<std::pair<double, dlib::rectangle>> dets;
+        //scores on the gray image are comparable to those of the keyframe detections
+        detector(dlib::cv_image<unsigned char>(img(roirect)), dets);
+        auto best = std::max_element(dets.begin(), dets.end(),
+                [](const std::pair<double, dlib::rectangle>& a, const std::pair<double, dlib::rectangle>& b) {
+                    return a.first < b.first;
+                });
+        if (best == dets.end() || best->first < minTrackingConfidence) return false;
+        faces.push_back(toFrame(dlib::translate_rect(best->second, roi.tl_corner())));
+    }
+    return true;
+}
+
+// Returns the image the detector scans: the frame downscaled by the detection scale and by
+// the pyramid levels skipped for the minimum face size. Valid until the next call of the thread.
+cv::Mat FaceDetectionWorker::detectionImage(const cv::Mat& grayframe) const {
+    static thread_local dlib::array2d<unsigned char> levels[2];
+    cv::Mat level = grayframe;
+    unsigned int i = 0;
+    for (unsigned int h = 0; h < halvings; h++, i++) {
+        dlib::pyramid_down<2>()(dlib::cv_image<unsigned char>(level), levels[i % 2]);
+        level = dlib::toMat(levels[i % 2]);
+    }
+    for (unsigned int l = 0; l < skippedLevels; l++, i++) {
+        dlib::pyramid_down<6>()(dlib::cv_image<unsigned char>(level), levels[i % 2]);
+        level = dlib::toMat(levels[i % 2]);
+    }
+    return level;
+}
+
+dlib::rectangle FaceDetectionWorker::toDetection(const dlib::rectangle& rect) const {
+    return dlib::pyramid_down<6>().rect_down(dlib::pyramid_down<2>().rect_down(rect, halvings), skippedLevels);
+}
+
+dlib::rectangle FaceDetectionWorker::toFrame(const dlib::rectangle& rect) const {
+    return dlib::pyramid_down<2>().rect_up(dlib::pyramid_down<6>().rect_up(rect, skippedLevels), halvings);
+}
+
+// Runs one full frame detection as parallel parts: the finest pyramid levels, which take about
+// half of the scan, in overlapping horizontal strips, every coarser band of levels on the frame
+// downscaled to its first level. The parts are merged with the detector's own overlap test.
+// Strips start on the cell grid of all their levels, only detections crossing a strip seam can
+// score marginally different than in a single scan.
+std::vector<dlib::rectangle> FaceDetectionWorker::detectSplit(const cv::Mat& img) {
+    typedef std::pair<double, dlib::rectangle> Detection;
+    //every thread of the scheduler scans with its own copies
+    static thread_local std::vector<dlib::frontal_face_detector> detectors;
+    mutex resultmutex;
+    condition_variable finished;
+    bool done = false;
+    std::vector<Detection> detections;
+    auto addDetections = [&](const std::vector<Detection>& dets) {
+        lock_guard<mutex> lock(resultmutex);
+        detections.insert(detections.end(), dets.begin(), dets.end());
+    };
+    auto localDetector = [this](int band) -> dlib::frontal_face_detector& {
+        if (detectors.empty()) detectors = bandDetectors;
+        return detectors[band];
+    };
+    TaskJoin::Ptr join = TaskJoin::create([&]() {
+        //notify under the lock, the waiting thread may return right after
+        lock_guard<mutex> lock(resultmutex);
+        done = true;
+        finished.notify_one();
+    });
+
+    //a strip top maps to row top*(5/6)^l on pyramid level l, strips start where this lies on the
+    //cell grid of every level they scan, so their windows score exactly like in a single scan
+    long stripAlignment = CELL_SIZE;
+    for (int l = 1; l < LEVELS_PER_BAND; l++) stripAlignment *= 6;
+    //a face starting in a strip has to fit into the strip's overlap at the largest scale of the band
+    const double bandScale = std::pow(6.0/5.0, LEVELS_PER_BAND - 1);
+    const long overlap = std::ceil(bandScale*_detector.get_scanner().get_detection_window_height()) + CELL_SIZE;
+    const long stripHeight = (img.rows + detectionSplit - 1) / detectionSplit;
+    for (int strip = 0; strip < detectionSplit; strip++) {
+        const long top = strip*stripHeight / stripAlignment * stripAlignment;
+        const long bottom = std::min<long>(img.rows, (strip + 1)*stripHeight + overlap);
+        if (top >= bottom) break;
+        join->add();
+        splitScheduler->spawn([&, join, top, bottom]() {
+            Trace::Scope scope("detect_strip");
+            const cv::Mat strip(img, cv::Rect(0, top, img.cols, bottom - top));
+            std::vector<Detection> dets;
+            localDetector(0)(dlib::cv_image<unsigned char>(strip), dets);
+            for (auto& det : dets) det.second = dlib::translate_rect(det.second, 0, top);
+            addDetections(dets);
+            join->done();
+        });
+    }
+    for (int band = 1; band < static_cast<int>(bandDetectors.size()); band++) {
+        join->add();
+        splitScheduler->spawn([&, join, band]() {
+            Trace::Scope scope("detect_band");
+            //the same image pyramid the scanner builds internally
+            dlib::pyramid_down<6> pyr;
+            dlib::array2d<unsigned char> levels[2];
+            cv::Mat level = img;
+            for (int l = 0; l < band*LEVELS_PER_BAND; l++) {
+                pyr(dlib::cv_image<unsigned char>(level), levels[l % 2]);
+                level = dlib::toMat(levels[l % 2]);
+            }
+            std::vector<Detection> dets;
+            localDetector(band)(dlib::cv_image<unsigned char>(level), dets);
+            for (auto& det : dets) det.second = pyr.rect_up(det.second, band*LEVELS_PER_BAND);
+            addDetections(dets);
+            join->done();
+        });
+    }
+    join->done();
+    unique_lock<mutex> lock(resultmutex);
+    finished.wait(lock, [&done]() { return done; });
+    return mergeDetections(detections);
+}
+
+// Greedy non-max suppression over the parts, strongest detections first.
+std::vector<dlib::rectangle> FaceDetectionWorker::mergeDetections(std::vector<std::pair<double, dlib::rectangle>>& detections) const {
+    std::sort(detections.begin(), detections.end(),
+              [](const std::pair<double, dlib::rectangle>& a, const std::pair<double, dlib::rectangle>& b) {
+                  return a.first > b.first;
+              });
+    const dlib::test_box_overlap overlaps = _detector.get_overlap_tester();
+    std::vector<dlib::rectangle> faces;
+    for (const auto& det : detections) {
+        bool suppressed = std::any_of(faces.begin(), faces.end(),
+                                      [&](const dlib::rectangle& face) { return overlaps(face, det.second); });
+        if (!suppressed) faces.push_back(det.second);
+    }
+    return faces;
+}
+
 void FaceDetectionWorker::detectfaces() {
     //working with thread individual copy, since the detector is not thread safe.
     dlib::frontal_face_detector detector = _detector;
+    Trace::setThreadName("detection");
     try {
         while (true) {
-            GazeHypsPtr gazehyps = _workqueue.pop();
-            const auto faceDetections = detector(gazehyps->dlibimage);
+            GazeHypsPtr gazehyps;
+            {
+                Trace::Scope scope("wait_input");
+                gazehyps = _workqueue.pop();
+            }
+            Trace::Scope scope("detect", gazehyps->sequence);
+            const auto start = Metrics::now();
+            Metrics::record(Stage::DETECTION_WAIT, gazehyps->stageTime, start);
+            const cv::Mat img = detectionImage(gazehyps->grayframe);
+            std::vector<dlib::rectangle> faceDetections;
+            if (gazehyps->keyframe || !trackfaces(detector, img, faceDetections)) {
+                faceDetections = splitScheduler ? detectSplit(img) : detector(dlib::cv_image<unsigned char>(img));
+                for (auto& facerect : faceDetections) facerect = toFrame(facerect);
+            }
+            if (keyframeInterval > 1) {
+                //frames finish out of order, tracks follow the most recent result.
+                //persistent ids are assigned in frame order by the consumer.
+                lock_guard<mutex> lock(trackermutex);
+                tracker.update(faceDetections);
+            }
             for (const auto& facerect : faceDetections) {
                 GazeHyp ghyp(*gazehyps);
                 ghyp.faceDetection = facerect;
                 gazehyps->addGazeHyp(ghyp);
             }
+            gazehyps->stageTime = Metrics::now();
+            Metrics::record(Stage::DETECTION, start, gazehyps->stageTime);
             gazehyps->setready(-1);
         }
     } catch (QueueInterruptedException) {}
 }
 
 void FaceDetectionWorker::thread() {
+    long frameCount = 0;
+    Trace::setThreadName("capture");
     try {
         while (!should_stop()) {
-            GazeHypsPtr ghyps(new GazeHypList());
+            GazeHypsPtr ghyps = framePool.acquire();
             ghyps->setready(1);
-            _hypsqueue.waitAccept();
-            _workqueue.waitAccept();
+            {
+                Trace::Scope scope("wait_accept");
+                _hypsqueue.waitAccept();
+                _workqueue.waitAccept();
+            }
+            Trace::Scope scope("capture", frameCount);
+            const auto start = Metrics::now();
             if (imgprovider->get(ghyps->frame)) {
                 ghyps->frameTime = std::chrono::system_clock::now();
                 ghyps->label = imgprovider->getLabel();
                 ghyps->id = imgprovider->getId();
-                dlib::assign_image(ghyps->dlibimage, dlib::cv_image<dlib::bgr_pixel>(ghyps->frame));
+                ghyps->droppedFrames = imgprovider->droppedFrames();
+                ghyps->keyframe = keyframeInterval <= 1 || frameCount % keyframeInterval == 0;
+                ghyps->sequence = frameCount++;
+                ImageProvider::toGray(ghyps->frame, ghyps->grayframe);
+                ghyps->captureTime = ghyps->stageTime = Metrics::now();
+                Metrics::record(Stage::CAPTURE, start, ghyps->captureTime);
                 _workqueue.push(ghyps);
                 _hypsqueue.push(ghyps);
             } else {
@@ -1,22 +1,47 @@
 #pragma once
 
+#include <mutex>
+#include <memory>
+#include <vector>
 #include <dlib/threads.h>
 #include "imageprovider.h"
 #include "gazehyps.h"
-#include "blockingqueue.h"
+#include "facetracker.h"
+#include "taskscheduler.h"
 
 class FaceDetectionWorker : public dlib::multithreaded_object
 {
 public:
-    FaceDetectionWorker(std::unique_ptr<ImageProvider> imgprovider, int threadcount);
+    FaceDetectionWorker(std::unique_ptr<ImageProvider> imgprovider, int threadcount,
+                        int keyframeInterval = 1, double minTrackingConfidence = 0.3, int detectionSplit = 0,
+                        int detectionScale = 1, int minFaceSize = 0, int maxFaceSize = 0);
     ~FaceDetectionWorker();
-    BlockingQueue<GazeHypsPtr>& hypsqueue();
+    GazeHypsQueue& hypsqueue();
 
 private:
     void thread();
     void detectfaces();
+    bool trackfaces(dlib::frontal_face_detector& detector, const cv::Mat& img,
+                    std::vector<dlib::rectangle>& faces);
+    cv::Mat detectionImage(const cv::Mat& grayframe) const;
+    dlib::rectangle toDetection(const dlib::rectangle& rect) const;
+    dlib::rectangle toFrame(const dlib::rectangle& rect) const;
+    std::vector<dlib::rectangle> detectSplit(const cv::Mat& img);
+    std::vector<dlib::rectangle> mergeDetections(std::vector<std::pair<double, dlib::rectangle>>& detections) const;
     dlib::frontal_face_detector _detector;
     std::unique_ptr<ImageProvider> imgprovider;
-    BlockingQueue<GazeHypsPtr> _hypsqueue;
-    BlockingQueue<GazeHypsPtr> _workqueue;
+    GazeHypListPool framePool;
+    GazeHypsQueue _hypsqueue;
+    GazeHypsQueue _workqueue;
+    int keyframeInterval;
+    double minTrackingConfidence;
+    //detection runs on the frame halved this many times, minus the pyramid levels too fine for the smallest face
+    unsigned int halvings = 0;
+    unsigned int skippedLevels = 0;
+    std::mutex trackermutex;
+    FaceTracker tracker;
+    //intra-frame parallel detection, see detectSplit()
+    int detectionSplit;
+    std::vector<dlib::frontal_face_detector> bandDetectors;
+    std::unique_ptr<TaskScheduler> splitScheduler;
 };
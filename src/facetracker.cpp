@@ -0,0 +1,70 @@
+#include "facetracker.h"
+
+#include <algorithm>
+#include <tuple>
+
+using namespace std;
+
+FaceTracker::FaceTracker(double minOverlap, int maxMissed)
+    : minOverlap(minOverlap), maxMissed(maxMissed)
+{
+}
+
+double FaceTracker::iou(const dlib::rectangle& a, const dlib::rectangle& b)
+{
+    double inter = a.intersect(b).area();
+    double uni = a.area() + b.area() - inter;
+    return uni > 0 ? inter / uni : 0;
+}
+
+vector<int> FaceTracker::update(const vector<dlib::rectangle>& faces)
+{
+    // all pairs above the minimum overlap, best matches are assigned first
+    vector<tuple<double, size_t, size_t>> pairs;
+    for (size_t f = 0; f < faces.size(); f++) {
+        for (size_t t = 0; t < _tracks.size(); t++) {
+            double overlap = iou(faces[f], _tracks[t].rect);
+            if (overlap >= minOverlap) pairs.push_back(make_tuple(overlap, f, t));
+        }
+    }
+    sort(pairs.begin(), pairs.end(), [](const tuple<double, size_t, size_t>& a, const tuple<double, size_t, size_t>& b) {
+        return get<0>(a) > get<0>(b);
+    });
+    vector<int> ids(faces.size(), -1);
+    vector<bool> trackUsed(_tracks.size(), false);
+    for (const auto& p : pairs) {
+        size_t f = get<1>(p);
+        size_t t = get<2>(p);
+        if (ids[f] != -1 || trackUsed[t]) continue;
+        ids[f] = _tracks[t].id;
+        trackUsed[t] = true;
+        _tracks[t].rect = faces[f];
+        _tracks[t].missed = 0;
+    }
+    for (size_t t = 0; t < _tracks.size(); t++) {
+        if (!trackUsed[t]) _tracks[t].missed++;
+    }
+    _tracks.erase(remove_if(_tracks.begin(), _tracks.end(), [this](const Track& t) {
+        return t.missed > maxMissed;
+    }), _tracks.end());
+    for (size_t f = 0; f < faces.size(); f++) {
+        if (ids[f] != -1) continue;
+        ids[f] = nextId++;
+        Track track;
+        track.id = ids[f];
+        track.rect = faces[f];
+        track.missed = 0;
+        _tracks.push_back(track);
+    }
+    return ids;
+}
+
+const vector<FaceTracker::Track>& FaceTracker::tracks() const
+{
+    return _tracks;
+}
+
+void FaceTracker::clear()
+{
+    _tracks.clear();
+}
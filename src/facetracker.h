@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include <dlib/geometry.h>
+
+/**
+ * @brief Assigns persistent ids to face rectangles by greedy IoU matching
+ * against the faces of the previous update.
+ */
+class FaceTracker
+{
+public:
+    struct Track {
+        int id;
+        dlib::rectangle rect;
+        int missed;
+    };
+
+    FaceTracker(double minOverlap = 0.3, int maxMissed = 5);
+    std::vector<int> update(const std::vector<dlib::rectangle>& faces);
+    const std::vector<Track>& tracks() const;
+    void clear();
+    static double iou(const dlib::rectangle& a, const dlib::rectangle& b);
+
+private:
+    double minOverlap;
+    int maxMissed;
+    int nextId = 0;
+    std::vector<Track> _tracks;
+};
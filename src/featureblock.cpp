@@ -0,0 +1,116 @@
+#include "featureblock.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+static constexpr size_t CHUNK_SIZE = 16384;
+
+double* FeatureArena::allocate(size_t n)
+{
+    lock_guard<std::mutex> lock(mutex);
+    while (current < chunks.size() && used + n > chunks[current].size) {
+        current++;
+        used = 0;
+    }
+    if (current == chunks.size()) {
+        Chunk chunk;
+        chunk.size = max(CHUNK_SIZE, n);
+        chunk.data.reset(new double[chunk.size]);
+        chunks.push_back(std::move(chunk));
+        used = 0;
+    }
+    double* result = chunks[current].data.get() + used;
+    used += n;
+    return result;
+}
+
+void FeatureArena::reset()
+{
+    lock_guard<std::mutex> lock(mutex);
+    current = 0;
+    used = 0;
+}
+
+FeatureBlock::Writer::Writer(FeatureBlock& block, FeatureSegment segment)
+    : block(block), segment(segment)
+{
+}
+
+void FeatureBlock::Writer::push_back(double value)
+{
+    const int s = static_cast<int>(segment);
+    if (!block.block || count >= block.size(segment)) {
+        throw logic_error("feature segment " + to_string(s) + " overflows its block");
+    }
+    block.block[block.offsets[s] + count++] = value;
+}
+
+void FeatureBlock::Writer::commit()
+{
+    if (count != block.size(segment)) {
+        throw logic_error("feature segment " + to_string(static_cast<int>(segment)) + " is incomplete");
+    }
+    block.present[static_cast<int>(segment)] = true;
+}
+
+void FeatureBlock::allocate(FeatureArena& arena, const Sizes& sizes)
+{
+    offsets[0] = 0;
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+        offsets[s + 1] = offsets[s] + sizes[s];
+    }
+    block = arena.allocate(offsets[FEATURE_SEGMENTS]);
+    present.fill(false);
+}
+
+void FeatureBlock::assign(FeatureSegment segment, const double* values)
+{
+    const int s = static_cast<int>(segment);
+    if (!block) throw logic_error("feature segment " + to_string(s) + " assigned before allocation");
+    std::copy(values, values + size(segment), block + offsets[s]);
+    present[s] = true;
+}
+
+bool FeatureBlock::has(FeatureSegment segment) const
+{
+    return present[static_cast<int>(segment)];
+}
+
+long FeatureBlock::size(FeatureSegment segment) const
+{
+    const int s = static_cast<int>(segment);
+    return offsets[s + 1] - offsets[s];
+}
+
+const double* FeatureBlock::data(FeatureSegment segment) const
+{
+    return block + offsets[static_cast<int>(segment)];
+}
+
+bool FeatureLayout::available(const FeatureBlock& features) const
+{
+    for (FeatureSegment segment : required) {
+        if (!features.has(segment)) return false;
+    }
+    return std::all_of(ranges.begin(), ranges.end(),
+                       [&features](const FeatureRange& r) { return features.has(r.segment); });
+}
+
+long FeatureLayout::size(const FeatureBlock& features) const
+{
+    long n = 0;
+    for (const auto& r : ranges) {
+        n += features.size(r.segment) - r.begin - r.dropLast;
+    }
+    return n;
+}
+
+void FeatureLayout::gather(const FeatureBlock& features, double* out) const
+{
+    for (const auto& r : ranges) {
+        const double* src = features.data(r.segment);
+        out = std::copy(src + r.begin, src + features.size(r.segment) - r.dropLast, out);
+    }
+}
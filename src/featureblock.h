@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+enum class FeatureSegment {FACE, LID, HORIZ_GAZE, VERT_GAZE, EYE_HOG};
+static constexpr int FEATURE_SEGMENTS = 5;
+
+/**
+ * @brief Bump allocator for the feature blocks of one frame.
+ *
+ * Chunks are kept when the arena is reset, so a recycled frame stores the features
+ * of its faces without new allocations. Faces allocate concurrently.
+ */
+class FeatureArena
+{
+public:
+    double* allocate(size_t n);
+    void reset();
+
+private:
+    struct Chunk {
+        std::unique_ptr<double[]> data;
+        size_t size;
+    };
+    std::mutex mutex;
+    std::vector<Chunk> chunks;
+    size_t current = 0;
+    size_t used = 0;
+};
+
+/**
+ * @brief All features of one face in a single block, one segment per extractor.
+ *
+ * The segment sizes are fixed when the block is allocated, extractors running in
+ * parallel fill disjoint segments.
+ */
+class FeatureBlock
+{
+public:
+    typedef std::array<long, FEATURE_SEGMENTS> Sizes;
+
+    // sequential writer for one segment, the segment is present once it is complete
+    class Writer {
+    public:
+        Writer(FeatureBlock& block, FeatureSegment segment);
+        void push_back(double value);
+        void commit();
+    private:
+        FeatureBlock& block;
+        FeatureSegment segment;
+        long count = 0;
+    };
+
+    void allocate(FeatureArena& arena, const Sizes& sizes);
+    // copies a complete segment
+    void assign(FeatureSegment segment, const double* values);
+    bool has(FeatureSegment segment) const;
+    long size(FeatureSegment segment) const;
+    const double* data(FeatureSegment segment) const;
+
+private:
+    double* block = nullptr;
+    std::array<long, FEATURE_SEGMENTS + 1> offsets{};
+    std::array<bool, FEATURE_SEGMENTS> present{};
+};
+
+// rows [begin, size - dropLast) of a segment
+struct FeatureRange {
+    FeatureSegment segment;
+    long begin;
+    long dropLast;
+};
+
+/**
+ * @brief Which segments form a learner's feature vector, precomputed for its feature set.
+ */
+struct FeatureLayout {
+    std::vector<FeatureSegment> required;
+    std::vector<FeatureRange> ranges;
+
+    bool available(const FeatureBlock& features) const;
+    long size(const FeatureBlock& features) const;
+    void gather(const FeatureBlock& features, double* out) const;
+};
@@ -0,0 +1,315 @@
+#include "featurecache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const char MAGIC[8] = {'G', 'Z', 'F', 'E', 'A', 'T', 'S', '\0'};
+static constexpr uint32_t VERSION = 1;
+// bump whenever the features computed for an image change
+static constexpr uint32_t PIPELINE_VERSION = 1;
+static constexpr size_t ALIGNMENT = 64;
+
+static size_t alignedPos(size_t pos) {
+    return (pos + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+bool FeatureCache::isCache(const string& filename)
+{
+    ifstream infile(filename, ios::in | ios::binary);
+    char magic[sizeof(MAGIC)];
+    return infile.read(magic, sizeof(magic)) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+FeatureCache::FileStamp FeatureCache::stamp(const string& filename)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) throw runtime_error("Error: Cannot stat " + filename);
+    FileStamp result;
+    result.mtime = static_cast<int64_t>(st.st_mtim.tv_sec)*1000000000 + st.st_mtim.tv_nsec;
+    result.size = st.st_size;
+    return result;
+}
+
+uint64_t FeatureCache::pipelineKey(const string& settings)
+{
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const char* data, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ull;
+        }
+    };
+    mix(reinterpret_cast<const char*>(&PIPELINE_VERSION), sizeof(PIPELINE_VERSION));
+    mix(settings.data(), settings.size());
+    return hash;
+}
+
+FeatureCache::FeatureCache(const string& filename)
+    : file(new MappedFile(filename))
+{
+    if (file->size() < sizeof(Header)) throw runtime_error("Error: Truncated feature cache " + filename);
+    header = reinterpret_cast<const Header*>(file->data());
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION) {
+        throw runtime_error("Error: Unsupported feature cache " + filename);
+    }
+    auto section = [this, &filename](uint64_t pos, uint64_t bytes) {
+        if (pos % ALIGNMENT || pos + bytes > file->size() || pos + bytes < pos) {
+            throw runtime_error("Error: Corrupt feature cache " + filename);
+        }
+        return file->data() + pos;
+    };
+    entryRecords = reinterpret_cast<const EntryRecord*>(section(header->entriesPos, header->entries*sizeof(EntryRecord)));
+    rowRecords = reinterpret_cast<const RowRecord*>(section(header->rowsPos, header->rows*sizeof(RowRecord)));
+    strings = section(header->stringsPos, 0);
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+        columns[s] = reinterpret_cast<const double*>(section(header->columnsPos[s],
+                                                             header->rows*header->widths[s]*sizeof(double)));
+    }
+    for (size_t e = 0; e < header->entries; e++) {
+        const EntryRecord& r = entryRecords[e];
+        section(header->stringsPos, r.pathPos + r.pathLength);
+        section(header->stringsPos, r.labelPos + r.labelLength);
+        if (r.firstRow + r.rowCount > header->rows) {
+            throw runtime_error("Error: Corrupt feature cache " + filename);
+        }
+        index[path(e)] = e;
+    }
+}
+
+uint64_t FeatureCache::key() const
+{
+    return header->pipelineKey;
+}
+
+size_t FeatureCache::entryCount() const
+{
+    return header->entries;
+}
+
+size_t FeatureCache::rowCount() const
+{
+    return header->rows;
+}
+
+long FeatureCache::find(const string& filename, const FileStamp& stamp) const
+{
+    auto it = index.find(filename);
+    if (it == index.end() || !(fileStamp(it->second) == stamp)) return -1;
+    return it->second;
+}
+
+string FeatureCache::path(size_t entry) const
+{
+    const EntryRecord& r = entryRecords[entry];
+    return string(strings + r.pathPos, r.pathLength);
+}
+
+string FeatureCache::label(size_t entry) const
+{
+    const EntryRecord& r = entryRecords[entry];
+    return string(strings + r.labelPos, r.labelLength);
+}
+
+FeatureCache::FileStamp FeatureCache::fileStamp(size_t entry) const
+{
+    FileStamp result;
+    result.mtime = entryRecords[entry].mtime;
+    result.size = entryRecords[entry].fileSize;
+    return result;
+}
+
+size_t FeatureCache::firstRow(size_t entry) const
+{
+    return entryRecords[entry].firstRow;
+}
+
+size_t FeatureCache::rows(size_t entry) const
+{
+    return entryRecords[entry].rowCount;
+}
+
+size_t FeatureCache::rowEntry(size_t row) const
+{
+    return rowRecords[row].entry;
+}
+
+const double* FeatureCache::value(size_t row, int segment) const
+{
+    return columns[segment] + row*header->widths[segment];
+}
+
+void FeatureCache::load(size_t row, FeatureArena& arena, FeatureBlock& block) const
+{
+    FeatureBlock::Sizes sizes;
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) sizes[s] = header->widths[s];
+    block.allocate(arena, sizes);
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+        if (rowRecords[row].present & (1u << s)) {
+            block.assign(static_cast<FeatureSegment>(s), value(row, s));
+        }
+    }
+}
+
+/**
+ * @brief FeatureCache::Writer::Writer
+ */
+
+FeatureCache::Writer::Writer(const string& filename, uint64_t key)
+    : filename(filename), cacheKey(key)
+{
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+        columns[s].open(columnFile(s), ios::out | ios::binary | ios::trunc);
+        if (!columns[s].is_open()) throw runtime_error("Error: Cannot write " + columnFile(s));
+    }
+}
+
+FeatureCache::Writer::~Writer()
+{
+    if (!finished) {
+        for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+            columns[s].close();
+            remove(columnFile(s).c_str());
+        }
+    }
+}
+
+string FeatureCache::Writer::columnFile(int segment) const
+{
+    return filename + ".column" + to_string(segment);
+}
+
+void FeatureCache::Writer::setWidths(const array<uint64_t, FEATURE_SEGMENTS>& sizes)
+{
+    if (!haveWidths) {
+        widths = sizes;
+        haveWidths = true;
+        zeros.assign(*max_element(widths.begin(), widths.end()), 0.0);
+    } else if (widths != sizes) {
+        throw runtime_error("Error: Feature sizes differ from the other entries of " + filename);
+    }
+}
+
+void FeatureCache::Writer::writeRow(const array<const double*, FEATURE_SEGMENTS>& segments, uint32_t mask)
+{
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+        const double* values = (mask & (1u << s)) ? segments[s] : zeros.data();
+        columns[s].write(reinterpret_cast<const char*>(values), widths[s]*sizeof(double));
+    }
+    present.push_back(mask);
+}
+
+void FeatureCache::Writer::add(const string& path, const string& label, const FileStamp& stamp,
+                               const vector<const FeatureBlock*>& faces)
+{
+    entries.push_back(Entry{path, label, stamp, present.size(), faces.size()});
+    for (const FeatureBlock* features : faces) {
+        array<uint64_t, FEATURE_SEGMENTS> sizes;
+        array<const double*, FEATURE_SEGMENTS> segments;
+        uint32_t mask = 0;
+        for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+            const FeatureSegment segment = static_cast<FeatureSegment>(s);
+            sizes[s] = features->size(segment);
+            segments[s] = features->data(segment);
+            if (features->has(segment)) mask |= 1u << s;
+        }
+        setWidths(sizes);
+        writeRow(segments, mask);
+    }
+}
+
+void FeatureCache::Writer::add(const FeatureCache& cache, size_t entry, const string& label)
+{
+    entries.push_back(Entry{cache.path(entry), label, cache.fileStamp(entry),
+                            present.size(), cache.rows(entry)});
+    if (!cache.rows(entry)) return;
+    setWidths(array<uint64_t, FEATURE_SEGMENTS>{{cache.header->widths[0], cache.header->widths[1],
+            cache.header->widths[2], cache.header->widths[3], cache.header->widths[4]}});
+    for (size_t row = cache.firstRow(entry); row < cache.firstRow(entry) + cache.rows(entry); row++) {
+        array<const double*, FEATURE_SEGMENTS> segments;
+        for (int s = 0; s < FEATURE_SEGMENTS; s++) segments[s] = cache.value(row, s);
+        writeRow(segments, cache.rowRecords[row].present);
+    }
+}
+
+void FeatureCache::Writer::finish()
+{
+    for (auto& column : columns) {
+        column.close();
+        if (column.fail()) throw runtime_error("Error: Cannot write feature columns of " + filename);
+    }
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.pipelineKey = cacheKey;
+    header.entries = entries.size();
+    header.rows = present.size();
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) header.widths[s] = widths[s];
+
+    vector<EntryRecord> records;
+    string stringData;
+    for (const Entry& e : entries) {
+        EntryRecord r;
+        r.pathPos = stringData.size();
+        r.pathLength = e.path.size();
+        stringData += e.path;
+        r.labelPos = stringData.size();
+        r.labelLength = e.label.size();
+        stringData += e.label;
+        r.mtime = e.stamp.mtime;
+        r.fileSize = e.stamp.size;
+        r.firstRow = e.firstRow;
+        r.rowCount = e.rowCount;
+        records.push_back(r);
+    }
+    vector<RowRecord> rowRecords;
+    for (size_t row = 0; row < present.size(); row++) {
+        uint32_t entry = upper_bound(entries.begin(), entries.end(), row,
+                                     [](size_t r, const Entry& e) { return r < e.firstRow; }) - entries.begin() - 1;
+        rowRecords.push_back(RowRecord{entry, present[row]});
+    }
+    header.entriesPos = alignedPos(sizeof(Header));
+    header.stringsPos = alignedPos(header.entriesPos + records.size()*sizeof(EntryRecord));
+    header.rowsPos = alignedPos(header.stringsPos + stringData.size());
+    uint64_t pos = alignedPos(header.rowsPos + rowRecords.size()*sizeof(RowRecord));
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+        header.columnsPos[s] = pos;
+        pos = alignedPos(pos + header.rows*header.widths[s]*sizeof(double));
+    }
+    header.size = pos;
+
+    // written next to the cache and renamed, so readers never see a partial file
+    const string tmpname = filename + ".tmp";
+    ofstream outfile(tmpname, ios::out | ios::binary | ios::trunc);
+    if (!outfile.is_open()) throw runtime_error("Error: Cannot write " + tmpname);
+    auto padTo = [&outfile](uint64_t target) {
+        static const char padding[ALIGNMENT] = {0};
+        outfile.write(padding, target - outfile.tellp());
+    };
+    outfile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    padTo(header.entriesPos);
+    outfile.write(reinterpret_cast<const char*>(records.data()), records.size()*sizeof(EntryRecord));
+    padTo(header.stringsPos);
+    outfile.write(stringData.data(), stringData.size());
+    padTo(header.rowsPos);
+    outfile.write(reinterpret_cast<const char*>(rowRecords.data()), rowRecords.size()*sizeof(RowRecord));
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) {
+        padTo(header.columnsPos[s]);
+        if (header.rows && header.widths[s]) {
+            ifstream column(columnFile(s), ios::in | ios::binary);
+            outfile << column.rdbuf();
+        }
+    }
+    padTo(header.size);
+    outfile.close();
+    if (outfile.fail()) throw runtime_error("Error: Cannot write " + tmpname);
+    for (int s = 0; s < FEATURE_SEGMENTS; s++) remove(columnFile(s).c_str());
+    if (rename(tmpname.c_str(), filename.c_str()) != 0) throw runtime_error("Error: Cannot write " + filename);
+    finished = true;
+}
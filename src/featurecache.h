@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "featureblock.h"
+#include "mappedfile.h"
+
+/**
+ * @brief Memory mapped features of all faces of a batch list, keyed by image file.
+ *
+ * Every segment of the feature blocks is stored as one column with a row per face, so
+ * training runs from the cache without touching the images. A cache is only valid for the
+ * pipeline key it was written with, an entry only while size and modification time of its
+ * image are unchanged.
+ */
+class FeatureCache
+{
+public:
+    struct FileStamp {
+        int64_t mtime = 0;
+        uint64_t size = 0;
+        bool operator==(const FileStamp& other) const { return mtime == other.mtime && size == other.size; }
+    };
+
+    FeatureCache(const std::string& filename);
+    FeatureCache(const FeatureCache&) = delete;
+    FeatureCache& operator=(const FeatureCache&) = delete;
+    static bool isCache(const std::string& filename);
+    static FileStamp stamp(const std::string& filename);
+    // identifies the feature extraction, settings describes everything the features depend on
+    static uint64_t pipelineKey(const std::string& settings);
+
+    uint64_t key() const;
+    size_t entryCount() const;
+    size_t rowCount() const;
+    // entry of filename, -1 if it is missing or outdated
+    long find(const std::string& filename, const FileStamp& stamp) const;
+    std::string path(size_t entry) const;
+    std::string label(size_t entry) const;
+    FileStamp fileStamp(size_t entry) const;
+    size_t firstRow(size_t entry) const;
+    size_t rows(size_t entry) const;
+    size_t rowEntry(size_t row) const;
+    void load(size_t row, FeatureArena& arena, FeatureBlock& block) const;
+
+    /**
+     * @brief Writes a cache entry by entry, the file is replaced on finish().
+     */
+    class Writer {
+    public:
+        Writer(const std::string& filename, uint64_t key);
+        ~Writer();
+        void add(const std::string& path, const std::string& label, const FileStamp& stamp,
+                 const std::vector<const FeatureBlock*>& faces);
+        // copies an entry of another cache, the label is taken from the current list
+        void add(const FeatureCache& cache, size_t entry, const std::string& label);
+        void finish();
+
+    private:
+        struct Entry {
+            std::string path;
+            std::string label;
+            FileStamp stamp;
+            uint64_t firstRow;
+            uint64_t rowCount;
+        };
+        std::string filename;
+        uint64_t cacheKey;
+        bool haveWidths = false;
+        std::array<uint64_t, FEATURE_SEGMENTS> widths{};
+        std::vector<Entry> entries;
+        std::vector<uint32_t> present;
+        std::array<std::ofstream, FEATURE_SEGMENTS> columns;
+        std::vector<double> zeros;
+        bool finished = false;
+
+        std::string columnFile(int segment) const;
+        void setWidths(const std::array<uint64_t, FEATURE_SEGMENTS>& sizes);
+        void writeRow(const std::array<const double*, FEATURE_SEGMENTS>& segments, uint32_t mask);
+    };
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t pipelineKey;
+        uint64_t entries;
+        uint64_t rows;
+        uint64_t widths[FEATURE_SEGMENTS];
+        uint64_t entriesPos;
+        uint64_t stringsPos;
+        uint64_t rowsPos;
+        uint64_t columnsPos[FEATURE_SEGMENTS];
+        uint64_t size;
+    };
+
+    struct EntryRecord {
+        uint64_t pathPos;
+        uint64_t labelPos;
+        uint32_t pathLength;
+        uint32_t labelLength;
+        int64_t mtime;
+        uint64_t fileSize;
+        uint64_t firstRow;
+        uint64_t rowCount;
+    };
+
+    struct RowRecord {
+        uint32_t entry;
+        uint32_t present;
+    };
+
+    std::unique_ptr<MappedFile> file;
+    const Header* header;
+    const EntryRecord* entryRecords;
+    const char* strings;
+    const RowRecord* rowRecords;
+    std::array<const double*, FEATURE_SEGMENTS> columns;
+    std::unordered_map<std::string, size_t> index;
+
+    const double* value(size_t row, int segment) const;
+};
@@ -5,7 +5,31 @@
 
 using namespace std;
 
+//eye patch sizes of the lid and the eye context features
+static constexpr int LID_PATCH_SIZE = 24;
+static constexpr int EYE_HOG_PATCH_SIZE = 32;
+//values written by extractHorizGazeFeatures and extractVertGazeFeatures
+static constexpr long HORIZ_GAZE_FEATURES = 6;
+static constexpr long VERT_GAZE_FEATURES = 10;
+
+static long fhogFeatureCount(int patchSize) {
+    cv::Mat patch(patchSize, 2*patchSize, CV_8UC3, cv::Scalar::all(0));
+    return dlib::extract_fhog_features(dlib::cv_image<dlib::rgb_pixel>(patch), 8).size();
+}
+
+// hog features as one column, the same order as dlib::extract_fhog_features
+static void writeFhogFeatures(const cv::Mat& patch, FeatureBlock& block, FeatureSegment segment) {
+    static thread_local dlib::matrix<double,0,1> hog;
+    dlib::extract_fhog_features(dlib::cv_image<dlib::rgb_pixel>(patch), hog, 8);
+    FeatureBlock::Writer features(block, segment);
+    for (long i = 0; i < hog.size(); i++) {
+        features.push_back(hog(i));
+    }
+    features.commit();
+}
+
 FeatureExtractor::FeatureExtractor()
+    : lidFeatureCount(fhogFeatureCount(LID_PATCH_SIZE)), eyeHogFeatureCount(fhogFeatureCount(EYE_HOG_PATCH_SIZE))
 {
 
 }
@@ -15,26 +39,33 @@ FeatureExtractor::~FeatureExtractor()
 
 }
 
+FeatureBlock::Sizes FeatureExtractor::segmentSizes(const GazeHyp &ghyp) const {
+    FeatureBlock::Sizes sizes;
+    //landmarks and both pupils
+    sizes[static_cast<int>(FeatureSegment::FACE)] = 2*(ghyp.shape.num_parts() + 2);
+    sizes[static_cast<int>(FeatureSegment::LID)] = lidFeatureCount;
+    sizes[static_cast<int>(FeatureSegment::HORIZ_GAZE)] = HORIZ_GAZE_FEATURES;
+    sizes[static_cast<int>(FeatureSegment::VERT_GAZE)] = VERT_GAZE_FEATURES;
+    sizes[static_cast<int>(FeatureSegment::EYE_HOG)] = eyeHogFeatureCount;
+    return sizes;
+}
+
 void FeatureExtractor::extractLidFeatures(GazeHyp& ghyp) {
-    EyePatcher ep;
+    EyePatcher ep(LID_PATCH_SIZE, LID_PATCH_SIZE);
     ep(ghyp.parentHyp.frame, ghyp.faceParts, ghyp.eyePatch, cv::INTER_LINEAR);
     if (!ghyp.eyePatch.empty()) {
-        dlib::cv_image<dlib::rgb_pixel> rgbcv(ghyp.eyePatch);
-        ghyp.lidFeatures = dlib::extract_fhog_features(rgbcv, 8);
-        //cerr << "hog dimensions: " << fhogmat.nr() << endl;
+        writeFhogFeatures(ghyp.eyePatch, ghyp.features, FeatureSegment::LID);
     }
 }
 
 void FeatureExtractor::extractEyeHogFeatures(GazeHyp &ghyp)
 {
     // hog features on eye area to provide context
-    EyePatcher ep(32, 32);
-    cv::Mat eyePatch;
+    static thread_local cv::Mat eyePatch;
+    EyePatcher ep(EYE_HOG_PATCH_SIZE, EYE_HOG_PATCH_SIZE);
     ep(ghyp.parentHyp.frame, ghyp.faceParts, eyePatch, cv::INTER_LINEAR);
     if (eyePatch.empty()) return;
-    dlib::cv_image<dlib::rgb_pixel> rgbcv(eyePatch);
-    ghyp.eyeHogFeatures = dlib::extract_fhog_features(rgbcv, 8);
-
+    writeFhogFeatures(eyePatch, ghyp.features, FeatureSegment::EYE_HOG);
 }
 
 
@@ -43,7 +74,7 @@ void FeatureExtractor::extractFaceFeatures(GazeHyp &ghyp)
     auto& faceParts = ghyp.faceParts;
     auto& pupils = ghyp.pupils;
     if (pupils.pupilsFound() < 2) return;
-    vector<double> features;
+    FeatureBlock::Writer features(ghyp.features, FeatureSegment::FACE);
 
     cv::Point2d lleft;
     lleft = faceParts.featurePoint(FaceParts::LEYE, 3);
@@ -87,7 +118,7 @@ void FeatureExtractor::extractFaceFeatures(GazeHyp &ghyp)
         features.push_back(proj[1]);
         //cv::circle(ghyp.parentHyp.frame, cv::Point(proj[0]*40+100, proj[1]*40+100), 2, cv::Scalar(0, 50, 255), 1, 'A');
     }
-    ghyp.faceFeatures = dlib::mat(features);
+    features.commit();
 }
 
 
@@ -96,7 +127,7 @@ void FeatureExtractor::extractHorizGazeFeatures(GazeHyp &ghyp)
     auto& faceParts = ghyp.faceParts;
     auto& pupils = ghyp.pupils;
     if (pupils.pupilsFound() < 2) return;
-    vector<double> features;
+    FeatureBlock::Writer features(ghyp.features, FeatureSegment::HORIZ_GAZE);
 
     cv::Point2d lleft;
     lleft = faceParts.featurePoint(FaceParts::LEYE, 3);
@@ -188,7 +219,7 @@ void FeatureExtractor::extractHorizGazeFeatures(GazeHyp &ghyp)
         features.push_back(rel);
     }
 
-    ghyp.horizGazeFeatures = dlib::mat(features);
+    features.commit();
 }
 
 
@@ -198,7 +229,7 @@ void FeatureExtractor::extractVertGazeFeatures(GazeHyp &ghyp)
     auto& faceParts = ghyp.faceParts;
     auto& pupils = ghyp.pupils;
     if (pupils.pupilsFound() < 2) return;
-    vector<double> features;
+    FeatureBlock::Writer features(ghyp.features, FeatureSegment::VERT_GAZE);
 
     cv::Point2d lright;
     lright = faceParts.featurePoint(FaceParts::LEYE, 0);
@@ -290,7 +321,7 @@ void FeatureExtractor::extractVertGazeFeatures(GazeHyp &ghyp)
         //cv::circle(ghyp.parentHyp.frame, rlwingcenter+coordinateRoot, 3, cv::Scalar(255, 255, 50), 1, 'A');
     }
     //features.push_back(ghyp.eyeLidClassification.get());
-    ghyp.vertGazeFeatures = dlib::mat(features);
+    features.commit();
     //cerr << ghyp.vertGazeFeatures << endl;
 }
 
@@ -14,4 +14,10 @@ public:
     void extractEyeHogFeatures(GazeHyp &ghyp);
     void extractVertGazeFeatures(GazeHyp &ghyp);
     void extractHorizGazeFeatures(GazeHyp &ghyp);
+    // segment sizes of a face's feature block, fixed by the landmark count and the patch sizes
+    FeatureBlock::Sizes segmentSizes(const GazeHyp &ghyp) const;
+
+private:
+    long lidFeatureCount;
+    long eyeHogFeatureCount;
 };
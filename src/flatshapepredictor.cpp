@@ -0,0 +1,289 @@
+#include "flatshapepredictor.h"
+
+#include <cstring>
+#include <fstream>
+#include <dlib/serialize.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define FLAT_SHAPE_PREDICTOR_X86
+    #include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const char MAGIC[8] = {'G', 'Z', 'S', 'H', 'A', 'P', 'E', '\0'};
+static constexpr uint32_t VERSION = 1;
+static constexpr size_t ALIGNMENT = 64;
+
+static size_t alignedPos(size_t pos) {
+    return (pos + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+typedef void (*AccumulateFunc)(float* shape, const float* const* leafs, size_t count, size_t coords);
+
+// leaf values are added tree by tree as in dlib, so every coordinate sees the same sums
+static void accumulateScalar(float* shape, const float* const* leafs, size_t count, size_t coords)
+{
+    for (size_t t = 0; t < count; t++) {
+        for (size_t k = 0; k < coords; k++) {
+            shape[k] += leafs[t][k];
+        }
+    }
+}
+
+#ifdef FLAT_SHAPE_PREDICTOR_X86
+
+__attribute__((target("sse2")))
+static void accumulateSse(float* shape, const float* const* leafs, size_t count, size_t coords)
+{
+    size_t k = 0;
+    for (; k + 8 <= coords; k += 8) {
+        __m128 a = _mm_loadu_ps(shape + k);
+        __m128 b = _mm_loadu_ps(shape + k + 4);
+        for (size_t t = 0; t < count; t++) {
+            a = _mm_add_ps(a, _mm_loadu_ps(leafs[t] + k));
+            b = _mm_add_ps(b, _mm_loadu_ps(leafs[t] + k + 4));
+        }
+        _mm_storeu_ps(shape + k, a);
+        _mm_storeu_ps(shape + k + 4, b);
+    }
+    for (; k < coords; k++) {
+        for (size_t t = 0; t < count; t++) shape[k] += leafs[t][k];
+    }
+}
+
+__attribute__((target("avx2")))
+static void accumulateAvx2(float* shape, const float* const* leafs, size_t count, size_t coords)
+{
+    size_t k = 0;
+    // 32 coordinates stay in registers while the leafs of all trees are added
+    for (; k + 32 <= coords; k += 32) {
+        __m256 a = _mm256_loadu_ps(shape + k);
+        __m256 b = _mm256_loadu_ps(shape + k + 8);
+        __m256 c = _mm256_loadu_ps(shape + k + 16);
+        __m256 d = _mm256_loadu_ps(shape + k + 24);
+        for (size_t t = 0; t < count; t++) {
+            const float* leaf = leafs[t] + k;
+            a = _mm256_add_ps(a, _mm256_loadu_ps(leaf));
+            b = _mm256_add_ps(b, _mm256_loadu_ps(leaf + 8));
+            c = _mm256_add_ps(c, _mm256_loadu_ps(leaf + 16));
+            d = _mm256_add_ps(d, _mm256_loadu_ps(leaf + 24));
+        }
+        _mm256_storeu_ps(shape + k, a);
+        _mm256_storeu_ps(shape + k + 8, b);
+        _mm256_storeu_ps(shape + k + 16, c);
+        _mm256_storeu_ps(shape + k + 24, d);
+    }
+    for (; k + 8 <= coords; k += 8) {
+        __m256 a = _mm256_loadu_ps(shape + k);
+        for (size_t t = 0; t < count; t++) {
+            a = _mm256_add_ps(a, _mm256_loadu_ps(leafs[t] + k));
+        }
+        _mm256_storeu_ps(shape + k, a);
+    }
+    for (; k < coords; k++) {
+        for (size_t t = 0; t < count; t++) shape[k] += leafs[t][k];
+    }
+}
+
+#endif
+
+static AccumulateFunc selectAccumulate()
+{
+#ifdef FLAT_SHAPE_PREDICTOR_X86
+    if (__builtin_cpu_supports("avx2")) return accumulateAvx2;
+    if (__builtin_cpu_supports("sse2")) return accumulateSse;
+#endif
+    return accumulateScalar;
+}
+
+FlatShapePredictor::FlatShapePredictor(const string& filename)
+{
+    if (isCompiled(filename)) {
+        try {
+            file = make_shared<MappedFile>(filename);
+        } catch (runtime_error& e) {
+            throw dlib::serialization_error(e.what());
+        }
+        attach(file->data(), file->size(), filename);
+    } else {
+        flatten(filename);
+        attach(buffer.data(), buffer.size(), filename);
+    }
+}
+
+bool FlatShapePredictor::isCompiled(const string& filename)
+{
+    ifstream infile(filename, ios::in | ios::binary);
+    char magic[sizeof(MAGIC)];
+    return infile.read(magic, sizeof(magic)) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+void FlatShapePredictor::write(const string& filename) const
+{
+    ofstream outfile(filename, ios::out | ios::binary);
+    if (!outfile.is_open()) throw runtime_error("Error: Cannot write " + filename);
+    outfile.write(reinterpret_cast<const char*>(header), header->size);
+}
+
+size_t FlatShapePredictor::landmarkCount() const
+{
+    return header->landmarks;
+}
+
+// reads the members of a serialized dlib::shape_predictor in their stored order
+void FlatShapePredictor::flatten(const string& filename)
+{
+    ifstream infile(filename, ios::in | ios::binary);
+    if (!infile.is_open()) throw dlib::serialization_error("Error: Cannot open " + filename);
+    int version = 0;
+    dlib::deserialize(version, infile);
+    if (version != 1) throw dlib::serialization_error("Unexpected version found while deserializing dlib::shape_predictor.");
+    dlib::matrix<float,0,1> initial;
+    vector<vector<dlib::impl::regression_tree>> forests;
+    vector<vector<unsigned long>> anchorIdx;
+    vector<vector<dlib::vector<float,2>>> pixelDeltas;
+    dlib::deserialize(initial, infile);
+    dlib::deserialize(forests, infile);
+    dlib::deserialize(anchorIdx, infile);
+    dlib::deserialize(pixelDeltas, infile);
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.landmarks = initial.size()/2;
+    h.cascades = forests.size();
+    h.trees = forests.empty() ? 0 : forests[0].size();
+    h.splits = h.trees ? forests[0][0].splits.size() : 0;
+    h.features = anchorIdx.empty() ? 0 : anchorIdx[0].size();
+    // the flat layout needs the same number of trees, splits and feature pixels everywhere
+    auto invalid = [&filename]() {
+        return dlib::serialization_error("Error: Unsupported shape model layout in " + filename);
+    };
+    if (anchorIdx.size() != h.cascades || pixelDeltas.size() != h.cascades) throw invalid();
+    for (uint32_t c = 0; c < h.cascades; c++) {
+        if (forests[c].size() != h.trees || anchorIdx[c].size() != h.features || pixelDeltas[c].size() != h.features) {
+            throw invalid();
+        }
+        for (const auto& tree : forests[c]) {
+            if (tree.splits.size() != h.splits || tree.leaf_values.size() != h.splits + 1) throw invalid();
+            for (const auto& split : tree.splits) {
+                if (split.idx1 >= h.features || split.idx2 >= h.features) throw invalid();
+            }
+            for (const auto& leaf : tree.leaf_values) {
+                if (leaf.size() != initial.size()) throw invalid();
+            }
+        }
+        for (unsigned long idx : anchorIdx[c]) {
+            if (idx >= h.landmarks) throw invalid();
+        }
+    }
+
+    size_t trees = (size_t)h.cascades * h.trees;
+    size_t pos = alignedPos(sizeof(Header));
+    h.initialShapePos = pos;
+    pos = alignedPos(pos + initial.size() * sizeof(float));
+    h.anchorsPos = pos;
+    pos = alignedPos(pos + (size_t)h.cascades * h.features * sizeof(uint32_t));
+    h.deltasPos = pos;
+    pos = alignedPos(pos + (size_t)h.cascades * h.features * 2 * sizeof(float));
+    h.splitsPos = pos;
+    pos = alignedPos(pos + trees * h.splits * sizeof(Split));
+    h.leavesPos = pos;
+    pos = alignedPos(pos + trees * (h.splits + 1) * initial.size() * sizeof(float));
+    h.size = pos;
+
+    buffer.assign(h.size, 0);
+    memcpy(buffer.data(), &h, sizeof(h));
+    float* shapeOut = reinterpret_cast<float*>(&buffer[h.initialShapePos]);
+    for (long i = 0; i < initial.size(); i++) {
+        shapeOut[i] = initial(i);
+    }
+    uint32_t* anchorOut = reinterpret_cast<uint32_t*>(&buffer[h.anchorsPos]);
+    float* deltaOut = reinterpret_cast<float*>(&buffer[h.deltasPos]);
+    Split* splitOut = reinterpret_cast<Split*>(&buffer[h.splitsPos]);
+    float* leafOut = reinterpret_cast<float*>(&buffer[h.leavesPos]);
+    for (uint32_t c = 0; c < h.cascades; c++) {
+        for (uint32_t i = 0; i < h.features; i++) {
+            *anchorOut++ = anchorIdx[c][i];
+            *deltaOut++ = pixelDeltas[c][i].x();
+            *deltaOut++ = pixelDeltas[c][i].y();
+        }
+        for (const auto& tree : forests[c]) {
+            for (const auto& split : tree.splits) {
+                *splitOut++ = {static_cast<uint32_t>(split.idx1), static_cast<uint32_t>(split.idx2), split.thresh};
+            }
+            for (const auto& leaf : tree.leaf_values) {
+                for (long k = 0; k < leaf.size(); k++) {
+                    *leafOut++ = leaf(k);
+                }
+            }
+        }
+    }
+}
+
+void FlatShapePredictor::attach(const char* data, size_t size, const string& filename)
+{
+    if (size < sizeof(Header)) throw dlib::serialization_error("Error: Truncated shape model " + filename);
+    header = reinterpret_cast<const Header*>(data);
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION) {
+        throw dlib::serialization_error("Error: Unsupported compiled shape model " + filename);
+    }
+    size_t coords = 2*header->landmarks;
+    size_t trees = (size_t)header->cascades * header->trees;
+    auto section = [data, size, &filename](uint64_t pos, size_t bytes) {
+        if (pos % ALIGNMENT || pos + bytes > size) {
+            throw dlib::serialization_error("Error: Corrupt compiled shape model " + filename);
+        }
+        return data + pos;
+    };
+    if (header->size > size) throw dlib::serialization_error("Error: Truncated shape model " + filename);
+    // trees are complete binary trees stored in heap order
+    if ((header->splits + 1) & header->splits) {
+        throw dlib::serialization_error("Error: Corrupt compiled shape model " + filename);
+    }
+    initialShape = reinterpret_cast<const float*>(section(header->initialShapePos, coords * sizeof(float)));
+    anchors = reinterpret_cast<const uint32_t*>(section(header->anchorsPos,
+                (size_t)header->cascades * header->features * sizeof(uint32_t)));
+    deltas = reinterpret_cast<const float*>(section(header->deltasPos,
+                (size_t)header->cascades * header->features * 2 * sizeof(float)));
+    splits = reinterpret_cast<const Split*>(section(header->splitsPos, trees * header->splits * sizeof(Split)));
+    leaves = reinterpret_cast<const float*>(section(header->leavesPos,
+                trees * (header->splits + 1) * coords * sizeof(float)));
+    for (size_t i = 0; i < (size_t)header->cascades * header->features; i++) {
+        if (anchors[i] >= header->landmarks) throw dlib::serialization_error("Error: Corrupt compiled shape model " + filename);
+    }
+    for (size_t i = 0; i < trees * header->splits; i++) {
+        if (splits[i].idx1 >= header->features || splits[i].idx2 >= header->features) {
+            throw dlib::serialization_error("Error: Corrupt compiled shape model " + filename);
+        }
+    }
+    referenceShape.set_size(coords);
+    for (size_t i = 0; i < coords; i++) {
+        referenceShape(i) = initialShape[i];
+    }
+}
+
+void FlatShapePredictor::regress(uint32_t cascade, const float* featureValues, float* shape) const
+{
+    static const AccumulateFunc accumulate = selectAccumulate();
+    static thread_local vector<const float*> leafs;
+    const size_t coords = 2*header->landmarks;
+    const size_t leafCount = header->splits + 1;
+    const Split* split = splits + (size_t)cascade*header->trees*header->splits;
+    const float* leaf = leaves + (size_t)cascade*header->trees*leafCount*coords;
+    // walk all trees of the level first, then add their leafs in one pass over the shape
+    leafs.resize(header->trees);
+    for (uint32_t t = 0; t < header->trees; t++) {
+        uint32_t i = 0;
+        while (i < header->splits) {
+            const Split& s = split[i];
+            i = featureValues[s.idx1] - featureValues[s.idx2] > s.thresh ? 2*i+1 : 2*i+2;
+        }
+        leafs[t] = leaf + (i - header->splits)*coords;
+        split += header->splits;
+        leaf += leafCount*coords;
+    }
+    accumulate(shape, leafs.data(), leafs.size(), coords);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <dlib/image_processing.h>
+
+#include "mappedfile.h"
+
+/**
+ * @brief Read-only shape predictor over one flat block of memory.
+ *
+ * Evaluates the same cascade of regression trees as dlib::shape_predictor, but keeps all
+ * split features and leaf values in contiguous arrays. Loaded from a compiled file the
+ * block is memory mapped and shared by all threads and processes. Evaluation is const and
+ * only uses thread local scratch buffers, so a single instance serves all threads.
+ */
+class FlatShapePredictor
+{
+public:
+    FlatShapePredictor(const std::string& filename);
+    FlatShapePredictor(const FlatShapePredictor&) = delete;
+    FlatShapePredictor& operator=(const FlatShapePredictor&) = delete;
+    static bool isCompiled(const std::string& filename);
+    void write(const std::string& filename) const;
+    size_t landmarkCount() const;
+
+    template <typename image_type>
+    dlib::full_object_detection operator()(const image_type& img, const dlib::rectangle& rect) const;
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t landmarks;
+        uint32_t cascades;
+        uint32_t trees;
+        uint32_t splits;
+        uint32_t features;
+        uint64_t initialShapePos;
+        uint64_t anchorsPos;
+        uint64_t deltasPos;
+        uint64_t splitsPos;
+        uint64_t leavesPos;
+        uint64_t size;
+    };
+
+    struct Split {
+        uint32_t idx1;
+        uint32_t idx2;
+        float thresh;
+    };
+
+    std::shared_ptr<MappedFile> file;
+    std::vector<char> buffer;
+    const Header* header;
+    const float* initialShape;
+    const uint32_t* anchors;
+    const float* deltas;
+    const Split* splits;
+    const float* leaves;
+    dlib::matrix<float,0,1> referenceShape;
+
+    void flatten(const std::string& filename);
+    void attach(const char* data, size_t size, const std::string& filename);
+    void regress(uint32_t cascade, const float* featureValues, float* shape) const;
+};
+
+template <typename image_type>
+dlib::full_object_detection FlatShapePredictor::operator()(const image_type& img, const dlib::rectangle& rect) const
+{
+    static thread_local std::vector<float> featureValues;
+    static thread_local dlib::matrix<float,0,1> shape;
+    shape = referenceShape;
+    featureValues.resize(header->features);
+    const dlib::point_transform_affine toImage = dlib::impl::unnormalizing_tform(rect);
+    const dlib::rectangle area = dlib::get_rect(img);
+    dlib::const_image_view<image_type> view(img);
+    for (uint32_t c = 0; c < header->cascades; c++) {
+        // pixel sampling as in dlib::impl::extract_feature_pixel_values
+        const dlib::matrix<float,2,2> tform =
+                dlib::matrix_cast<float>(dlib::impl::find_tform_between_shapes(referenceShape, shape).get_m());
+        const uint32_t* anchor = anchors + c*header->features;
+        const float* delta = deltas + 2*c*header->features;
+        for (uint32_t i = 0; i < header->features; i++) {
+            const dlib::vector<float,2> d(delta[2*i], delta[2*i+1]);
+            const dlib::vector<float,2> a(shape(2*anchor[i]), shape(2*anchor[i]+1));
+            dlib::point p = toImage(tform*d + a);
+            featureValues[i] = area.contains(p) ? dlib::get_pixel_intensity(view[p.y()][p.x()]) : 0;
+        }
+        regress(c, featureValues.data(), &shape(0));
+    }
+    std::vector<dlib::point> parts(header->landmarks);
+    for (uint32_t i = 0; i < header->landmarks; i++) {
+        parts[i] = toImage(dlib::vector<float,2>(shape(2*i), shape(2*i+1)));
+    }
+    return dlib::full_object_detection(rect, parts);
+}
@@ -1,4 +1,5 @@
 #include "gazehyps.h"
+#include "trace.h"
 
 GazeHypList::GazeHypList()
 {
@@ -7,6 +8,8 @@ GazeHypList::GazeHypList()
 void GazeHypList::waitready()
 {
     std::unique_lock<std::mutex> lock(_mutex);
+    if (!_tasks) return;
+    Trace::Scope scope("wait_ready", sequence);
     while(_tasks) {
         _cond.wait(lock);
     }
@@ -24,6 +27,10 @@ void GazeHypList::setready(int ready)
 void GazeHypList::addGazeHyp(GazeHyp &hyp)
 {
     _hyps.push_back(hyp);
+    if (_hyps.back().eyePatch.empty() && !_sparePatches.empty()) {
+        _hyps.back().eyePatch = _sparePatches.back();
+        _sparePatches.pop_back();
+    }
 }
 
 std::vector<GazeHyp>::iterator GazeHypList::begin()
@@ -55,3 +62,63 @@ GazeHyp &GazeHypList::hyps(int i)
 {
     return _hyps[i];
 }
+
+// buffers still referenced elsewhere, e.g. by the gui, must not be overwritten
+static bool unshared(const cv::Mat& mat)
+{
+#if CV_MAJOR_VERSION >= 3
+    return mat.u && mat.u->refcount == 1;
+#else
+    return mat.refcount && *mat.refcount == 1;
+#endif
+}
+
+void GazeHypList::recycle()
+{
+    for (auto& hyp : _hyps) {
+        if (unshared(hyp.eyePatch)) _sparePatches.push_back(hyp.eyePatch);
+    }
+    _hyps.clear();
+    featureArena.reset();
+    if (!unshared(frame)) frame.release();
+    if (!unshared(grayframe)) grayframe.release();
+    frameTime = std::chrono::system_clock::time_point();
+    captureTime = Metrics::Clock::time_point();
+    stageTime = Metrics::Clock::time_point();
+    latency = 0.0;
+    fps = 0.0;
+    frameCounter = 0;
+    sequence = -1;
+    droppedFrames = 0;
+    keyframe = true;
+    label.clear();
+    id.clear();
+    _tasks = 0;
+}
+
+GazeHypListPool::GazeHypListPool(size_t capacity)
+    : storage(std::make_shared<Storage>())
+{
+    storage->capacity = capacity;
+    storage->lists.reserve(capacity);
+}
+
+GazeHypsPtr GazeHypListPool::acquire()
+{
+    std::unique_ptr<GazeHypList> list;
+    {
+        std::lock_guard<std::mutex> lock(storage->mutex);
+        if (!storage->lists.empty()) {
+            list = std::move(storage->lists.back());
+            storage->lists.pop_back();
+        }
+    }
+    if (!list) list.reset(new GazeHypList());
+    std::shared_ptr<Storage> owner = storage;
+    return GazeHypsPtr(list.release(), [owner](GazeHypList* released) {
+        std::unique_ptr<GazeHypList> list(released);
+        list->recycle();
+        std::lock_guard<std::mutex> lock(owner->mutex);
+        if (owner->lists.size() < owner->capacity) owner->lists.push_back(std::move(list));
+    });
+}
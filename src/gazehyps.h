@@ -4,15 +4,21 @@
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
+#include <memory>
+#include <vector>
 #include <dlib/image_processing.h>
 #include <dlib/opencv.h>
 #include <qt5/QtCore/QMetaType>
 #include <boost/optional.hpp>
 
 #include "pupilfinder.h"
+#include "ringqueue.h"
+#include "featureblock.h"
+#include "metrics.h"
 
 class GazeHypList;
 typedef std::shared_ptr<GazeHypList> GazeHypsPtr;
+typedef RingQueue<GazeHypsPtr> GazeHypsQueue;
 Q_DECLARE_METATYPE(GazeHypsPtr)
 
 struct GazeHyp {
@@ -20,18 +26,19 @@ struct GazeHyp {
     dlib::full_object_detection shape;
     PupilFinder pupils;
     FaceParts faceParts;
-    dlib::matrix<double,0,1> faceFeatures;
-    dlib::matrix<double,0,1> lidFeatures;
-    dlib::matrix<double,0,1> horizGazeFeatures;
-    dlib::matrix<double,0,1> vertGazeFeatures;
-    dlib::matrix<double,0,1> eyeHogFeatures;
+    FeatureBlock features;
     cv::Mat eyePatch;
     boost::optional<double> eyeLidClassification;
     boost::optional<double> mutualGazeClassification;
     boost::optional<double> horizontalGazeEstimation;
     boost::optional<double> verticalGazeEstimation;
+    //estimates before temporal smoothing
+    boost::optional<double> rawEyeLidClassification;
+    boost::optional<double> rawHorizontalGazeEstimation;
+    boost::optional<double> rawVerticalGazeEstimation;
     boost::optional<bool> isMutualGaze;
     boost::optional<bool> isLidClosed;
+    int trackId = -1;
     GazeHypList& parentHyp;
     GazeHyp(GazeHypList& parent) : parentHyp(parent) {}
 };
@@ -41,13 +48,23 @@ class GazeHypList
 public:
     GazeHypList();
     cv::Mat frame;
+    //gray copy of the frame shared by all stages, use dlib::cv_image<unsigned char> on the dlib side
+    cv::Mat grayframe;
     std::chrono::system_clock::time_point frameTime;
-    dlib::array2d<unsigned char> dlibimage;
+    //set while metrics are enabled: capture end and the end of the last finished stage
+    Metrics::Clock::time_point captureTime;
+    Metrics::Clock::time_point stageTime;
     double latency = 0.0;
     double fps = 0.0;
     int frameCounter = 0;
+    //position in capture order, frameCounter is only assigned by the consumer
+    long sequence = -1;
+    //frames the live input dropped up to this one
+    long droppedFrames = 0;
+    bool keyframe = true;
     std::string label;
     std::string id;
+    FeatureArena featureArena;
     void waitready();
     void setready(int ready);
     void addGazeHyp(GazeHyp& hyp);
@@ -57,11 +74,37 @@ public:
     std::vector<GazeHyp>::const_iterator end() const;
     size_t size();
     GazeHyp& hyps(int i);
+    void recycle();
 
 private:
     std::vector<GazeHyp> _hyps;
+    //eye patch buffers of recycled faces, handed to the next faces added
+    std::vector<cv::Mat> _sparePatches;
     std::mutex _mutex;
     std::condition_variable _cond;
     int _tasks = 0;
 };
 
+
+/**
+ * @brief Fixed size pool of frame lists.
+ *
+ * Lists are handed out as GazeHypsPtr, which return them to the pool once the last reference
+ * is dropped. Recycled lists keep their frame buffers and eye patches, so frames of the same
+ * size are stored without new allocations. Lists beyond the capacity are freed.
+ */
+class GazeHypListPool
+{
+public:
+    GazeHypListPool(size_t capacity);
+    GazeHypsPtr acquire();
+
+private:
+    struct Storage {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<GazeHypList>> lists;
+        size_t capacity;
+    };
+    //shared with the deleters, frames may outlive the pool in the gui
+    std::shared_ptr<Storage> storage;
+};
@@ -56,6 +56,7 @@ void GazerGui::displayGazehyps(GazeHypsPtr gazehyps) {
     out.setRealNumberNotation(QTextStream::FixedNotation);
     out << "fps: " << gazehyps->fps << " | latency: " << gazehyps->latency
         << " ms | frame: " << gazehyps->frameCounter;
+    if (gazehyps->droppedFrames) out << " | dropped: " << gazehyps->droppedFrames;
     if (!gazehyps->id.empty()) out << " | " << QString::fromStdString(gazehyps->id);
     ui->statusbar->showMessage(msg);
 }
@@ -0,0 +1,376 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "imageprovider.h"
+#include "facedetectionworker.h"
+#include "shapedetectionworker.h"
+#include "regressionworker.h"
+#include "mutualgazelearner.h"
+#include "verticalgazelearner.h"
+#include "eyelidlearner.h"
+#include "relativeeyelidlearner.h"
+#include "relativegazelearner.h"
+#include "metrics.h"
+
+using namespace std;
+
+namespace po = boost::program_options;
+
+// Every heap allocation of the process is counted, including the frame buffers opencv allocates
+// with malloc, by replacing glibc's allocation functions. Other c libraries report no allocations.
+static atomic<uint64_t> allocationCount{0};
+static atomic<uint64_t> allocatedBytes{0};
+
+#ifdef __GLIBC__
+static constexpr bool countingAllocations = true;
+
+static void countAllocation(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    allocatedBytes.fetch_add(size, memory_order_relaxed);
+}
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) {
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    countAllocation(count*size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    countAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) || (alignment & (alignment - 1))) return EINVAL;
+    void* p = memalign(alignment, size);
+    if (!p && size) return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+}
+#else
+static constexpr bool countingAllocations = false;
+#endif
+
+// Hands out copies of frames held in memory, so the replay does not depend on disk or decoder speed.
+// The copy into the pooled frame buffer stands for the decoder writing a new frame.
+class ReplayImageProvider : public ImageProvider
+{
+public:
+    ReplayImageProvider(const vector<cv::Mat>& frames, long count) : frames(frames), count(count) {}
+    virtual bool get(cv::Mat& frame) {
+        if (position >= count) return false;
+        frames[position % frames.size()].copyTo(frame);
+        id = to_string(position++);
+        return true;
+    }
+    virtual std::string getLabel() { return ""; }
+    virtual std::string getId() { return id; }
+
+private:
+    const vector<cv::Mat>& frames;
+    long count;
+    long position = 0;
+    string id;
+};
+
+struct BenchConfig {
+    string input;
+    bool batch = false;
+    string model;
+    string classifyGaze, classifyLid, estimateGaze, estimateLid, estimateVerticalGaze;
+    cv::Size size;
+    int tiles = 1;
+    int threads = max(1u, std::thread::hardware_concurrency());
+    long frames = 0;
+    long recorded = 100;
+    long warmup = 10;
+    int keyframeInterval = 1;
+    int detectionSplit = 0;
+    int detectionScale = 1;
+    PupilFinder::SearchStrategy pupilSearch = PupilFinder::SearchStrategy::EXHAUSTIVE;
+    string output;
+};
+
+// The recorded frames scaled to the benchmark size. With tiles the frame is an n x n grid of the
+// scaled input, which multiplies the faces per frame at the same frame size.
+static vector<cv::Mat> recordFrames(const BenchConfig& config, cv::Size& size) {
+    unique_ptr<ImageProvider> source;
+    if (config.batch) {
+        source.reset(new BatchImageProvider(config.input));
+    } else {
+        source.reset(new CvVideoImageProvider(config.input, cv::Size()));
+    }
+    vector<cv::Mat> frames;
+    cv::Mat frame;
+    while ((long)frames.size() < config.recorded && source->get(frame)) {
+        if (frame.empty()) continue;
+        if (size.area() == 0) size = config.size.area() ? config.size : frame.size();
+        cv::Mat tiled(size, CV_8UC3, cv::Scalar::all(0));
+        const int tileWidth = size.width/config.tiles;
+        const int tileHeight = size.height/config.tiles;
+        if (tileWidth < 1 || tileHeight < 1) throw runtime_error("Error: Frames are too small for the tiles");
+        cv::Mat tile;
+        cv::resize(frame, tile, cv::Size(tileWidth, tileHeight));
+        for (int row = 0; row < config.tiles; row++) {
+            for (int col = 0; col < config.tiles; col++) {
+                tile.copyTo(tiled(cv::Rect(col*tileWidth, row*tileHeight, tileWidth, tileHeight)));
+            }
+        }
+        frames.push_back(tiled);
+    }
+    if (frames.empty()) throw runtime_error("Error: No frames read from " + config.input);
+    return frames;
+}
+
+template<typename T>
+static void loadModel(T& learner, const string& filename) {
+    if (!filename.empty()) learner.loadClassifier(filename);
+}
+
+static long peakRssKb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static string jsonString(const string& text) {
+    ostringstream out;
+    out << "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+        } else {
+            out << c;
+        }
+    }
+    out << "\"";
+    return out.str();
+}
+
+static void writeResult(ostream& out, const BenchConfig& config, cv::Size size, long frames, uint64_t faces,
+                        double seconds, const Metrics::Snapshot& stages, uint64_t allocations, uint64_t bytes) {
+    out << "{\"input\":" << jsonString(config.input)
+        << ",\"threads\":" << config.threads
+        << ",\"width\":" << size.width
+        << ",\"height\":" << size.height
+        << ",\"tiles\":" << config.tiles
+        << ",\"frames\":" << frames
+        << ",\"warmup_frames\":" << config.warmup
+        << ",\"faces_per_frame\":" << (double)faces/frames
+        << ",\"seconds\":" << seconds
+        << ",\"fps\":" << frames/seconds
+        << ",\"faces_per_second\":" << faces/seconds
+        << ",\"stages\":{";
+    for (int i = 0; i < STAGES; i++) {
+        out << (i ? "," : "") << "\"" << Metrics::stageName(static_cast<Stage>(i)) << "\":{"
+            << "\"count\":" << stages[i].count
+            << ",\"mean_us\":" << (stages[i].count ? (double)stages[i].sum/stages[i].count : 0.0)
+            << ",\"p50_us\":" << stages[i].quantile(0.5)
+            << ",\"p95_us\":" << stages[i].quantile(0.95)
+            << ",\"p99_us\":" << stages[i].quantile(0.99) << "}";
+    }
+    out << "},\"peak_rss_kb\":" << peakRssKb();
+    if (countingAllocations) {
+        out << ",\"allocations_per_frame\":" << (double)allocations/frames
+            << ",\"allocated_bytes_per_frame\":" << (double)bytes/frames;
+    } else {
+        out << ",\"allocations_per_frame\":null,\"allocated_bytes_per_frame\":null";
+    }
+    out << "}" << endl;
+}
+
+static void run(const BenchConfig& config) {
+    cv::Size size;
+    const vector<cv::Mat> recorded = recordFrames(config, size);
+    const long total = config.frames ? config.frames : recorded.size();
+    if (total <= config.warmup) throw runtime_error("Error: Fewer frames than warmup frames");
+    cerr << "Replaying " << total << " frames of " << size.width << "x" << size.height
+         << " from " << recorded.size() << " recorded frames on " << config.threads << " threads" << endl;
+
+    TrainingParameters params;
+    MutualGazeLearner glearner(params);
+    RelativeGazeLearner rglearner(params);
+    EyeLidLearner eoclearner(params);
+    RelativeEyeLidLearner rellearner(params);
+    VerticalGazeLearner vglearner(params);
+    loadModel(glearner, config.classifyGaze);
+    loadModel(eoclearner, config.classifyLid);
+    loadModel(rglearner, config.estimateGaze);
+    loadModel(rellearner, config.estimateLid);
+    loadModel(vglearner, config.estimateVerticalGaze);
+
+    Metrics::enable();
+    std::unique_ptr<ImageProvider> images(new ReplayImageProvider(recorded, total));
+    FaceDetectionWorker faceworker(std::move(images), config.threads, config.keyframeInterval, 0.3,
+                                   config.detectionSplit, config.detectionScale, 0, 0);
+    ShapeDetectionWorker shapeworker(faceworker.hypsqueue(), config.model, max(1, config.threads/2));
+    RegressionWorker regressionWorker(shapeworker.hypsqueue(), eoclearner, glearner, rglearner, rellearner,
+                                      vglearner, config.threads, config.pupilSearch);
+
+    long consumed = 0;
+    uint64_t faces = 0;
+    Metrics::Snapshot stagesBefore;
+    uint64_t allocationsBefore = 0, bytesBefore = 0;
+    chrono::steady_clock::time_point start;
+    // measured from the completion of the last warmup frame, every measured frame completes after it
+    auto takeBaseline = [&]() {
+        stagesBefore = Metrics::snapshot();
+        allocationsBefore = allocationCount.load(memory_order_relaxed);
+        bytesBefore = allocatedBytes.load(memory_order_relaxed);
+        start = chrono::steady_clock::now();
+    };
+    if (config.warmup == 0) takeBaseline();
+    auto end = start;
+    while (true) {
+        GazeHypsPtr gazehyps;
+        try {
+            gazehyps = regressionWorker.hypsqueue().peek();
+            gazehyps->waitready();
+        } catch(QueueInterruptedException) {
+            break;
+        }
+        Metrics::record(Stage::OUTPUT_WAIT, gazehyps->stageTime);
+        if (consumed >= config.warmup) faces += gazehyps->size();
+        Metrics::record(Stage::END_TO_END, gazehyps->captureTime);
+        regressionWorker.hypsqueue().pop();
+        consumed++;
+        if (consumed == config.warmup) takeBaseline();
+        end = chrono::steady_clock::now();
+    }
+    regressionWorker.hypsqueue().interrupt();
+    regressionWorker.wait();
+
+    const long measured = consumed - config.warmup;
+    if (measured <= 0) throw runtime_error("Error: The pipeline stopped during warmup");
+    const uint64_t allocations = allocationCount.load(memory_order_relaxed) - allocationsBefore;
+    const uint64_t bytes = allocatedBytes.load(memory_order_relaxed) - bytesBefore;
+    Metrics::Snapshot stages = Metrics::snapshot();
+    for (int i = 0; i < STAGES; i++) stages[i] = stages[i] - stagesBefore[i];
+    const double seconds = chrono::duration<double>(end - start).count();
+    if (config.output.empty()) {
+        writeResult(cout, config, size, measured, faces, seconds, stages, allocations, bytes);
+    } else {
+        ofstream out(config.output, ios::out | ios::app);
+        if (!out.is_open()) throw runtime_error("Error: Cannot write " + config.output);
+        writeResult(out, config, size, measured, faces, seconds, stages, allocations, bytes);
+    }
+}
+
+int main(int argc, char** argv) {
+    po::options_description desc("gazetool_bench options");
+    desc.add_options()
+            ("help,h", "show help messages")
+            ("model,m", po::value<string>()->required(), "read the shape model from file arg")
+            ("video,v", po::value<string>(), "replay video file arg")
+            ("batch,b", po::value<string>(), "replay image filenames from arg")
+            ("recorded", po::value<long>(), "frames read from the input into memory (default 100)")
+            ("frames", po::value<long>(), "frames replayed, repeating the recorded frames (default: all recorded)")
+            ("warmup", po::value<long>(), "frames replayed before the measurement starts (default 10)")
+            ("size", po::value<string>(), "scale frames to size arg, e.g. 640x480")
+            ("tiles", po::value<int>(), "replicate the input as an arg x arg grid in every frame")
+            ("threads", po::value<int>(), "set number of threads per processing step (default: all cores)")
+            ("track-faces", po::value<int>(), "detect faces in full frames only every arg frames and track them in between")
+            ("detect-split", po::value<int>(), "scan each frame in parallel as arg overlapping strips")
+            ("detect-scale", po::value<int>(), "detect faces on the frame downscaled by arg (1, 2, 4, ...)")
+            ("pupil-search", po::value<string>(), "pupil center search: exhaustive or coarse")
+            ("classify-gaze", po::value<string>(), "load classifier from arg")
+            ("classify-lid", po::value<string>(), "load classifier from arg")
+            ("estimate-gaze", po::value<string>(), "load estimator from arg")
+            ("estimate-lid", po::value<string>(), "load estimator from arg")
+            ("estimate-verticalgaze", po::value<string>(), "load estimator from arg")
+            ("output,o", po::value<string>(), "append the result as a json line to file arg instead of printing it");
+    BenchConfig config;
+    try {
+        po::variables_map options;
+        po::store(po::parse_command_line(argc, argv, desc), options);
+        if (options.count("help")) {
+            desc.print(cout);
+            return 0;
+        }
+        po::notify(options);
+        if (options.count("video") + options.count("batch") != 1) {
+            throw po::error("exactly one of --video and --batch is required");
+        }
+        config.batch = options.count("batch");
+        config.input = options[config.batch ? "batch" : "video"].as<string>();
+        config.model = options["model"].as<string>();
+        if (options.count("size")) {
+            auto sizestr = options["size"].as<string>();
+            vector<string> args;
+            boost::split(args, sizestr, boost::is_any_of(":x "));
+            if (args.size() != 2) throw po::error("invalid size " + sizestr);
+            config.size = cv::Size(boost::lexical_cast<int>(args[0]), boost::lexical_cast<int>(args[1]));
+        }
+        if (options.count("recorded")) config.recorded = options["recorded"].as<long>();
+        if (options.count("frames")) config.frames = options["frames"].as<long>();
+        if (options.count("warmup")) config.warmup = options["warmup"].as<long>();
+        if (options.count("tiles")) config.tiles = options["tiles"].as<int>();
+        if (options.count("threads")) config.threads = options["threads"].as<int>();
+        if (options.count("track-faces")) config.keyframeInterval = options["track-faces"].as<int>();
+        if (options.count("detect-split")) config.detectionSplit = options["detect-split"].as<int>();
+        if (options.count("detect-scale")) config.detectionScale = options["detect-scale"].as<int>();
+        if (options.count("pupil-search")) {
+            config.pupilSearch = PupilFinder::strategyFromName(options["pupil-search"].as<string>());
+        }
+        if (options.count("classify-gaze")) config.classifyGaze = options["classify-gaze"].as<string>();
+        if (options.count("classify-lid")) config.classifyLid = options["classify-lid"].as<string>();
+        if (options.count("estimate-gaze")) config.estimateGaze = options["estimate-gaze"].as<string>();
+        if (options.count("estimate-lid")) config.estimateLid = options["estimate-lid"].as<string>();
+        if (options.count("estimate-verticalgaze")) config.estimateVerticalGaze = options["estimate-verticalgaze"].as<string>();
+        if (options.count("output")) config.output = options["output"].as<string>();
+        if (config.recorded < 1 || config.frames < 0 || config.warmup < 0) throw po::error("frame counts have to be positive");
+        if (config.tiles < 1) throw po::error("tiles has to be at least 1");
+        if (config.threads < 1) throw po::error("threads has to be at least 1");
+        if (config.detectionScale < 1 || (config.detectionScale & (config.detectionScale - 1))) {
+            throw po::error("detect-scale has to be a power of two");
+        }
+    } catch (std::exception& e) {
+        cerr << "Error parsing command line:" << endl << e.what() << endl;
+        return 1;
+    }
+    try {
+        run(config);
+    } catch (std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,313 @@
+#include "gradientobjective.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define GRADIENT_OBJECTIVE_X86
+    #include <immintrin.h>
+#endif
+
+using namespace std;
+
+GradientObjective::Kernel GradientObjective::defKernel = GradientObjective::Kernel::AUTO;
+
+GradientObjective::GradientObjective(int mapWidth, int maxMapHeight, int step)
+    : width(mapWidth), maxHeight(maxMapHeight), step(step), gridWidth((mapWidth + step - 1) / step)
+{
+    // one row per vertical offset dy in [-(maxHeight-1), maxHeight-1] and phase p = x mod step
+    // of the gradient, holding the x and y components for the horizontal grid offsets. The
+    // offset is stored reversed (dx = step*(gridWidth-1-k) + p), hence neighbouring grid
+    // candidates map to neighbouring entries. Rows are padded for vector loads past the last candidate.
+    lutStride = ((2*gridWidth + 8 + 7) / 8) * 8;
+    lut.assign(2*lutStride*(2*maxHeight - 1)*step, 0.0f);
+    for (int dy = -(maxHeight-1); dy < maxHeight; dy++) {
+        for (int p = 0; p < step; p++) {
+            float* row = lut.data() + 2*lutStride*((dy + maxHeight - 1)*step + p);
+            for (int k = 0; k < 2*gridWidth - 1; k++) {
+                int dx = step*(gridWidth - 1 - k) + p;
+                // same arithmetic as cv::normalize(cv::Vec2f(dx, dy))
+                double nv = std::sqrt(double(dx)*dx + double(dy)*dy);
+                double scale = nv ? 1./nv : 0.;
+                row[k] = static_cast<float>(dx*scale);
+                row[lutStride + k] = static_cast<float>(dy*scale);
+            }
+        }
+    }
+}
+
+// Row of a gradient is at its lut position (see compact) minus step*step*cy of the grid candidate row.
+const float* GradientObjective::lutCenter() const
+{
+    return lut.data() + 2*lutStride*(maxHeight - 1)*step;
+}
+
+bool GradientObjective::covers(const cv::Size& mapSize) const
+{
+    return mapSize.width == width && mapSize.height <= maxHeight;
+}
+
+cv::Size GradientObjective::gridSize(const cv::Size& mapSize) const
+{
+    return cv::Size((mapSize.width + step - 1) / step, (mapSize.height + step - 1) / step);
+}
+
+void GradientObjective::operator()(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask,
+                                   const cv::Mat& candidateMask, cv::Mat& objective) const
+{
+    operator()(gradientxy, gradThreshMask, candidateMask, objective, defKernel);
+}
+
+void GradientObjective::operator()(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask,
+                                   const cv::Mat& candidateMask, cv::Mat& objective, Kernel kernel) const
+{
+    CV_Assert(gradientxy.type() == CV_32FC2 && gradThreshMask.type() == CV_8UC1 && candidateMask.type() == CV_8UC1);
+    CV_Assert(gradientxy.size() == gradThreshMask.size() && gridSize(gradientxy.size()) == candidateMask.size());
+    CV_Assert(gradientxy.isContinuous() && gradThreshMask.isContinuous() && candidateMask.isContinuous());
+    objective = cv::Mat::zeros(candidateMask.size(), CV_32F);
+    kernel = resolve(kernel);
+    if (kernel == Kernel::REFERENCE || !covers(gradientxy.size())) {
+        reference(gradientxy, gradThreshMask, candidateMask, objective);
+        return;
+    }
+    static thread_local CompactGradients grads;
+    compact(gradientxy, gradThreshMask, grads);
+    switch (kernel) {
+    case Kernel::AVX2:
+        avx2(grads, candidateMask, objective);
+        break;
+    case Kernel::SSE:
+        sse(grads, candidateMask, objective);
+        break;
+    default:
+        scalar(grads, candidateMask, objective);
+    }
+}
+
+void GradientObjective::compact(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask, CompactGradients& grads) const
+{
+    grads.x.clear();
+    grads.y.clear();
+    grads.gx.clear();
+    grads.gy.clear();
+    // raster order is kept, the kernels depend on it for identical sums.
+    // x is stored as grid column, y as lut row position y*step + phase
+    auto gradientp = gradientxy.ptr<cv::Vec2f>(0);
+    auto maskp = gradThreshMask.ptr<uchar>(0);
+    for (int y = 0; y < gradientxy.rows; y++) {
+        for (int x = 0; x < gradientxy.cols; x++, gradientp++, maskp++) {
+            if (!(*maskp)) continue;
+            grads.x.push_back(x / step);
+            grads.y.push_back(y*step + x % step);
+            grads.gx.push_back((*gradientp)[0]);
+            grads.gy.push_back((*gradientp)[1]);
+        }
+    }
+}
+
+void GradientObjective::reference(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask,
+                                  const cv::Mat& candidateMask, cv::Mat& objective) const
+{
+    auto objPtr = objective.ptr<float>(0);
+    auto cmaskPtr = candidateMask.ptr<uchar>(0);
+    for (int cy = 0; cy < gradientxy.rows; cy += step) {
+        for (int cx = 0; cx < gradientxy.cols; cx += step, objPtr++, cmaskPtr++) {
+            if (!*cmaskPtr) continue;
+            auto gradientp = gradientxy.ptr<cv::Vec2f>(0);
+            auto maskp = gradThreshMask.ptr<uchar>(0);
+            float result = 0;
+            for (int y = 0; y < gradientxy.rows; y++) {
+                for (int x = 0; x < gradientxy.cols; x++, gradientp++, maskp++) {
+                    if (!(*maskp)) continue;
+                    cv::Vec2f di = cv::normalize(cv::Vec2f(x - cx, y - cy)); // (xi - c)/||xi-c||
+                    const cv::Vec2f& gi = *gradientp;
+                    const float dotprod = di.dot(gi); // di^T*gi
+                    // only positive values, no square ( )^2
+                    result += max(dotprod, 0.0f);
+                }
+            }
+            *objPtr = result;
+        }
+    }
+}
+
+// first and last masked column of a candidate row, returns false for empty rows
+static bool maskedSpan(const uchar* cmask, int cols, int& first, int& last)
+{
+    first = 0;
+    while (first < cols && !cmask[first]) first++;
+    if (first == cols) return false;
+    last = cols - 1;
+    while (!cmask[last]) last--;
+    return true;
+}
+
+void GradientObjective::scalar(const CompactGradients& grads, const cv::Mat& candidateMask, cv::Mat& objective) const
+{
+    const size_t n = grads.x.size();
+    const float* center = lutCenter();
+    for (int cy = 0; cy < objective.rows; cy++) {
+        const uchar* cmask = candidateMask.ptr<uchar>(cy);
+        float* obj = objective.ptr<float>(cy);
+        for (int cx = 0; cx < objective.cols; cx++) {
+            if (!cmask[cx]) continue;
+            float result = 0;
+            for (size_t i = 0; i < n; i++) {
+                const float* row = center + 2*lutStride*(grads.y[i] - step*step*cy);
+                const int k = gridWidth - 1 - grads.x[i] + cx;
+                const float dotprod = row[k]*grads.gx[i] + row[lutStride + k]*grads.gy[i];
+                result += max(dotprod, 0.0f);
+            }
+            obj[cx] = result;
+        }
+    }
+}
+
+#ifdef GRADIENT_OBJECTIVE_X86
+
+__attribute__((target("sse2")))
+static void sseRow(const float* lutCenter, int lutStride, int width, int rowOffset, const std::vector<int>& gxpos,
+                   const std::vector<int>& gypos, const std::vector<float>& gx, const std::vector<float>& gy,
+                   int first, int last, float* out)
+{
+    const size_t n = gxpos.size();
+    const __m128 zero = _mm_setzero_ps();
+    for (int cx = first & ~3; cx <= last; cx += 4) {
+        __m128 acc = _mm_setzero_ps();
+        for (size_t i = 0; i < n; i++) {
+            const float* row = lutCenter + 2*lutStride*(gypos[i] - rowOffset);
+            const int k = width - 1 - gxpos[i] + cx;
+            const __m128 ux = _mm_loadu_ps(row + k);
+            const __m128 uy = _mm_loadu_ps(row + lutStride + k);
+            const __m128 dotprod = _mm_add_ps(_mm_mul_ps(ux, _mm_set1_ps(gx[i])),
+                                              _mm_mul_ps(uy, _mm_set1_ps(gy[i])));
+            acc = _mm_add_ps(acc, _mm_max_ps(dotprod, zero));
+        }
+        _mm_storeu_ps(out + cx, acc);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2Row(const float* lutCenter, int lutStride, int width, int rowOffset, const std::vector<int>& gxpos,
+                    const std::vector<int>& gypos, const std::vector<float>& gx, const std::vector<float>& gy,
+                    int first, int last, float* out)
+{
+    const size_t n = gxpos.size();
+    const __m256 zero = _mm256_setzero_ps();
+    for (int cx = first & ~7; cx <= last; cx += 8) {
+        __m256 acc = _mm256_setzero_ps();
+        for (size_t i = 0; i < n; i++) {
+            const float* row = lutCenter + 2*lutStride*(gypos[i] - rowOffset);
+            const int k = width - 1 - gxpos[i] + cx;
+            const __m256 ux = _mm256_loadu_ps(row + k);
+            const __m256 uy = _mm256_loadu_ps(row + lutStride + k);
+            // separate mul and add, a fused multiply-add would change the rounding
+            const __m256 dotprod = _mm256_add_ps(_mm256_mul_ps(ux, _mm256_set1_ps(gx[i])),
+                                                 _mm256_mul_ps(uy, _mm256_set1_ps(gy[i])));
+            acc = _mm256_add_ps(acc, _mm256_max_ps(dotprod, zero));
+        }
+        _mm256_storeu_ps(out + cx, acc);
+    }
+}
+
+#endif
+
+template<typename RowFunc>
+static void vectorized(const float* lutCenter, int lutStride, int gridWidth, int step, int vecWidth,
+                       const std::vector<int>& gxpos, const std::vector<int>& gypos,
+                       const std::vector<float>& gx, const std::vector<float>& gy,
+                       const cv::Mat& candidateMask, cv::Mat& objective, RowFunc rowFunc)
+{
+    // lane results are written for whole vectors, masked out candidates are reset afterwards
+    std::vector<float> rowbuf(((gridWidth + vecWidth - 1) / vecWidth) * vecWidth, 0.0f);
+    for (int cy = 0; cy < objective.rows; cy++) {
+        const uchar* cmask = candidateMask.ptr<uchar>(cy);
+        int first, last;
+        if (!maskedSpan(cmask, objective.cols, first, last)) continue;
+        rowFunc(lutCenter, lutStride, gridWidth, step*step*cy, gxpos, gypos, gx, gy, first, last, rowbuf.data());
+        float* obj = objective.ptr<float>(cy);
+        for (int cx = first; cx <= last; cx++) {
+            if (cmask[cx]) obj[cx] = rowbuf[cx];
+        }
+    }
+}
+
+void GradientObjective::sse(const CompactGradients& grads, const cv::Mat& candidateMask, cv::Mat& objective) const
+{
+#ifdef GRADIENT_OBJECTIVE_X86
+    vectorized(lutCenter(), lutStride, gridWidth, step, 4, grads.x, grads.y, grads.gx, grads.gy,
+               candidateMask, objective, sseRow);
+#else
+    scalar(grads, candidateMask, objective);
+#endif
+}
+
+void GradientObjective::avx2(const CompactGradients& grads, const cv::Mat& candidateMask, cv::Mat& objective) const
+{
+#ifdef GRADIENT_OBJECTIVE_X86
+    vectorized(lutCenter(), lutStride, gridWidth, step, 8, grads.x, grads.y, grads.gx, grads.gy,
+               candidateMask, objective, avx2Row);
+#else
+    scalar(grads, candidateMask, objective);
+#endif
+}
+
+bool GradientObjective::isSupported(Kernel kernel)
+{
+    switch (kernel) {
+    case Kernel::AUTO:
+    case Kernel::REFERENCE:
+    case Kernel::SCALAR:
+        return true;
+#ifdef GRADIENT_OBJECTIVE_X86
+    case Kernel::SSE:
+        return __builtin_cpu_supports("sse2");
+    case Kernel::AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+GradientObjective::Kernel GradientObjective::resolve(Kernel kernel)
+{
+    if (kernel != Kernel::AUTO) {
+        return isSupported(kernel) ? kernel : Kernel::SCALAR;
+    }
+    for (auto k : {Kernel::AVX2, Kernel::SSE}) {
+        if (isSupported(k)) return k;
+    }
+    return Kernel::SCALAR;
+}
+
+void GradientObjective::setDefaultKernel(Kernel kernel)
+{
+    defKernel = kernel;
+}
+
+GradientObjective::Kernel GradientObjective::defaultKernel()
+{
+    return defKernel;
+}
+
+string GradientObjective::kernelName(Kernel kernel)
+{
+    switch (kernel) {
+    case Kernel::AUTO: return "auto";
+    case Kernel::REFERENCE: return "reference";
+    case Kernel::SCALAR: return "scalar";
+    case Kernel::SSE: return "sse";
+    case Kernel::AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+GradientObjective::Kernel GradientObjective::kernelFromName(const string& name)
+{
+    for (auto k : {Kernel::AUTO, Kernel::REFERENCE, Kernel::SCALAR, Kernel::SSE, Kernel::AVX2}) {
+        if (kernelName(k) == name) return k;
+    }
+    throw runtime_error("unknown pupil kernel " + name);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+/**
+ * @brief Evaluates the means of gradients objective for all candidate centers
+ * selected by a mask.
+ *
+ * The unit displacement vectors (xi - c)/||xi - c|| only depend on the pixel offset,
+ * so they are precomputed once for a fixed map width. The vectorized kernels process
+ * several neighbouring candidates per gradient and sum the gradients in the same order
+ * as the reference implementation. All kernels thus produce identical candidate maps.
+ *
+ * With a step > 1 only candidates at multiples of step are evaluated. Candidate mask and
+ * objective then have the size of this grid, see gridSize(), and the lookup table holds
+ * one row per vertical offset and horizontal phase, so neighbouring grid candidates
+ * still map to neighbouring entries. Grid values equal the full map at the same centers.
+ */
+class GradientObjective
+{
+public:
+    enum class Kernel { AUTO, REFERENCE, SCALAR, SSE, AVX2 };
+
+    GradientObjective(int mapWidth, int maxMapHeight, int step = 1);
+
+    void operator()(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask,
+                    const cv::Mat& candidateMask, cv::Mat& objective) const;
+    void operator()(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask,
+                    const cv::Mat& candidateMask, cv::Mat& objective, Kernel kernel) const;
+    bool covers(const cv::Size& mapSize) const;
+    cv::Size gridSize(const cv::Size& mapSize) const;
+
+    static bool isSupported(Kernel kernel);
+    static Kernel resolve(Kernel kernel);
+    static void setDefaultKernel(Kernel kernel);
+    static Kernel defaultKernel();
+    static std::string kernelName(Kernel kernel);
+    static Kernel kernelFromName(const std::string& name);
+
+private:
+    struct CompactGradients {
+        std::vector<int> x;
+        std::vector<int> y;
+        std::vector<float> gx;
+        std::vector<float> gy;
+    };
+
+    int width;
+    int maxHeight;
+    int step;
+    int gridWidth;
+    int lutStride;
+    std::vector<float> lut;
+    static Kernel defKernel;
+
+    const float* lutCenter() const;
+    void compact(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask, CompactGradients& grads) const;
+    void reference(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask,
+                   const cv::Mat& candidateMask, cv::Mat& objective) const;
+    void scalar(const CompactGradients& grads, const cv::Mat& candidateMask, cv::Mat& objective) const;
+    void sse(const CompactGradients& grads, const cv::Mat& candidateMask, cv::Mat& objective) const;
+    void avx2(const CompactGradients& grads, const cv::Mat& candidateMask, cv::Mat& objective) const;
+};
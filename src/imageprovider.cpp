@@ -1,6 +1,8 @@
 #include "imageprovider.h"
 
+#include <algorithm>
 #include <fstream>
+#include <limits>
 #include <boost/tokenizer.hpp>
 
 
@@ -8,6 +10,23 @@ using namespace std;
 
 typedef boost::tokenizer<boost::char_separator<char> > CharTokenizer;
 
+bool ImageProvider::load(size_t, cv::Mat&, std::string&, std::string&)
+{
+    throw logic_error("image provider does not support random access");
+}
+
+void ImageProvider::toGray(const cv::Mat& frame, cv::Mat& gray)
+{
+    gray.create(frame.size(), CV_8UC1);
+    for (int r = 0; r < frame.rows; r++) {
+        const unsigned char* src = frame.ptr<unsigned char>(r);
+        unsigned char* dst = gray.ptr<unsigned char>(r);
+        for (int c = 0; c < frame.cols; c++) {
+            dst[c] = (static_cast<unsigned int>(src[3*c]) + src[3*c+1] + src[3*c+2]) / 3;
+        }
+    }
+}
+
 /**
  * @brief CvVideoImageProvider::CvVideoImageProvider
  */
@@ -37,13 +56,18 @@ CvVideoImageProvider::CvVideoImageProvider(const string &infile, cv::Size size)
 
 bool CvVideoImageProvider::get(cv::Mat &frame)
 {
-    bool ret = capture.read(frame);
-    if (ret && desiredSize != cv::Size() && frame.size() != desiredSize) {
-        cv::Mat tmp;
-        cv::resize(frame, tmp, desiredSize, 0, 0, cv::INTER_LINEAR);
-        frame = tmp;
+    //once the camera ignored the desired size, frames are read into the provider's buffer and
+    //resized into the frame, so recycled frames keep their buffers
+    if (resizing) {
+        if (!capture.read(image)) return false;
+    } else {
+        if (!capture.read(frame)) return false;
+        if (desiredSize == cv::Size() || frame.size() == desiredSize) return true;
+        resizing = true;
+        image = frame.clone();
     }
-    return ret;
+    cv::resize(image, frame, desiredSize, 0, 0, cv::INTER_LINEAR);
+    return true;
 }
 
 string CvVideoImageProvider::getLabel()
@@ -93,23 +117,47 @@ BatchImageProvider::BatchImageProvider(const std::vector<string> &filelist)
 {
 }
 
+BatchImageProvider::BatchImageProvider(const BatchImageProvider& list, size_t begin, size_t end)
+    : position(-1),
+      filenames(list.filenames.begin() + begin, list.filenames.begin() + end),
+      labels(list.labels.begin() + min(begin, list.labels.size()), list.labels.begin() + min(end, list.labels.size()))
+{
+}
+
+BatchImageProvider::BatchImageProvider(const BatchImageProvider& list, const std::vector<size_t>& entries)
+    : position(-1)
+{
+    for (size_t index : entries) {
+        filenames.push_back(list.filenames.at(index));
+        labels.push_back(index < list.labels.size() ? list.labels[index] : "");
+    }
+}
+
 bool BatchImageProvider::get(cv::Mat &frame)
 {
     if (position < (int)filenames.size()-1) {
         position++;
-        string filename(filenames.at(position));
-        cv::Mat tmp(cv::imread(filename));
-        frame = tmp;
-        if (frame.empty()) {
-            throw runtime_error(string("Cannot read image from " + filename));
-        } else {
-            return true;
-        }
+        string label, id;
+        return load(position, frame, label, id);
     }
     frame = cv::Mat();
     return false;
 }
 
+bool BatchImageProvider::load(size_t index, cv::Mat& frame, string& label, string& id)
+{
+    if (index >= filenames.size()) return false;
+    string filename(filenames[index]);
+    cv::Mat tmp(cv::imread(filename));
+    frame = tmp;
+    if (frame.empty()) {
+        throw runtime_error(string("Cannot read image from " + filename));
+    }
+    label = index < labels.size() ? labels[index] : "";
+    id = filename;
+    return true;
+}
+
 string BatchImageProvider::getLabel()
 {
     if (position < (int)labels.size() && position >= 0) {
@@ -126,3 +174,193 @@ string BatchImageProvider::getId()
     return "";
 }
 
+
+
+/**
+ * @brief LatestFrameProvider::LatestFrameProvider
+ */
+
+LatestFrameProvider::LatestFrameProvider(std::unique_ptr<ImageProvider> source)
+    : source(std::move(source))
+{
+    captureThread = std::thread(&LatestFrameProvider::capture, this);
+}
+
+LatestFrameProvider::~LatestFrameProvider()
+{
+    interrupt();
+    captureThread.join();
+}
+
+void LatestFrameProvider::interrupt()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        frameAvailable.notify_all();
+    }
+    //the capture thread may block in the source until it is interrupted
+    source->interrupt();
+}
+
+void LatestFrameProvider::capture()
+{
+    cv::Mat captured;
+    while (true) {
+        {
+            lock_guard<std::mutex> lock(mutex);
+            if (stopping) break;
+        }
+        bool ok = source->get(captured);
+        lock_guard<std::mutex> lock(mutex);
+        if (!ok) {
+            ended = true;
+            frameAvailable.notify_all();
+            break;
+        }
+        //the replaced frame's buffer is captured into next
+        std::swap(captured, latest);
+        latestLabel = source->getLabel();
+        latestId = source->getId();
+        if (fresh) dropped++;
+        fresh = true;
+        frameAvailable.notify_all();
+    }
+}
+
+bool LatestFrameProvider::get(cv::Mat& frame)
+{
+    unique_lock<std::mutex> lock(mutex);
+    frameAvailable.wait(lock, [this]() { return fresh || ended || stopping; });
+    if (!fresh || stopping) return false;
+    //hands the caller's buffer back for capturing
+    std::swap(frame, latest);
+    label = latestLabel;
+    id = latestId;
+    fresh = false;
+    return true;
+}
+
+string LatestFrameProvider::getLabel()
+{
+    lock_guard<std::mutex> lock(mutex);
+    return label;
+}
+
+string LatestFrameProvider::getId()
+{
+    lock_guard<std::mutex> lock(mutex);
+    return id;
+}
+
+long LatestFrameProvider::droppedFrames()
+{
+    lock_guard<std::mutex> lock(mutex);
+    return dropped;
+}
+
+
+/**
+ * @brief PrefetchingImageProvider::PrefetchingImageProvider
+ */
+
+PrefetchingImageProvider::PrefetchingImageProvider(std::unique_ptr<ImageProvider> source, int threadcount, size_t depth)
+    : source(std::move(source)), slots(max<size_t>(1, depth)), endIndex(numeric_limits<size_t>::max())
+{
+    for (int i = 0; i < max(1, threadcount); i++) {
+        threads.emplace_back(&PrefetchingImageProvider::prefetch, this);
+    }
+}
+
+PrefetchingImageProvider::~PrefetchingImageProvider()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// waits for a free slot in the reorder buffer, false once the source is exhausted
+bool PrefetchingImageProvider::claim(size_t& index)
+{
+    unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() {
+        return stopping || nextIndex >= endIndex || nextIndex < nextOut + slots.size();
+    });
+    if (stopping || nextIndex >= endIndex) return false;
+    index = nextIndex++;
+    return true;
+}
+
+void PrefetchingImageProvider::prefetch()
+{
+    const bool concurrent = source->randomAccess();
+    while (true) {
+        size_t index = 0;
+        Slot slot;
+        bool ok;
+        try {
+            if (concurrent) {
+                if (!claim(index)) return;
+                ok = source->load(index, slot.frame, slot.label, slot.id);
+            } else {
+                // claimed under the source lock, so the frames are read in index order
+                lock_guard<std::mutex> sourcelock(sourcemutex);
+                if (!claim(index)) return;
+                ok = source->get(slot.frame);
+                if (ok) {
+                    slot.label = source->getLabel();
+                    slot.id = source->getId();
+                }
+            }
+        } catch (...) {
+            lock_guard<std::mutex> lock(mutex);
+            if (!error) error = current_exception();
+            endIndex = min(endIndex, index);
+            changed.notify_all();
+            return;
+        }
+        lock_guard<std::mutex> lock(mutex);
+        if (ok) {
+            slot.ready = true;
+            swap(slots[index % slots.size()], slot);
+        } else {
+            endIndex = min(endIndex, index);
+        }
+        changed.notify_all();
+    }
+}
+
+bool PrefetchingImageProvider::get(cv::Mat& frame)
+{
+    unique_lock<std::mutex> lock(mutex);
+    Slot& slot = slots[nextOut % slots.size()];
+    changed.wait(lock, [this, &slot]() { return slot.ready || nextOut >= endIndex; });
+    if (!slot.ready) {
+        if (error) rethrow_exception(error);
+        return false;
+    }
+    swap(frame, slot.frame);
+    label = slot.label;
+    id = slot.id;
+    slot.ready = false;
+    nextOut++;
+    changed.notify_all();
+    return true;
+}
+
+string PrefetchingImageProvider::getLabel()
+{
+    lock_guard<std::mutex> lock(mutex);
+    return label;
+}
+
+string PrefetchingImageProvider::getId()
+{
+    lock_guard<std::mutex> lock(mutex);
+    return id;
+}
@@ -5,6 +5,11 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
 
 class ImageProvider
 {
@@ -13,6 +18,16 @@ class ImageProvider
     virtual bool get(cv::Mat& frame) = 0;
     virtual std::string getLabel() = 0;
     virtual std::string getId() = 0;
+    // BGR to gray with the same channel average as dlib::assign_image
+    static void toGray(const cv::Mat& frame, cv::Mat& gray);
+    // frames captured but never handed out so far
+    virtual long droppedFrames() { return 0; }
+    // wakes up a get() that blocks on a live source, later calls of get() return false
+    virtual void interrupt() {}
+    // providers whose frames are read independently of each other, e.g. image files,
+    // can be read by several threads through load()
+    virtual bool randomAccess() { return false; }
+    virtual bool load(size_t index, cv::Mat& frame, std::string& label, std::string& id);
 
   protected:
     cv::Mat image;
@@ -32,6 +47,7 @@ public:
 private:
     cv::VideoCapture capture;
     cv::Size desiredSize;
+    bool resizing = false;
 };
 
 class BatchImageProvider : public ImageProvider
@@ -40,10 +56,19 @@ public:
     BatchImageProvider();
     BatchImageProvider(const std::string& batchfile);
     BatchImageProvider(const std::vector<std::string>& filelist);
+    // entries [begin, end) of another list
+    BatchImageProvider(const BatchImageProvider& list, size_t begin, size_t end);
+    // the given entries of another list
+    BatchImageProvider(const BatchImageProvider& list, const std::vector<size_t>& entries);
+    size_t size() const { return filenames.size(); }
+    const std::string& filename(size_t index) const { return filenames[index]; }
+    std::string label(size_t index) const { return index < labels.size() ? labels[index] : ""; }
 
     virtual bool get(cv::Mat& frame);
     virtual std::string getLabel();
     virtual std::string getId();
+    virtual bool randomAccess() { return true; }
+    virtual bool load(size_t index, cv::Mat& frame, std::string& label, std::string& id);
     virtual ~BatchImageProvider() {}
 
 protected:
@@ -52,3 +77,74 @@ protected:
     std::vector<std::string> labels;
 };
 
+
+/**
+ * @brief Keeps only the newest frame of a live source.
+ *
+ * A capture thread reads the wrapped provider continuously. get() waits for a frame newer
+ * than the last one handed out, frames replaced before they were taken are counted as dropped.
+ */
+class LatestFrameProvider : public ImageProvider
+{
+public:
+    LatestFrameProvider(std::unique_ptr<ImageProvider> source);
+    virtual bool get(cv::Mat& frame);
+    virtual std::string getLabel();
+    virtual std::string getId();
+    virtual long droppedFrames();
+    virtual void interrupt();
+    virtual ~LatestFrameProvider();
+
+private:
+    std::unique_ptr<ImageProvider> source;
+    std::mutex mutex;
+    std::condition_variable frameAvailable;
+    cv::Mat latest;
+    std::string latestLabel, latestId;
+    std::string label, id;
+    bool fresh = false;
+    bool ended = false;
+    bool stopping = false;
+    long dropped = 0;
+    std::thread captureThread;
+    void capture();
+};
+
+/**
+ * @brief Reads frames ahead of the pipeline on several threads.
+ *
+ * Frames are kept in a bounded reorder buffer and handed out in their original order with
+ * their labels and ids. Random access sources are decoded concurrently, sequential sources
+ * such as videos are read by one thread at a time.
+ */
+class PrefetchingImageProvider : public ImageProvider
+{
+public:
+    PrefetchingImageProvider(std::unique_ptr<ImageProvider> source, int threadcount, size_t depth);
+    virtual bool get(cv::Mat& frame);
+    virtual std::string getLabel();
+    virtual std::string getId();
+    virtual ~PrefetchingImageProvider();
+
+private:
+    struct Slot {
+        cv::Mat frame;
+        std::string label;
+        std::string id;
+        bool ready = false;
+    };
+    std::unique_ptr<ImageProvider> source;
+    std::mutex sourcemutex;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<Slot> slots;
+    size_t nextIndex = 0;
+    size_t nextOut = 0;
+    size_t endIndex;
+    bool stopping = false;
+    std::exception_ptr error;
+    std::string label, id;
+    std::vector<std::thread> threads;
+    bool claim(size_t& index);
+    void prefetch();
+};
@@ -7,6 +7,7 @@
 
 #include "workerthread.h"
 #include "gazergui.h"
+#include "gradientobjective.h"
 
 using namespace std;
 
@@ -63,6 +64,24 @@ private:
        copyCheckArg("svm-epsilon", params.epsilon);
        copyCheckArg("svm-epsilon-insensitivity", params.epsilon_insensitivity);
        copyCheckArg("pca-epsilon", params.pca_epsilon);
+       if (options.count("svm-gamma")) {
+           vector<string> values;
+           boost::split(values, options["svm-gamma"].as<string>(), boost::is_any_of(", "), boost::token_compress_on);
+           for (const auto& value : values) {
+               try {
+                   params.gammaGrid.push_back(boost::lexical_cast<double>(value));
+               } catch (boost::bad_lexical_cast&) {
+                   throw po::error("invalid svm-gamma value " + value);
+               }
+           }
+       }
+       copyCheckArg("svm-c-steps", params.cSteps);
+       copyCheckArg("cv-folds", params.folds);
+       copyCheckArg("train-threads", params.threads);
+       if (params.cSteps.get_value_or(1) < 1) throw po::error("svm-c-steps has to be at least 1");
+       if (params.folds.get_value_or(2) < 2) throw po::error("cv-folds has to be at least 2");
+       if (params.threads.get_value_or(1) < 1) throw po::error("train-threads has to be at least 1");
+       params.successiveHalving = options.count("successive-halving");
        return params;
     }
 
@@ -77,9 +96,26 @@ private:
                 ("novis", "do not display frames")
                 ("quiet,q", "do not print statistics")
                 ("limitfps", po::value<double>(), "slow down display fps to arg")
+                ("shards", po::value<int>(), "split batch input into arg parts processed by independent pipelines without display, results keep the list order")
+                ("prefetch", po::value<int>(), "decode video or image input ahead of the pipeline on arg threads, keeping the frame order")
+                ("realtime", "capture live input continuously and process only the newest frame, dropping frames the pipeline cannot keep up with")
                 ("streamppm", po::value<string>(), "stream ppm files to arg. e.g. "
                                                    ">(ffmpeg -f image2pipe -vcodec ppm -r 30 -i - -r 30 -preset ultrafast out.mp4)")
-                ("dump-estimates", po::value<string>(), "dump estimated values to file")
+                ("dump-estimates", po::value<string>(), "dump estimated values of all faces to file")
+                ("estimates-format", po::value<string>(), "format of --dump-estimates: tsv (default), binary or columnar")
+                ("metrics", po::value<string>(), "export per stage latencies and queue depths to file arg or serve them on tcp:<port> of localhost")
+                ("metrics-format", po::value<string>(), "metrics export format: json (lines) or prometheus")
+                ("metrics-interval", po::value<double>(), "seconds between metrics exports (default 5)")
+                ("trace", po::value<string>(), "write a timeline of the pipeline threads to file arg in the chrome trace format")
+                ("pupil-kernel", po::value<string>(), "pupil finder kernel: auto, reference, scalar, sse, or avx2")
+                ("pupil-search", po::value<string>(), "pupil center search: exhaustive or coarse")
+                ("detect-split", po::value<int>(), "scan each frame in parallel as arg overlapping strips plus coarser pyramid bands to reduce latency")
+                ("detect-scale", po::value<int>(), "detect faces on the frame downscaled by arg (1, 2, 4, ...), landmarks still use the full frame")
+                ("min-face-size", po::value<int>(), "skip detector pyramid levels for faces smaller than arg pixels")
+                ("max-face-size", po::value<int>(), "skip detector pyramid levels for faces larger than arg pixels")
+                ("track-faces", po::value<int>(), "detect faces in full frames only every arg frames and track them in between")
+                ("track-min-confidence", po::value<double>(), "detect faces in the full frame if tracking confidence drops below arg")
+                ("track-max-age", po::value<int>(), "forget face tracks and their smoothing state after arg frames without the face")
                 ("mirror", "mirror output");
         po::options_description inputops("input options");
         inputops.add_options()
@@ -88,6 +124,7 @@ private:
                 ("image,i", po::value<string>(), "process single image arg")
                 ("port,p", po::value<string>(), "expect image on yarp port arg")
                 ("batch,b", po::value<string>(), "batch process image filenames from arg")
+                ("features", po::value<string>(), "train from feature cache arg without reading any image")
                 ("size", po::value<string>(), "request image size arg and scale if required")
                 ("fps", po::value<int>(), "request video with arg frames per second");
         po::options_description classifyopts("classification options");
@@ -103,14 +140,21 @@ private:
                 ("horizontal-gaze-tolerance", po::value<double>(), "mutual gaze tolerance in deg")
                 ("vertical-gaze-tolerance", po::value<double>(), "mutual gaze tolerance in deg")
                 ("train-gaze-estimator", po::value<string>(), "train gaze estimator and save to arg")
-                ("train-verticalgaze-estimator", po::value<string>(), "train vertical gaze estimator and save to arg");
+                ("train-verticalgaze-estimator", po::value<string>(), "train vertical gaze estimator and save to arg")
+                ("feature-cache", po::value<string>(), "keep the features of batch input in cache file arg, only new or changed images are processed and training runs from the cache")
+                ("compile-models", po::value<string>(), "write compiled copies of the shape model and the loaded classifiers to their filenames with suffix arg");
         po::options_description trainopts("parameters applied to all active trainers");
         trainopts.add_options()
                 ("svm-c", po::value<double>(), "svm c parameter")
                 ("svm-epsilon", po::value<double>(), "svm epsilon parameter")
                 ("svm-epsilon-insensitivity", po::value<double>(), "svmr insensitivity parameter")
                 ("feature-set", po::value<string>(), "use feature set arg")
-                ("pca-epsilon", po::value<double>(), "pca dimension reduction depending on arg");
+                ("pca-epsilon", po::value<double>(), "pca dimension reduction depending on arg")
+                ("svm-gamma", po::value<string>(), "comma separated rbf gamma values searched for the gaze classifier (default 0.16,0.2,0.3)")
+                ("svm-c-steps", po::value<int>(), "number of halved class weights searched per gamma for the gaze classifier (default 6)")
+                ("cv-folds", po::value<int>(), "cross validation folds of the gaze classifier search (default 3)")
+                ("train-threads", po::value<int>(), "threads training the search grid in parallel (default: all cores)")
+                ("successive-halving", "evaluate the search grid fold by fold and keep only the better half after each fold");
         allopts.add(desc).add(inputops).add(classifyopts).add(trainopts);
         try {
             po::store(po::parse_command_line(argc, argv, allopts), options);
@@ -119,7 +163,7 @@ private:
                 std::exit(0);
             }
             po::notify(options);
-            for (const auto& s : { "camera", "image", "video", "port", "batch"}) {
+            for (const auto& s : { "camera", "image", "video", "port", "batch", "features"}) {
                 if (options.count(s)) {
                     if (worker.inputType.empty()) {
                         worker.inputParam = options[s].as<string>();
@@ -141,6 +185,19 @@ private:
             }
             copyCheckArg("fps", worker.desiredFps);
             copyCheckArg("threads", worker.threadcount);
+            copyCheckArg("detect-split", worker.detectionSplit);
+            copyCheckArg("detect-scale", worker.detectionScale);
+            if (worker.detectionScale < 1 || (worker.detectionScale & (worker.detectionScale - 1))) {
+                throw po::error("detect-scale has to be a power of two");
+            }
+            copyCheckArg("min-face-size", worker.minFaceSize);
+            copyCheckArg("max-face-size", worker.maxFaceSize);
+            if (worker.maxFaceSize && worker.maxFaceSize < worker.minFaceSize) {
+                throw po::error("max-face-size is smaller than min-face-size");
+            }
+            copyCheckArg("track-faces", worker.keyframeInterval);
+            copyCheckArg("track-min-confidence", worker.minTrackingConfidence);
+            copyCheckArg("track-max-age", worker.trackMaxAge);
             copyCheckArg("streamppm", worker.streamppm);
             copyCheckArg("model", worker.modelfile);
             copyCheckArg("classify-gaze", worker.classifyGaze);
@@ -155,9 +212,69 @@ private:
             copyCheckArg("train-verticalgaze-estimator", worker.trainVerticalGazeEstimator);
             copyCheckArg("limitfps", worker.limitFps);
             copyCheckArg("dump-estimates", worker.dumpEstimates);
+            copyCheckArg("estimates-format", worker.estimatesFormat);
+            if (!EstimateWriter::isFormat(worker.estimatesFormat)) {
+                throw po::error("unknown estimates format " + worker.estimatesFormat);
+            }
+            copyCheckArg("metrics", worker.metricsTarget);
+            copyCheckArg("metrics-format", worker.metricsFormat);
+            copyCheckArg("metrics-interval", worker.metricsInterval);
+            copyCheckArg("trace", worker.traceFile);
+            if (worker.metricsFormat != "json" && worker.metricsFormat != "prometheus") {
+                throw po::error("unknown metrics format " + worker.metricsFormat);
+            }
+            if (worker.metricsInterval <= 0) throw po::error("metrics-interval has to be positive");
+            if (worker.metricsTarget.compare(0, 4, "tcp:") == 0) {
+                try {
+                    boost::lexical_cast<unsigned short>(worker.metricsTarget.substr(4));
+                } catch (boost::bad_lexical_cast&) {
+                    throw po::error("invalid metrics port " + worker.metricsTarget.substr(4));
+                }
+            }
+            copyCheckArg("compile-models", worker.compileModelSuffix);
+            copyCheckArg("feature-cache", worker.featureCache);
+            if (!worker.featureCache.empty()) {
+                if (worker.inputType != "batch") throw po::error("--feature-cache requires batch input");
+                if (!worker.dumpEstimates.empty()) throw po::error("--feature-cache cannot be combined with --dump-estimates");
+            }
             copyCheckArg("horizontal-gaze-tolerance", worker.horizGazeTolerance);
             copyCheckArg("vertical-gaze-tolerance", worker.verticalGazeTolerance);
             if (options.count("quiet")) worker.showstats = false;
+            if (options.count("realtime")) worker.realtime = true;
+            if (worker.realtime && worker.inputType != "camera" && worker.inputType != "port") {
+                throw po::error("--realtime requires camera or port input");
+            }
+            copyCheckArg("shards", worker.shards);
+            if (worker.shards > 1 && worker.inputType != "batch") {
+                throw po::error("--shards requires batch input");
+            }
+            copyCheckArg("prefetch", worker.prefetchThreads);
+            if (worker.prefetchThreads < 0) {
+                throw po::error("prefetch thread count must not be negative");
+            }
+            if (worker.prefetchThreads && worker.realtime) {
+                throw po::error("--prefetch and --realtime cannot be combined");
+            }
+            if (options.count("pupil-kernel")) {
+                try {
+                    auto kernel = GradientObjective::kernelFromName(options["pupil-kernel"].as<string>());
+                    if (!GradientObjective::isSupported(kernel)) {
+                        cerr << "Warning: pupil kernel " << GradientObjective::kernelName(kernel)
+                             << " not supported by this cpu, using "
+                             << GradientObjective::kernelName(GradientObjective::resolve(kernel)) << endl;
+                    }
+                    GradientObjective::setDefaultKernel(kernel);
+                } catch (runtime_error& e) {
+                    throw po::error(e.what());
+                }
+            }
+            if (options.count("pupil-search")) {
+                try {
+                    worker.pupilSearch = PupilFinder::strategyFromName(options["pupil-search"].as<string>());
+                } catch (runtime_error& e) {
+                    throw po::error(e.what());
+                }
+            }
             gui.setHorizGazeTolerance(worker.horizGazeTolerance);
             gui.setVerticalGazeTolerance(worker.verticalGazeTolerance);
             bool mirror = false;
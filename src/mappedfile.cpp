@@ -0,0 +1,42 @@
+#include "mappedfile.h"
+
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+MappedFile::MappedFile(const string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("Error: Cannot open " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        throw runtime_error("Error: Cannot map empty file " + filename);
+    }
+    _size = st.st_size;
+    _data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (_data == MAP_FAILED) {
+        _data = nullptr;
+        throw runtime_error("Error: Cannot map " + filename);
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (_data) munmap(_data, _size);
+}
+
+const char* MappedFile::data() const
+{
+    return static_cast<const char*>(_data);
+}
+
+size_t MappedFile::size() const
+{
+    return _size;
+}
@@ -0,0 +1,309 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+static constexpr int MAX_OCTAVE = 40;
+// stop waiting for the next export this often to check for shutdown
+static constexpr int POLL_MS = 200;
+
+static int bucketIndex(uint64_t micros) {
+    if (micros < 16) return micros;
+    int e = min(63 - __builtin_clzll(micros), MAX_OCTAVE);
+    int sub = e == MAX_OCTAVE && micros >> (MAX_OCTAVE + 1) ? 7 : (micros >> (e - 3)) & 7;
+    return 16 + (e - 4)*8 + sub;
+}
+
+static double bucketUpperBound(int bucket) {
+    if (bucket < 16) return bucket;
+    int e = (bucket - 16)/8 + 4;
+    int sub = (bucket - 16)%8;
+    return std::ldexp(8 + sub + 1, e - 3) - 1;
+}
+
+void LatencyHistogram::record(uint64_t micros)
+{
+    buckets[bucketIndex(micros)].fetch_add(1, memory_order_relaxed);
+    count.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(micros, memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+    Snapshot s;
+    for (int b = 0; b < BUCKETS; b++) {
+        s.buckets[b] = buckets[b].load(memory_order_relaxed);
+    }
+    s.count = count.load(memory_order_relaxed);
+    s.sum = sum.load(memory_order_relaxed);
+    return s;
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::Snapshot::operator-(const Snapshot& earlier) const
+{
+    Snapshot s;
+    for (int b = 0; b < BUCKETS; b++) {
+        s.buckets[b] = buckets[b] - earlier.buckets[b];
+    }
+    s.count = count - earlier.count;
+    s.sum = sum - earlier.sum;
+    return s;
+}
+
+double LatencyHistogram::Snapshot::quantile(double q) const
+{
+    uint64_t total = 0;
+    for (uint64_t n : buckets) total += n;
+    if (!total) return 0;
+    const uint64_t rank = max<uint64_t>(1, std::ceil(q*total));
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank) return bucketUpperBound(b);
+    }
+    return bucketUpperBound(BUCKETS - 1);
+}
+
+/**
+ * @brief Metrics
+ */
+
+atomic<bool> Metrics::active{false};
+array<LatencyHistogram, STAGES> Metrics::histograms;
+array<atomic<long>, GAUGES> Metrics::gauges{};
+
+void Metrics::enable()
+{
+    active.store(true, memory_order_relaxed);
+}
+
+bool Metrics::enabled()
+{
+    return active.load(memory_order_relaxed);
+}
+
+Metrics::Clock::time_point Metrics::now()
+{
+    return enabled() ? Clock::now() : Clock::time_point();
+}
+
+void Metrics::record(Stage stage, Clock::time_point start, Clock::time_point end)
+{
+    // intervals that began before metrics were enabled are skipped
+    if (start == Clock::time_point() || end < start) return;
+    histograms[static_cast<int>(stage)].record(chrono::duration_cast<chrono::microseconds>(end - start).count());
+}
+
+void Metrics::record(Stage stage, Clock::time_point start)
+{
+    if (enabled()) record(stage, start, Clock::now());
+}
+
+void Metrics::setGauge(Gauge gauge, long value)
+{
+    if (enabled()) gauges[static_cast<int>(gauge)].store(value, memory_order_relaxed);
+}
+
+Metrics::Snapshot Metrics::snapshot()
+{
+    Snapshot s;
+    for (int i = 0; i < STAGES; i++) {
+        s[i] = histograms[i].snapshot();
+    }
+    return s;
+}
+
+string Metrics::stageName(Stage stage)
+{
+    static const char* names[STAGES] = {"capture", "detection_wait", "detection", "alignment_wait", "alignment",
+                                        "regression_wait", "pupils", "face_features", "lid_features", "eye_hog",
+                                        "classification", "output_wait", "consumer", "end_to_end"};
+    return names[static_cast<int>(stage)];
+}
+
+string Metrics::gaugeName(Gauge gauge)
+{
+    static const char* names[GAUGES] = {"detection", "shape", "regression"};
+    return names[static_cast<int>(gauge)];
+}
+
+string Metrics::json(const Snapshot& current, const Snapshot& previous)
+{
+    ostringstream out;
+    out << "{\"time_ms\":" << chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch()).count()
+        << ",\"stages\":{";
+    for (int i = 0; i < STAGES; i++) {
+        const LatencyHistogram::Snapshot window = current[i] - previous[i];
+        out << (i ? "," : "") << "\"" << stageName(static_cast<Stage>(i)) << "\":{"
+            << "\"count\":" << current[i].count
+            << ",\"sum_us\":" << current[i].sum
+            << ",\"window_count\":" << window.count
+            << ",\"p50_us\":" << window.quantile(0.5)
+            << ",\"p95_us\":" << window.quantile(0.95)
+            << ",\"p99_us\":" << window.quantile(0.99) << "}";
+    }
+    out << "},\"queues\":{";
+    for (int i = 0; i < GAUGES; i++) {
+        out << (i ? "," : "") << "\"" << gaugeName(static_cast<Gauge>(i)) << "\":"
+            << gauges[i].load(memory_order_relaxed);
+    }
+    out << "}}\n";
+    return out.str();
+}
+
+string Metrics::prometheus(const Snapshot& current, const Snapshot& previous)
+{
+    ostringstream out;
+    out << "# HELP gazetool_stage_latency_seconds Time frames and faces spend in each pipeline stage\n"
+        << "# TYPE gazetool_stage_latency_seconds summary\n";
+    for (int i = 0; i < STAGES; i++) {
+        const string stage = stageName(static_cast<Stage>(i));
+        const LatencyHistogram::Snapshot window = current[i] - previous[i];
+        for (double q : {0.5, 0.95, 0.99}) {
+            out << "gazetool_stage_latency_seconds{stage=\"" << stage << "\",quantile=\"" << q << "\"} "
+                << window.quantile(q)/1e6 << "\n";
+        }
+        out << "gazetool_stage_latency_seconds_sum{stage=\"" << stage << "\"} " << current[i].sum/1e6 << "\n"
+            << "gazetool_stage_latency_seconds_count{stage=\"" << stage << "\"} " << current[i].count << "\n";
+    }
+    out << "# HELP gazetool_queue_depth Frames waiting in the output queue of a stage\n"
+        << "# TYPE gazetool_queue_depth gauge\n";
+    for (int i = 0; i < GAUGES; i++) {
+        out << "gazetool_queue_depth{queue=\"" << gaugeName(static_cast<Gauge>(i)) << "\"} "
+            << gauges[i].load(memory_order_relaxed) << "\n";
+    }
+    return out.str();
+}
+
+/**
+ * @brief MetricsExporter
+ */
+
+MetricsExporter::MetricsExporter(const string& target, bool prometheus, double interval)
+    : target(target), prometheus(prometheus),
+      interval(max<long>(1, static_cast<long>(interval*1000))), previous(Metrics::snapshot())
+{
+    if (target.compare(0, 4, "tcp:") == 0) {
+        int port = stoi(target.substr(4));
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener < 0) throw runtime_error("Error: Cannot create metrics socket");
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 8) != 0) {
+            close(listener);
+            throw runtime_error("Error: Cannot listen for metrics on " + target);
+        }
+        fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    }
+    Metrics::enable();
+    exporter = std::thread(&MetricsExporter::run, this);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    exporter.join();
+    if (listener >= 0) close(listener);
+}
+
+void MetricsExporter::run()
+{
+    auto next = chrono::steady_clock::now() + interval;
+    unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        auto timeout = min(chrono::duration_cast<chrono::milliseconds>(next - chrono::steady_clock::now()),
+                           chrono::milliseconds(POLL_MS));
+        if (listener >= 0) {
+            lock.unlock();
+            pollfd pfd = {listener, POLLIN, 0};
+            if (poll(&pfd, 1, max<long>(0, timeout.count())) > 0) serve();
+            lock.lock();
+        } else {
+            wakeup.wait_for(lock, timeout);
+        }
+        if (chrono::steady_clock::now() >= next) {
+            lock.unlock();
+            publish();
+            lock.lock();
+            next += interval;
+        }
+    }
+    lock.unlock();
+    publish();
+}
+
+void MetricsExporter::publish()
+{
+    Metrics::Snapshot current = Metrics::snapshot();
+    string text = prometheus ? Metrics::prometheus(current, previous) : Metrics::json(current, previous);
+    previous = current;
+    if (listener >= 0) {
+        lock_guard<std::mutex> lock(mutex);
+        latest = text;
+    } else if (prometheus) {
+        // replaced atomically, so collectors never read a partial export
+        const string tmpname = target + ".tmp";
+        {
+            ofstream out(tmpname, ios::out | ios::trunc);
+            out << text;
+        }
+        std::rename(tmpname.c_str(), target.c_str());
+    } else {
+        ofstream out(target, ios::out | ios::app);
+        out << text;
+    }
+}
+
+void MetricsExporter::serve()
+{
+    int client = accept(listener, nullptr, nullptr);
+    if (client < 0) return;
+    // the request itself is not needed, every path returns the metrics
+    timeval timeout = {0, 100000};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[1024];
+    if (recv(client, request, sizeof(request), 0) < 0) {
+        close(client);
+        return;
+    }
+    string body;
+    {
+        lock_guard<std::mutex> lock(mutex);
+        body = latest;
+    }
+    ostringstream response;
+    response << "HTTP/1.0 200 OK\r\n"
+             << "Content-Type: " << (prometheus ? "text/plain; version=0.0.4" : "application/json") << "\r\n"
+             << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+    const string text = response.str();
+    size_t sent = 0;
+    while (sent < text.size()) {
+        ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    close(client);
+}
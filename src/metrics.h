@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum class Stage {CAPTURE, DETECTION_WAIT, DETECTION, ALIGNMENT_WAIT, ALIGNMENT, REGRESSION_WAIT,
+                  PUPILS, FACE_FEATURES, LID_FEATURES, EYE_HOG, CLASSIFICATION, OUTPUT_WAIT, CONSUMER, END_TO_END};
+static constexpr int STAGES = 14;
+
+enum class Gauge {DETECTION_QUEUE, SHAPE_QUEUE, REGRESSION_QUEUE};
+static constexpr int GAUGES = 3;
+
+/**
+ * @brief Lock-free latency histogram with logarithmic buckets of 1/8 octave.
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr int BUCKETS = 16 + 37*8;
+
+    struct Snapshot {
+        std::array<uint64_t, BUCKETS> buckets{};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        Snapshot operator-(const Snapshot& earlier) const;
+        // in microseconds, the upper bound of the bucket holding the quantile
+        double quantile(double q) const;
+    };
+
+    void record(uint64_t micros);
+    Snapshot snapshot() const;
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+};
+
+/**
+ * @brief Process wide stage latencies and queue depths.
+ *
+ * Recording is disabled until enable() is called, so disabled instrumentation costs a
+ * relaxed load per call and no clock reads.
+ */
+class Metrics
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    typedef std::array<LatencyHistogram::Snapshot, STAGES> Snapshot;
+
+    static void enable();
+    static bool enabled();
+    // the current time while enabled, the epoch otherwise
+    static Clock::time_point now();
+    static void record(Stage stage, Clock::time_point start, Clock::time_point end);
+    static void record(Stage stage, Clock::time_point start);
+    static void setGauge(Gauge gauge, long value);
+
+    static Snapshot snapshot();
+    static std::string stageName(Stage stage);
+    static std::string gaugeName(Gauge gauge);
+    // quantiles describe the interval since previous, counts and sums are totals
+    static std::string json(const Snapshot& current, const Snapshot& previous);
+    static std::string prometheus(const Snapshot& current, const Snapshot& previous);
+
+private:
+    static std::atomic<bool> active;
+    static std::array<LatencyHistogram, STAGES> histograms;
+    static std::array<std::atomic<long>, GAUGES> gauges;
+};
+
+/**
+ * @brief Periodically writes the metrics to a file or serves them on a local tcp port.
+ *
+ * A target "tcp:<port>" answers every connection to 127.0.0.1:<port> with the latest export
+ * as an http response, any other target is a file. JSON exports are appended as lines,
+ * Prometheus exports replace the file.
+ */
+class MetricsExporter
+{
+public:
+    MetricsExporter(const std::string& target, bool prometheus, double interval);
+    ~MetricsExporter();
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+private:
+    std::string target;
+    bool prometheus;
+    std::chrono::milliseconds interval;
+    int listener = -1;
+    Metrics::Snapshot previous;
+    std::string latest;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread exporter;
+
+    void run();
+    void publish();
+    void serve();
+};
@@ -1,10 +1,49 @@
 #include "mutualgazelearner.h"
 
+#include <algorithm>
+#include <exception>
+#include <thread>
 #include <boost/lexical_cast.hpp>
 #include "eyepatcher.h"
+#include "taskscheduler.h"
 
 using namespace std;
 
+typedef vector<pair<vector<size_t>, vector<size_t>>> fold_type;
+
+// training and test indices of every fold, split like dlib::cross_validate_trainer
+// so the search selects the same parameters as a sequential cross validation
+static fold_type crossValidationFolds(const vector<double>& labels, long folds)
+{
+    const long n = labels.size();
+    const long numPos = count(labels.begin(), labels.end(), +1.0);
+    const long numNeg = count(labels.begin(), labels.end(), -1.0);
+    if (numPos + numNeg != n || min(numPos, numNeg) < folds) {
+        throw runtime_error("cross validation needs labels of +1 and -1 with at least one sample per fold and class");
+    }
+    auto take = [&labels, n](long& idx, double label, long count, vector<size_t>& out) {
+        for (long cur = 0; cur < count; idx = (idx + 1) % n) {
+            if (labels[idx] == label) {
+                out.push_back(idx);
+                cur++;
+            }
+        }
+    };
+    fold_type result(folds);
+    long posIdx = 0;
+    long negIdx = 0;
+    for (long f = 0; f < folds; f++) {
+        take(posIdx, +1.0, numPos/folds, result[f].second);
+        take(negIdx, -1.0, numNeg/folds, result[f].second);
+        // training samples follow the test samples
+        long trainPosIdx = posIdx;
+        long trainNegIdx = negIdx;
+        take(trainPosIdx, +1.0, numPos - numPos/folds, result[f].first);
+        take(trainNegIdx, -1.0, numNeg - numNeg/folds, result[f].first);
+    }
+    return result;
+}
+
 
 
 MutualGazeLearner::MutualGazeLearner(TrainingParameters& params) : AbstractLearner(params)
@@ -20,30 +59,39 @@ MutualGazeLearner::~MutualGazeLearner()
 
 void MutualGazeLearner::loadClassifier(const std::string &filename)
 {
+    if (_loadCompiled(filename)) return;
     ifstream infile(filename, ios::in | ios::binary);
     if (!infile.is_open()) throw dlib::serialization_error("Error: Cannot open " + filename);
     deserialize(normalizer_pca, infile);
     deserialize(decision_function, infile);
+    batchBasis.set_size(0, 0);
+    compiled.reset();
     _initialized = true;
 }
 
 
-boost::optional<dlib::matrix<double,0,1>> MutualGazeLearner::getFeatureVector(GazeHyp& ghyp) {
-    auto result = boost::optional<dlib::matrix<double,0,1>>();
-    if (ghyp.horizGazeFeatures.size() && ghyp.faceFeatures.size() && ghyp.eyeHogFeatures.size()) {
-        result = dlib::join_cols(dlib::join_cols(ghyp.horizGazeFeatures, ghyp.faceFeatures), ghyp.eyeHogFeatures);
-    }
-    return result;
+FeatureLayout MutualGazeLearner::featureLayout() {
+    FeatureLayout fl;
+    fl.ranges = {{FeatureSegment::HORIZ_GAZE, 0, 0}, {FeatureSegment::FACE, 0, 0}, {FeatureSegment::EYE_HOG, 0, 0}};
+    return fl;
 }
 
 
 void MutualGazeLearner::classify(GazeHyp& ghyp){
+    if (_classifyCompiled(ghyp, ghyp.mutualGazeClassification)) return;
     auto fv = getFeatureVector(ghyp);
     if (decision_function.basis_vectors.size() && fv.is_initialized()) {
         ghyp.mutualGazeClassification = decision_function(normalizer_pca(fv.get()));
     }
 }
 
+void MutualGazeLearner::classifyBatch(const std::vector<GazeHyp*>& ghyps)
+{
+    for (auto& r : _classifyBatch(ghyps, decision_function, true)) {
+        r.first->mutualGazeClassification = r.second;
+    }
+}
+
 
 void MutualGazeLearner::train(const string& outfilename) {
     normalizer_pca.train(samples, 0.99);
@@ -64,40 +112,19 @@ void MutualGazeLearner::train(const string& outfilename) {
     initialc2 *= 16.0/mincls;
     dlib::svm_c_trainer<kernel_type> trainer;
     cerr << "initial c1,c2 = " << initialc1 << ", " << initialc2 << endl;
-    double bestc1 = 0;
-    double bestc2 = 0;
-    double bestgamma = 0;
-    double maxresult = 0;
     trainer.set_epsilon(0.1);
-    for (auto gamma : {0.16, 0.2, 0.3}) {
-        trainer.set_kernel(kernel_type(gamma));
-        double c1 = initialc1;
-        double c2 = initialc2;
-        for (int i = 1; i < 7; i++) {
-            trainer.set_c_class1(c1);
-            trainer.set_c_class2(c2);
-            // The first element of the vector is the fraction of +1 training examples correctly classified
-            // and the second number is the fraction of -1 training examples correctly classified.
-            auto valresult = dlib::cross_validate_trainer(trainer, samples, labels, 3);
-            cerr << "cross validation accuracy (c1, c2 = " << c1 << ", " << c2
-                 << " gamma: " << gamma << "): " << valresult;
-            double fm = valresult(0) * valresult(1);
-            if (fm > maxresult) {
-                maxresult = fm;
-                bestc1 = c1;
-                bestc2 = c2;
-                bestgamma = gamma;
-            }
-            c1 *= 0.5;
-            c2 *= 0.5;
-        }
-    }
+    GridPoint best = searchParameters(trainer, initialc1, initialc2);
+    const double bestc1 = best.c1;
+    const double bestc2 = best.c2;
+    const double bestgamma = best.gamma;
     cerr << "best c1, c2 = " << bestc1 << ", " << bestc2 << " gamma: " << bestgamma << endl;
     trainer.set_kernel(kernel_type(bestgamma));
     trainer.set_c_class1(bestc1);
     trainer.set_c_class2(bestc2);
     //auto redtrainer = dlib::reduced2(trainer, 400);
     decision_function = trainer.train(samples, labels);
+    batchBasis.set_size(0, 0);
+    compiled.reset();
     cerr << "basis vectors: " << decision_function.basis_vectors.size() << endl;
     ofstream outfile(outfilename, ios::out | ios::binary);
     serialize(normalizer_pca, outfile);
@@ -105,6 +132,111 @@ void MutualGazeLearner::train(const string& outfilename) {
 }
 
 
+// Every (grid point, fold) pair is trained as a task of its own. Results are stored per pair and
+// reduced in grid and fold order, so the selection does not depend on the thread count. With
+// successive halving the grid is evaluated fold by fold and only the better half of the grid
+// points is trained on the next fold.
+MutualGazeLearner::GridPoint MutualGazeLearner::searchParameters(const dlib::svm_c_trainer<kernel_type>& trainer,
+                                                                double initialc1, double initialc2)
+{
+    vector<GridPoint> grid;
+    vector<double> gammas = trainParams.gammaGrid;
+    if (gammas.empty()) gammas = {0.16, 0.2, 0.3};
+    for (double gamma : gammas) {
+        double c1 = initialc1;
+        double c2 = initialc2;
+        for (int i = 0; i < trainParams.cSteps.get_value_or(6); i++) {
+            grid.push_back(GridPoint{gamma, c1, c2});
+            c1 *= 0.5;
+            c2 *= 0.5;
+        }
+    }
+    const long folds = trainParams.folds.get_value_or(3);
+    const fold_type splits = crossValidationFolds(labels, folds);
+    const int threads = trainParams.threads.get_value_or(max(1u, thread::hardware_concurrency()));
+    TaskScheduler scheduler(threads);
+    // The first element is the fraction of +1 test samples correctly classified
+    // and the second one the fraction of -1 test samples correctly classified.
+    vector<dlib::matrix<double,1,2>> results(grid.size()*folds);
+    vector<long> evaluatedFolds(grid.size(), 0);
+    vector<exception_ptr> errors(results.size());
+    auto evaluate = [&](size_t point, long fold) {
+        scheduler.spawn([&, point, fold]() {
+            try {
+                dlib::svm_c_trainer<kernel_type> foldTrainer(trainer);
+                foldTrainer.set_kernel(kernel_type(grid[point].gamma));
+                foldTrainer.set_c_class1(grid[point].c1);
+                foldTrainer.set_c_class2(grid[point].c2);
+                std::vector<sample_type> xtrain, xtest;
+                std::vector<double> ytrain, ytest;
+                for (size_t i : splits[fold].first) {
+                    xtrain.push_back(samples[i]);
+                    ytrain.push_back(labels[i]);
+                }
+                for (size_t i : splits[fold].second) {
+                    xtest.push_back(samples[i]);
+                    ytest.push_back(labels[i]);
+                }
+                results[point*folds + fold] = dlib::test_binary_decision_function(
+                            foldTrainer.train(xtrain, ytrain), xtest, ytest);
+            } catch (dlib::invalid_nu_error&) {
+                // ignored like in dlib::cross_validate_trainer
+                results[point*folds + fold] = dlib::zeros_matrix<double>(1, 2);
+            } catch (...) {
+                errors[point*folds + fold] = current_exception();
+            }
+        });
+    };
+    auto mean = [&](size_t point) {
+        dlib::matrix<double,1,2> sum = dlib::zeros_matrix<double>(1, 2);
+        for (long f = 0; f < evaluatedFolds[point]; f++) sum += results[point*folds + f];
+        return dlib::matrix<double,1,2>(sum/(double)evaluatedFolds[point]);
+    };
+    auto score = [&](size_t point) {
+        dlib::matrix<double,1,2> m = mean(point);
+        return m(0)*m(1);
+    };
+    vector<size_t> active(grid.size());
+    for (size_t i = 0; i < grid.size(); i++) active[i] = i;
+    const long rounds = trainParams.successiveHalving ? folds : 1;
+    for (long round = 0; round < rounds; round++) {
+        const long lastFold = trainParams.successiveHalving ? round + 1 : folds;
+        for (size_t point : active) {
+            for (long fold = evaluatedFolds[point]; fold < lastFold; fold++) evaluate(point, fold);
+        }
+        scheduler.waitIdle();
+        for (auto& error : errors) {
+            if (error) rethrow_exception(error);
+        }
+        for (size_t point : active) evaluatedFolds[point] = lastFold;
+        if (round + 1 < rounds) {
+            stable_sort(active.begin(), active.end(), [&score](size_t a, size_t b) { return score(a) > score(b); });
+            active.resize((active.size() + 1)/2);
+            sort(active.begin(), active.end());
+        }
+    }
+    GridPoint best{0, 0, 0};
+    double maxresult = 0;
+    for (size_t point = 0; point < grid.size(); point++) {
+        cerr << "cross validation accuracy (c1, c2 = " << grid[point].c1 << ", " << grid[point].c2
+             << " gamma: " << grid[point].gamma << ", folds: " << evaluatedFolds[point] << "): " << mean(point);
+        if (evaluatedFolds[point] == folds && score(point) > maxresult) {
+            maxresult = score(point);
+            best = grid[point];
+        }
+    }
+    return best;
+}
+
+
+void MutualGazeLearner::compileClassifier(const string &outfilename)
+{
+    CompiledModel::Definition def = _compile(decision_function, true);
+    def.featureSet = -1;
+    CompiledModel::write(outfilename, def);
+}
+
+
 void MutualGazeLearner::visualize(GazeHyp& ghyp)
 {
     if (ghyp.isMutualGaze.get_value_or(false)) {
@@ -15,7 +15,9 @@ public:
     virtual ~MutualGazeLearner();
     virtual void loadClassifier(const std::string& filename);
     virtual void classify(GazeHyp &ghyp);
+    virtual void classifyBatch(const std::vector<GazeHyp*>& ghyps);
     virtual void train(const std::string &outfilename);
+    virtual void compileClassifier(const std::string& outfilename);
     virtual void visualize(GazeHyp& ghyp);
     virtual std::string getId();
 
@@ -23,6 +25,13 @@ protected:
     typedef dlib::radial_basis_kernel<sample_type> kernel_type;
     typedef dlib::decision_function<kernel_type> dec_funct_type;
     dec_funct_type decision_function;
-    boost::optional<dlib::matrix<double,0,1>> getFeatureVector(GazeHyp& ghyp);
+    FeatureLayout featureLayout();
+
+    struct GridPoint {
+        double gamma;
+        double c1;
+        double c2;
+    };
+    GridPoint searchParameters(const dlib::svm_c_trainer<kernel_type>& trainer, double initialc1, double initialc2);
 };
 
@@ -1,15 +1,31 @@
 #include "pupilfinder.h"
+#include "gradientobjective.h"
 #include <future>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
 
 using namespace std;
 
 //parameters
 static constexpr int CANDIDATE_MAP_WIDTH = 48;
 static constexpr double GRADIENT_THRESHOLD_FACTOR = 15;
+//eye regions higher than this are evaluated without lookup table
+static constexpr int CANDIDATE_MAP_MAX_HEIGHT = 2*CANDIDATE_MAP_WIDTH;
+//coarse to fine search: grid spacing, number of refined maxima and refinement window radius
+static constexpr int COARSE_STEP = 4;
+static constexpr size_t REFINE_MAXIMA = 2;
+static constexpr int REFINE_RADIUS = 3;
 
 class CenterDetector {
 
+public:
+    CenterDetector(PupilFinder::SearchStrategy strategy) : strategy(strategy) {}
+
 private:
+    PupilFinder::SearchStrategy strategy;
+
     double getGradientThreshold(const cv::Mat &mat) {
         cv::Scalar meanGradMag, stdGradMag;
         cv::meanStdDev(mat, meanGradMag, stdGradMag);
@@ -40,23 +56,6 @@ private:
         weights.convertTo(fweights, CV_32F, 0.3/(maxval-minval), -0.3*minval/(maxval-minval));
     }
 
-    float circleObjective(const cv::Mat& gradientxy, const cv::Mat& gradThreshMask, const cv::Point& c) {
-        auto gradientp = gradientxy.ptr<cv::Vec2f>(0);
-        auto maskp = gradThreshMask.ptr<uchar>(0);
-        float result = 0;
-        for (int y = 0; y < gradientxy.rows; y++) {
-            for (int x = 0; x < gradientxy.cols; x++, gradientp++, maskp++) {
-                if (!(*maskp)) continue;
-                cv::Vec2f di = cv::normalize(cv::Vec2f(x - c.x, y - c.y)); // (xi - c)/||xi-c||
-                const cv::Vec2f& gi = *gradientp;
-                const float dotprod = di.dot(gi); // di^T*gi
-                // only positive values, no square ( )^2
-                result += max(dotprod, 0.0f);
-            }
-        }
-        return result;
-    }
-
     double scaleToFixedWidth(const cv::Mat &src,cv::Mat &dst, int interpolation) {
         double sf = CANDIDATE_MAP_WIDTH/double(src.cols);
         cv::resize(src, dst, cv::Size(CANDIDATE_MAP_WIDTH, sf*src.rows), 0, 0, interpolation);
@@ -82,24 +81,137 @@ private:
         dst += dsttran*0.8; //max. combined value is 1.8 for normalized dst
     }
 
+    void applyWeights(cv::Mat& candidates, const cv::Mat& mask, const cv::Mat& weights) {
+        auto objFuncMatPtr = candidates.ptr<float>(0);
+        auto maskPtr = mask.ptr<uchar>(0);
+        auto weightsPtr = weights.ptr<float>(0);
+        for (size_t i = 0; i < candidates.total(); i++, objFuncMatPtr++, maskPtr++, weightsPtr++) {
+            if (!*maskPtr) continue;
+            *objFuncMatPtr *= (1-(*weightsPtr));
+        }
+    }
+
+    //every COARSE_STEP-th pixel in both directions
+    template<typename T>
+    cv::Mat decimate(const cv::Mat& full, const cv::Size& gridsize) {
+        cv::Mat grid(gridsize, full.type());
+        for (int y = 0; y < grid.rows; y++) {
+            for (int x = 0; x < grid.cols; x++) {
+                grid.at<T>(y, x) = full.at<T>(y*COARSE_STEP, x*COARSE_STEP);
+            }
+        }
+        return grid;
+    }
+
+    //bilinear interpolation from the valid grid points around (x, y), the weights are renormalized
+    //so candidates near the mask border are not pulled towards the zeros outside
+    float interpolate(const cv::Mat& grid, const cv::Mat& gridMask, int x, int y) {
+        const int x0 = min(x / COARSE_STEP, grid.cols-1);
+        const int y0 = min(y / COARSE_STEP, grid.rows-1);
+        const int x1 = min(x0 + 1, grid.cols-1);
+        const int y1 = min(y0 + 1, grid.rows-1);
+        const float fx = min(1.0f, (x - x0*COARSE_STEP) / float(COARSE_STEP));
+        const float fy = min(1.0f, (y - y0*COARSE_STEP) / float(COARSE_STEP));
+        float sum = 0, wsum = 0;
+        for (const auto& c : {make_tuple(x0, y0, (1-fx)*(1-fy)), make_tuple(x1, y0, fx*(1-fy)),
+                              make_tuple(x0, y1, (1-fx)*fy), make_tuple(x1, y1, fx*fy)}) {
+            if (!gridMask.at<uchar>(get<1>(c), get<0>(c))) continue;
+            sum += get<2>(c)*grid.at<float>(get<1>(c), get<0>(c));
+            wsum += get<2>(c);
+        }
+        if (wsum > 0) return sum / wsum;
+        //no valid neighbour, use the nearest valid grid point
+        float nearest = 0;
+        int bestdist = numeric_limits<int>::max();
+        for (int gy = 0; gy < grid.rows; gy++) {
+            for (int gx = 0; gx < grid.cols; gx++) {
+                if (!gridMask.at<uchar>(gy, gx)) continue;
+                const int dx = gx*COARSE_STEP - x, dy = gy*COARSE_STEP - y;
+                if (dx*dx + dy*dy < bestdist) {
+                    bestdist = dx*dx + dy*dy;
+                    nearest = grid.at<float>(gy, gx);
+                }
+            }
+        }
+        return nearest;
+    }
+
+    //returns false if no grid point lies inside the mask
+    bool getCoarseToFineMap(const GradientObjective& objective, const GradientObjective& gridObjective,
+                            const cv::Mat& gradientxy, const cv::Mat& gradThreshMask, const cv::Mat& innerMask,
+                            const cv::Mat& weights, cv::Mat& candidates) {
+        //score only the grid candidates, the decimated map saves the work of the skipped columns
+        const cv::Size gridsize = gridObjective.gridSize(innerMask.size());
+        const cv::Mat gridMask = decimate<uchar>(innerMask, gridsize);
+        if (!cv::countNonZero(gridMask)) return false;
+        cv::Mat coarse;
+        gridObjective(gradientxy, gradThreshMask, gridMask, coarse);
+        applyWeights(coarse, gridMask, decimate<float>(weights, gridsize));
+
+        //local maxima on the grid
+        std::vector<std::pair<float, cv::Point>> maxima;
+        for (int y = 0; y < coarse.rows; y++) {
+            for (int x = 0; x < coarse.cols; x++) {
+                if (!gridMask.at<uchar>(y, x)) continue;
+                float val = coarse.at<float>(y, x);
+                bool ismax = true;
+                for (int ny = y-1; ny <= y+1 && ismax; ny++) {
+                    for (int nx = x-1; nx <= x+1; nx++) {
+                        if (ny < 0 || nx < 0 || ny >= coarse.rows || nx >= coarse.cols) continue;
+                        if (gridMask.at<uchar>(ny, nx) && coarse.at<float>(ny, nx) > val) {
+                            ismax = false;
+                            break;
+                        }
+                    }
+                }
+                if (ismax) maxima.push_back(std::make_pair(val, cv::Point(x*COARSE_STEP, y*COARSE_STEP)));
+            }
+        }
+        std::sort(maxima.begin(), maxima.end(),
+                  [](const std::pair<float, cv::Point>& a, const std::pair<float, cv::Point>& b) {
+                      return a.first > b.first;
+                  });
+        if (maxima.size() > REFINE_MAXIMA) maxima.resize(REFINE_MAXIMA);
+
+        //refine at full resolution around the best maxima
+        cv::Rect maprect(cv::Point(0, 0), innerMask.size());
+        cv::Mat fineMask(innerMask.size(), CV_8UC1, cv::Scalar(0));
+        for (const auto& m : maxima) {
+            cv::Rect r(m.second - cv::Point(REFINE_RADIUS, REFINE_RADIUS), cv::Size(2*REFINE_RADIUS+1, 2*REFINE_RADIUS+1));
+            r &= maprect;
+            innerMask(r).copyTo(fineMask(r));
+        }
+        cv::Mat fine;
+        objective(gradientxy, gradThreshMask, fineMask, fine);
+        applyWeights(fine, fineMask, weights);
+
+        //remaining candidates are interpolated from the grid
+        candidates = cv::Mat::zeros(innerMask.size(), CV_32F);
+        for (int y = 0; y < innerMask.rows; y++) {
+            for (int x = 0; x < innerMask.cols; x++) {
+                if (!innerMask.at<uchar>(y, x)) continue;
+                candidates.at<float>(y, x) = fineMask.at<uchar>(y, x) ? fine.at<float>(y, x)
+                                                                      : interpolate(coarse, gridMask, x, y);
+            }
+        }
+        return true;
+    }
+
     void getCandidateMap(const cv::Mat& img, const cv::Mat& innerMask, const cv::Mat& outerMask,
                          cv::Mat& gradientxy, cv::Mat& gradThreshMask, cv::Mat& candidates) {
+        static const GradientObjective objective(CANDIDATE_MAP_WIDTH, CANDIDATE_MAP_MAX_HEIGHT);
+        static const GradientObjective gridObjective(CANDIDATE_MAP_WIDTH, CANDIDATE_MAP_MAX_HEIGHT, COARSE_STEP);
         getGradientxy(img, gradientxy, gradThreshMask);
         gradThreshMask &= outerMask;
-        candidates = cv::Mat::zeros(img.size(), CV_32F);
         cv::Mat weights;
         getWeights(img, innerMask, weights);
-        auto objFuncMatPtr = candidates.ptr<float>(0);
-        auto maskPtr = innerMask.ptr<uchar>(0);
-        auto weightsPtr = weights.ptr<float>(0);
-        float maxVal = 0;
-        for (int cy = 0; cy < img.rows; cy++) {
-            for (int cx = 0; cx < img.cols; cx++, objFuncMatPtr++, maskPtr++, weightsPtr++) {
-                if (!*maskPtr) continue;
-                *objFuncMatPtr = circleObjective(gradientxy, gradThreshMask, cv::Point(cx, cy))*(1-(*weightsPtr));
-                maxVal = max(maxVal, *objFuncMatPtr);
-            }
+        if (strategy != PupilFinder::SearchStrategy::COARSE_TO_FINE
+                || !getCoarseToFineMap(objective, gridObjective, gradientxy, gradThreshMask, innerMask, weights, candidates)) {
+            objective(gradientxy, gradThreshMask, innerMask, candidates);
+            applyWeights(candidates, innerMask, weights);
         }
+        double maxVal;
+        cv::minMaxLoc(candidates, NULL, &maxVal, NULL, NULL, innerMask);
         candidates /= maxVal;
     }
 
@@ -181,7 +293,8 @@ PupilFinder::PupilFinder()
 {
 }
 
-PupilFinder::PupilFinder(cv::Mat &frame, const FaceParts &faceParts)
+PupilFinder::PupilFinder(const cv::Mat &grayframe, const FaceParts &faceParts, SearchStrategy strategy)
+    : strategy(strategy)
 {
     //select subrectangle containing some facial features
     std::vector<cv::Point> fpoly;
@@ -196,7 +309,7 @@ PupilFinder::PupilFinder(cv::Mat &frame, const FaceParts &faceParts)
     lebounds = faceParts.boundingRect(FaceParts::LEYE);
     repoly = faceParts.featurePolygon(FaceParts::REYE);
     rebounds = faceParts.boundingRect(FaceParts::REYE);
-    scalefac = setupFaceRegion(frame, frect, lebounds, rebounds);
+    scalefac = setupFaceRegion(grayframe, frect, lebounds, rebounds);
 
     lpupCandidate = findEye(lepoly, lebounds, FaceParts::LEYE);
     if (lpupCandidate.is_initialized()) {
@@ -263,6 +376,23 @@ void PupilFinder::draw(cv::Mat &frame)
     }
 }
 
+std::string PupilFinder::strategyName(SearchStrategy strategy)
+{
+    switch (strategy) {
+    case SearchStrategy::EXHAUSTIVE: return "exhaustive";
+    case SearchStrategy::COARSE_TO_FINE: return "coarse";
+    }
+    return "unknown";
+}
+
+PupilFinder::SearchStrategy PupilFinder::strategyFromName(const std::string& name)
+{
+    for (auto s : {SearchStrategy::EXHAUSTIVE, SearchStrategy::COARSE_TO_FINE}) {
+        if (strategyName(s) == name) return s;
+    }
+    throw runtime_error("unknown pupil search strategy " + name);
+}
+
 boost::optional<PupilFinder::CenterCandidate> PupilFinder::findEye(std::vector<cv::Point> epoly, cv::Rect_<double> eyerect, FaceParts::FacePart eyeid)
 {
     cv::Point2d faceoffs;
@@ -291,7 +421,7 @@ boost::optional<PupilFinder::CenterCandidate> PupilFinder::findEye(std::vector<c
         return pupilcandidate;
     }
     //find and draw eye centers
-    CenterDetector cdet;
+    CenterDetector cdet(strategy);
     pupilcandidate = cdet.findEyeCenter(faceROIgray, epoly, eyerect, eyeid);
     // draw eye region
     //cv::rectangle(face, eye, cv::Scalar(150));
@@ -308,24 +438,25 @@ boost::optional<PupilFinder::CenterCandidate> PupilFinder::findEye(std::vector<c
 }
 
 
-double PupilFinder::setupFaceRegion(const cv::Mat& frame, const cv::Rect& facerect,
+double PupilFinder::setupFaceRegion(const cv::Mat& grayframe, const cv::Rect& facerect,
                       const cv::Rect& lebounds, const cv::Rect& rebounds) {
-    cv::Rect framerect(cv::Point(0, 0), frame.size());
+    cv::Rect framerect(cv::Point(0, 0), grayframe.size());
     double scaleFactor = 1.0;
     if (framerect.contains(facerect.tl()) && framerect.contains(facerect.br())) {
-        cv::cvtColor(frame(facerect), faceROIgray, CV_BGR2GRAY);
+        // the frame is shared with the other stages, the region is drawn on afterwards
+        const cv::Mat faceROI = grayframe(facerect);
         int mineyewidth = std::max(lebounds.width, rebounds.width);
         if (mineyewidth) {
             scaleFactor = CANDIDATE_MAP_WIDTH/double(mineyewidth);
-            cv::Size nsize(round(faceROIgray.cols*scaleFactor), round(faceROIgray.rows*scaleFactor));
+            cv::Size nsize(round(faceROI.cols*scaleFactor), round(faceROI.rows*scaleFactor));
             // using double size for for visualization purposes and
             // to minimize errors in subsequent scale operations
             nsize.width *= 2;
             nsize.height *= 2;
-            scaleFactor = nsize.width/double(faceROIgray.cols);
-            cv::Mat tmp;
-            cv::resize(faceROIgray, tmp, nsize, cv::INTER_LINEAR);
-            faceROIgray = tmp;
+            scaleFactor = nsize.width/double(faceROI.cols);
+            cv::resize(faceROI, faceROIgray, nsize, cv::INTER_LINEAR);
+        } else {
+            faceROIgray = faceROI.clone();
         }
     }
     return scaleFactor;
@@ -15,8 +15,10 @@ public:
         double radius;
     };
 
+    enum class SearchStrategy { EXHAUSTIVE, COARSE_TO_FINE };
+
     PupilFinder();
-    PupilFinder(cv::Mat& frame, const FaceParts& faceParts);
+    PupilFinder(const cv::Mat& grayframe, const FaceParts& faceParts, SearchStrategy strategy = SearchStrategy::EXHAUSTIVE);
 
     cv::Mat faceRegion();
     cv::Rect faceRect();
@@ -26,10 +28,12 @@ public:
     const boost::optional<CenterCandidate> &leftCandidate();
     int pupilsFound() const;
     void draw(cv::Mat& frame);
+    static std::string strategyName(SearchStrategy strategy);
+    static SearchStrategy strategyFromName(const std::string& name);
 
 private:
     boost::optional<CenterCandidate> findEye(std::vector<cv::Point> epoly, cv::Rect_<double> eyerect, FaceParts::FacePart eyeid);
-    double setupFaceRegion(const cv::Mat &frame, const cv::Rect &facerect, const cv::Rect &lebounds, const cv::Rect &rebounds);
+    double setupFaceRegion(const cv::Mat &grayframe, const cv::Rect &facerect, const cv::Rect &lebounds, const cv::Rect &rebounds);
     void drawCross(cv::Mat img, cv::Point center, cv::Scalar color, int d = 3, int thickness = 1, int lineType = 8);
 
     cv::Rect frect;
@@ -40,6 +44,7 @@ private:
     std::vector<cv::Point> repoly;
     cv::Rect rebounds;
     double scalefac;
+    SearchStrategy strategy = SearchStrategy::EXHAUSTIVE;
     int pupfound = 0;
     boost::optional<CenterCandidate> lpupCandidate;
     boost::optional<CenterCandidate> rpupCandidate;
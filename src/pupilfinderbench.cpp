@@ -0,0 +1,225 @@
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <boost/lexical_cast.hpp>
+#include <opencv2/opencv.hpp>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <dlib/image_processing.h>
+#include <dlib/opencv.h>
+
+#include "gradientobjective.h"
+#include "pupilfinder.h"
+#include "faceparts.h"
+#include "imageprovider.h"
+#include "flatshapepredictor.h"
+
+using namespace std;
+
+// synthetic eye regions of the size PupilFinder scales eyes to
+static constexpr int MAP_WIDTH = 48;
+static constexpr int MAP_MAX_HEIGHT = 2*MAP_WIDTH;
+// grid spacing of the coarse to fine search
+static constexpr int COARSE_STEP = 4;
+
+struct EyeSample {
+    cv::Mat gradientxy;
+    cv::Mat gradThreshMask;
+    cv::Mat candidateMask;
+};
+
+static EyeSample makeSample(cv::RNG& rng) {
+    int rows = rng.uniform(18, 40);
+    cv::Mat eye(rows, MAP_WIDTH, CV_8UC1);
+    rng.fill(eye, cv::RNG::NORMAL, 170, 20);
+    cv::Point iris(rng.uniform(14, MAP_WIDTH-14), rows/2 + rng.uniform(-3, 4));
+    cv::circle(eye, iris, rng.uniform(7, 11), cv::Scalar(60), -1, CV_AA);
+    cv::circle(eye, iris, 3, cv::Scalar(20), -1, CV_AA);
+    cv::GaussianBlur(eye, eye, cv::Size(3, 3), 0, 0);
+
+    EyeSample s;
+    static const cv::Mat derivkernelx = (cv::Mat_<float>(1,3)<<-0.5, 0, 0.5);
+    static const cv::Mat derivkernely = (cv::Mat_<float>(3,1)<<-0.5, 0, 0.5);
+    cv::Mat gradientX, gradientY;
+    cv::filter2D(eye, gradientX, CV_32F, derivkernelx);
+    cv::filter2D(eye, gradientY, CV_32F, derivkernely);
+    cv::Mat sqaredMags = gradientX.mul(gradientX) + gradientY.mul(gradientY);
+    std::vector<cv::Mat> planes = {gradientX/sqaredMags, gradientY/sqaredMags};
+    cv::merge(planes, s.gradientxy);
+    cv::Scalar meanGradMag, stdGradMag;
+    cv::meanStdDev(sqaredMags, meanGradMag, stdGradMag);
+    double thresh = meanGradMag[0] + stdGradMag[0] / sqrt(sqaredMags.total()) * 15;
+    cv::threshold(sqaredMags, sqaredMags, thresh, 255, cv::THRESH_BINARY);
+    sqaredMags.convertTo(s.gradThreshMask, CV_8UC1);
+    s.candidateMask = cv::Mat(eye.size(), CV_8UC1, cv::Scalar(0));
+    cv::ellipse(s.candidateMask, cv::Point(MAP_WIDTH/2, rows/2), cv::Size(MAP_WIDTH/2-1, rows/2-1),
+                0, 0, 360, cv::Scalar(255), -1);
+    s.gradThreshMask &= s.candidateMask;
+    return s;
+}
+
+static void benchmarkKernels(int samples, int repetitions) {
+    cv::RNG rng(4711);
+    vector<EyeSample> eyes;
+    for (int i = 0; i < samples; i++) {
+        eyes.push_back(makeSample(rng));
+    }
+    GradientObjective objective(MAP_WIDTH, MAP_MAX_HEIGHT);
+    vector<cv::Mat> referenceMaps(eyes.size());
+    cout << "kernel\tsupported\tus_per_eye\tspeedup\tmismatches" << endl;
+    double referenceTime = 0;
+    for (auto kernel : {GradientObjective::Kernel::REFERENCE, GradientObjective::Kernel::SCALAR,
+                        GradientObjective::Kernel::SSE, GradientObjective::Kernel::AVX2}) {
+        string name = GradientObjective::kernelName(kernel);
+        if (!GradientObjective::isSupported(kernel)) {
+            cout << name << "\t0\tnan\tnan\tnan" << endl;
+            continue;
+        }
+        long mismatches = 0;
+        cv::Mat result;
+        auto tstart = chrono::steady_clock::now();
+        for (int r = 0; r < repetitions; r++) {
+            for (size_t i = 0; i < eyes.size(); i++) {
+                objective(eyes[i].gradientxy, eyes[i].gradThreshMask, eyes[i].candidateMask, result, kernel);
+                if (kernel == GradientObjective::Kernel::REFERENCE) {
+                    if (r == 0) result.copyTo(referenceMaps[i]);
+                } else if (r == 0) {
+                    // bitwise comparison, the kernels have to reproduce the reference exactly
+                    cv::Mat diff = (result != referenceMaps[i]);
+                    mismatches += cv::countNonZero(diff);
+                }
+            }
+        }
+        double elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tstart).count();
+        double perEye = elapsed / (repetitions*eyes.size());
+        if (kernel == GradientObjective::Kernel::REFERENCE) referenceTime = perEye;
+        cout << name << "\t1\t" << perEye << "\t" << referenceTime/perEye << "\t" << mismatches << endl;
+    }
+
+    // the coarse search grid has to reproduce the full map at the grid points
+    GradientObjective gridObjective(MAP_WIDTH, MAP_MAX_HEIGHT, COARSE_STEP);
+    vector<cv::Mat> gridMasks;
+    for (const auto& eye : eyes) {
+        cv::Mat gridMask(gridObjective.gridSize(eye.candidateMask.size()), CV_8UC1);
+        for (int y = 0; y < gridMask.rows; y++) {
+            for (int x = 0; x < gridMask.cols; x++) {
+                gridMask.at<uchar>(y, x) = eye.candidateMask.at<uchar>(y*COARSE_STEP, x*COARSE_STEP);
+            }
+        }
+        gridMasks.push_back(gridMask);
+    }
+    cout << endl << "grid_kernel\tsupported\tus_per_eye\tspeedup\tmismatches" << endl;
+    for (auto kernel : {GradientObjective::Kernel::REFERENCE, GradientObjective::Kernel::SCALAR,
+                        GradientObjective::Kernel::SSE, GradientObjective::Kernel::AVX2}) {
+        string name = GradientObjective::kernelName(kernel);
+        if (!GradientObjective::isSupported(kernel)) {
+            cout << name << "\t0\tnan\tnan\tnan" << endl;
+            continue;
+        }
+        long mismatches = 0;
+        cv::Mat result;
+        auto tstart = chrono::steady_clock::now();
+        for (int r = 0; r < repetitions; r++) {
+            for (size_t i = 0; i < eyes.size(); i++) {
+                gridObjective(eyes[i].gradientxy, eyes[i].gradThreshMask, gridMasks[i], result, kernel);
+                if (r > 0) continue;
+                for (int y = 0; y < result.rows; y++) {
+                    for (int x = 0; x < result.cols; x++) {
+                        if (result.at<float>(y, x) != referenceMaps[i].at<float>(y*COARSE_STEP, x*COARSE_STEP)
+                                && gridMasks[i].at<uchar>(y, x)) {
+                            mismatches++;
+                        }
+                    }
+                }
+            }
+        }
+        double elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tstart).count();
+        double perEye = elapsed / (repetitions*eyes.size());
+        cout << name << "\t1\t" << perEye << "\t" << referenceTime/perEye << "\t" << mismatches << endl;
+    }
+}
+
+struct SearchStats {
+    long faces = 0;
+    long pupils = 0;
+    long missing = 0;
+    double deviation = 0;
+    double maxDeviation = 0;
+};
+
+static double timedPupilFinder(const cv::Mat& grayframe, const FaceParts& faceParts,
+                               PupilFinder::SearchStrategy strategy, PupilFinder& result) {
+    auto tstart = chrono::steady_clock::now();
+    result = PupilFinder(grayframe, faceParts, strategy);
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tstart).count();
+}
+
+// compares the coarse to fine search against the exhaustive search on detected faces,
+// deviations are reported in pixels of the input images and grouped by label
+static void compareSearch(const string& batchfile, const string& modelfile) {
+    dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+    FlatShapePredictor shapePredictor(modelfile);
+    BatchImageProvider images(batchfile);
+    map<string, SearchStats> stats;
+    double exhaustiveTime = 0;
+    double coarseTime = 0;
+    cv::Mat frame, grayframe;
+    while (images.get(frame)) {
+        ImageProvider::toGray(frame, grayframe);
+        dlib::cv_image<unsigned char> dlibimage(grayframe);
+        SearchStats& labelStats = stats[images.getLabel()];
+        for (const auto& facerect : detector(dlibimage)) {
+            FaceParts faceParts(shapePredictor(dlibimage, facerect));
+            PupilFinder exhaustive, coarse;
+            exhaustiveTime += timedPupilFinder(grayframe, faceParts, PupilFinder::SearchStrategy::EXHAUSTIVE, exhaustive);
+            coarseTime += timedPupilFinder(grayframe, faceParts, PupilFinder::SearchStrategy::COARSE_TO_FINE, coarse);
+            labelStats.faces++;
+            for (const auto& p : {make_pair(exhaustive.leftCandidate(), coarse.leftCandidate()),
+                                  make_pair(exhaustive.rightCandidate(), coarse.rightCandidate())}) {
+                if (!p.first.is_initialized()) continue;
+                if (!p.second.is_initialized()) {
+                    labelStats.missing++;
+                    continue;
+                }
+                double dev = cv::norm(p.first.get().center - p.second.get().center);
+                labelStats.pupils++;
+                labelStats.deviation += dev;
+                labelStats.maxDeviation = max(labelStats.maxDeviation, dev);
+            }
+        }
+    }
+    SearchStats total;
+    cout << "label\tfaces\tpupils\tmissing\tmean_dev_px\tmax_dev_px" << endl;
+    for (const auto& s : stats) {
+        const SearchStats& ls = s.second;
+        cout << (s.first.empty() ? "-" : s.first) << "\t" << ls.faces << "\t" << ls.pupils << "\t" << ls.missing
+             << "\t" << ls.deviation/max(1L, ls.pupils) << "\t" << ls.maxDeviation << endl;
+        total.faces += ls.faces;
+        total.pupils += ls.pupils;
+        total.missing += ls.missing;
+        total.deviation += ls.deviation;
+        total.maxDeviation = max(total.maxDeviation, ls.maxDeviation);
+    }
+    cout << "all\t" << total.faces << "\t" << total.pupils << "\t" << total.missing
+         << "\t" << total.deviation/max(1L, total.pupils) << "\t" << total.maxDeviation << endl;
+    cout << endl << "strategy\tus_per_face\tspeedup" << endl;
+    long faces = max(1L, total.faces);
+    cout << "exhaustive\t" << exhaustiveTime/faces << "\t1" << endl;
+    cout << "coarse\t" << coarseTime/faces << "\t" << exhaustiveTime/max(1.0, coarseTime) << endl;
+}
+
+int main(int argc, char** argv) {
+    string mode = argc > 1 ? argv[1] : "kernels";
+    if (mode == "kernels") {
+        int samples = argc > 2 ? boost::lexical_cast<int>(argv[2]) : 200;
+        int repetitions = argc > 3 ? boost::lexical_cast<int>(argv[3]) : 5;
+        benchmarkKernels(samples, repetitions);
+    } else if (mode == "search" && argc == 4) {
+        compareSearch(argv[2], argv[3]);
+    } else {
+        cerr << "usage: " << argv[0] << " kernels [samples] [repetitions]" << endl
+             << "       " << argv[0] << " search <batchfile> <shape model>" << endl;
+        return 1;
+    }
+    return 0;
+}
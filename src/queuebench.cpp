@@ -0,0 +1,140 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <cstdlib>
+#include <sys/resource.h>
+
+#include "blockingqueue.h"
+#include "ringqueue.h"
+
+using namespace std;
+
+// stands in for GazeHypList, the pipeline passes shared pointers between the stages
+struct Item {
+    long seq;
+};
+typedef shared_ptr<Item> ItemPtr;
+
+static long contextSwitches() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+struct Result {
+    double itemsPerSecond;
+    long switches;
+    bool ordered;
+};
+
+template <class Queue, class Run>
+static Result measure(long items, Run run) {
+    long switchesBefore = contextSwitches();
+    auto tstart = chrono::steady_clock::now();
+    bool ordered = run(items);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - tstart).count();
+    return {items / elapsed, contextSwitches() - switchesBefore, ordered};
+}
+
+// single producer, single consumer that peeks before it pops like the pipeline stages
+template <class Queue>
+static bool peekPop(long items, size_t capacity) {
+    Queue queue(capacity);
+    thread producer([&]() {
+        for (long i = 0; i < items; i++) {
+            queue.waitAccept();
+            queue.push(make_shared<Item>(Item{i}));
+        }
+    });
+    bool ordered = true;
+    for (long i = 0; i < items; i++) {
+        ordered &= queue.peek()->seq == i;
+        queue.pop();
+    }
+    producer.join();
+    return ordered;
+}
+
+// single producer feeding a pool of workers like the detection work queues
+template <class Queue>
+static bool workQueue(long items, size_t capacity, int workers) {
+    Queue queue(capacity);
+    atomic<long> sum(0);
+    vector<thread> pool;
+    for (int w = 0; w < workers; w++) {
+        pool.emplace_back([&]() {
+            try {
+                while (true) {
+                    sum += queue.pop()->seq;
+                }
+            } catch (QueueInterruptedException) {}
+        });
+    }
+    for (long i = 0; i < items; i++) {
+        queue.push(make_shared<Item>(Item{i}));
+    }
+    while (queue.size() > 0) {
+        this_thread::yield();
+    }
+    queue.interrupt();
+    for (auto& t : pool) t.join();
+    return sum == items*(items-1)/2;
+}
+
+// three stages handing the items on in order, as capture, detection and regression do
+template <class Queue>
+static bool chain(long items, size_t capacity) {
+    Queue first(capacity), second(capacity), third(capacity);
+    auto forward = [&items](Queue& in, Queue& out) {
+        for (long i = 0; i < items; i++) {
+            out.waitAccept();
+            ItemPtr item = in.peek();
+            in.pop();
+            out.push(item);
+        }
+    };
+    thread stage1([&]() {
+        for (long i = 0; i < items; i++) {
+            first.push(make_shared<Item>(Item{i}));
+        }
+    });
+    thread stage2([&]() { forward(first, second); });
+    thread stage3([&]() { forward(second, third); });
+    bool ordered = true;
+    for (long i = 0; i < items; i++) {
+        ordered &= third.pop()->seq == i;
+    }
+    stage1.join();
+    stage2.join();
+    stage3.join();
+    return ordered;
+}
+
+template <class Queue>
+static void runAll(const string& name, long items, size_t capacity, int workers) {
+    vector<pair<string, Result>> results = {
+        {"peek_pop", measure<Queue>(items, [&](long n) { return peekPop<Queue>(n, capacity); })},
+        {"work_queue", measure<Queue>(items, [&](long n) { return workQueue<Queue>(n, capacity, workers); })},
+        {"chain", measure<Queue>(items, [&](long n) { return chain<Queue>(n, capacity); })}
+    };
+    for (const auto& r : results) {
+        cout << name << "\t" << r.first << "\t" << capacity << "\t" << (long)r.second.itemsPerSecond
+             << "\t" << r.second.switches << "\t" << (r.second.ordered ? "ok" : "FAILED") << endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    long items = argc > 1 ? atol(argv[1]) : 200000;
+    int workers = argc > 2 ? atoi(argv[2]) : 4;
+    cout << "queue\tpattern\tcapacity\titems_per_s\tcontext_switches\tcheck" << endl;
+    // capacities as used by the workers, which size their queues by the thread count
+    for (size_t capacity : {1, 4, 16}) {
+        runAll<BlockingQueue<ItemPtr>>("blocking", items, capacity, workers);
+        runAll<RingQueue<ItemPtr>>("ring", items, capacity, workers);
+    }
+    return 0;
+}
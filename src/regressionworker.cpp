@@ -1,6 +1,7 @@
 #include "regressionworker.h"
 #include "pupilfinder.h"
 #include "eyepatcher.h"
+#include "trace.h"
 
 #include <dlib/threads.h>
 #include <thread>
@@ -9,10 +10,12 @@
 using namespace std;
 
 
-RegressionWorker::RegressionWorker(BlockingQueue<GazeHypsPtr>& inqueue, EyeLidLearner &eoc, MutualGazeLearner &glearner,
-                         RelativeGazeLearner &rglearner, RelativeEyeLidLearner& rellearner, VerticalGazeLearner& vglearner, int threadcount)
-    : tpool(threadcount), _inqueue(inqueue), _hypsqueue(threadcount),
-      lidlearner(eoc), gazelearner(glearner), relativeGazeLearner(rglearner), rellearner(rellearner), vglearner(vglearner)
+RegressionWorker::RegressionWorker(GazeHypsQueue& inqueue, EyeLidLearner &eoc, MutualGazeLearner &glearner,
+                         RelativeGazeLearner &rglearner, RelativeEyeLidLearner& rellearner, VerticalGazeLearner& vglearner, int threadcount,
+                         PupilFinder::SearchStrategy pupilSearch)
+    : scheduler(threadcount), _inqueue(inqueue), _hypsqueue(threadcount),
+      lidlearner(eoc), gazelearner(glearner), relativeGazeLearner(rglearner), rellearner(rellearner), vglearner(vglearner),
+      pupilSearch(pupilSearch)
 {
     register_thread(*this, &RegressionWorker::thread);
     start();
@@ -20,60 +23,134 @@ RegressionWorker::RegressionWorker(BlockingQueue<GazeHypsPtr>& inqueue, EyeLidLe
 
 RegressionWorker::~RegressionWorker() {
     _hypsqueue.interrupt();
-    tpool.wait_for_all_tasks();
     stop();
     wait();
+    scheduler.waitIdle();
 }
 
-BlockingQueue<GazeHypsPtr> &RegressionWorker::hypsqueue() {
+GazeHypsQueue &RegressionWorker::hypsqueue() {
     return _hypsqueue;
 }
 
 template<typename T1>
-void RegressionWorker::concurrentClassify(T1& learner, GazeHyp& ghyp) {
-    static dlib::thread_specific_data<std::unique_ptr<T1>> dataHolder;
+void RegressionWorker::concurrentClassify(T1& learner, std::shared_ptr<std::vector<GazeHyp*>> batch, TaskJoin::Ptr join) {
+    // scheduler threads are no dlib threads, thread_local copies are released when they end
+    static thread_local std::unique_ptr<T1> localLearner;
     if (!learner.isInitialized()) return;
-    tpool.add_task_by_value( [&ghyp, &learner, this](void) {
-        if (!dataHolder.data()) {
+    join->add();
+    scheduler.spawn( [batch, &learner, join, this](void) {
+        if (!localLearner) {
             lock_guard<mutex> lock(allocmutex);
-            dataHolder.data() = unique_ptr<T1>(new T1(learner));
+            localLearner = unique_ptr<T1>(new T1(learner));
         }
-        dataHolder.data()->classify(ghyp);
+        Trace::Scope scope("classify");
+        localLearner->classifyBatch(*batch);
+        join->done();
     });
 }
 
-void RegressionWorker::runTasks(GazeHypsPtr gazehyps) {
-    for (auto& ghyp : *gazehyps) {
-        tpool.add_task_by_value( [&gazehyps, &ghyp](void) {ghyp.pupils = PupilFinder(gazehyps->frame, ghyp.faceParts);} );
-        tpool.add_task_by_value( [&ghyp, this](void) {featureExtractor.extractLidFeatures(ghyp);} );
-        tpool.add_task_by_value( [&ghyp, this](void) {featureExtractor.extractEyeHogFeatures(ghyp);} );
-        tpool.wait_for_all_tasks();
+// extraction -> assembly for every face on its own, the frame join follows the last face
+void RegressionWorker::scheduleFace(GazeHypsPtr gazehyps, GazeHyp& ghyp, int face, TaskJoin::Ptr frameJoin) {
+    struct Extraction {
+        Stage stage;
+        const char* name;
+        TaskScheduler::Task task;
+    };
+    const long sequence = gazehyps->sequence;
+    ghyp.features.allocate(gazehyps->featureArena, featureExtractor.segmentSizes(ghyp));
+    frameJoin->add();
+    TaskJoin::Ptr extracted = TaskJoin::create( [&ghyp, frameJoin, sequence, face, this](void) {
+        Trace::Scope scope("face_features", sequence, face);
+        const auto start = Metrics::now();
         featureExtractor.extractFaceFeatures(ghyp);
         featureExtractor.extractHorizGazeFeatures(ghyp);
         featureExtractor.extractVertGazeFeatures(ghyp);
-        concurrentClassify(lidlearner, ghyp);
-        concurrentClassify(gazelearner, ghyp);
-        concurrentClassify(rellearner, ghyp);
-        concurrentClassify(relativeGazeLearner, ghyp);
-        concurrentClassify(vglearner, ghyp);
+        Metrics::record(Stage::FACE_FEATURES, start);
+        frameJoin->done();
+    });
+    vector<Extraction> extraction = {
+        {Stage::PUPILS, "pupils", [gazehyps, &ghyp, this](void) { ghyp.pupils = PupilFinder(gazehyps->grayframe, ghyp.faceParts, pupilSearch); }},
+        {Stage::LID_FEATURES, "lid_features", [&ghyp, this](void) { featureExtractor.extractLidFeatures(ghyp); }},
+        {Stage::EYE_HOG, "eye_hog", [&ghyp, this](void) { featureExtractor.extractEyeHogFeatures(ghyp); }}
+    };
+    for (auto& task : extraction) {
+        extracted->add();
+        scheduler.spawn( [task, extracted, sequence, face](void) {
+            Trace::Scope scope(task.name, sequence, face);
+            const auto start = Metrics::now();
+            task.task();
+            Metrics::record(task.stage, start);
+            extracted->done();
+        });
+    }
+    extracted->done();
+}
+
+// frames that finish extraction while a dispatch is still queued are classified in the same batch
+void RegressionWorker::queueClassification(GazeHypsPtr gazehyps) {
+    lock_guard<mutex> lock(pendingmutex);
+    pendingFrames.push_back(gazehyps);
+    if (!dispatchScheduled) {
+        dispatchScheduled = true;
+        scheduler.spawn( [this](void) {dispatchClassification();} );
+    }
+}
+
+void RegressionWorker::dispatchClassification() {
+    vector<GazeHypsPtr> frames;
+    {
+        lock_guard<mutex> lock(pendingmutex);
+        frames.swap(pendingFrames);
+        dispatchScheduled = false;
+    }
+    auto batch = make_shared<vector<GazeHyp*>>();
+    for (auto& gazehyps : frames) {
+        for (auto& ghyp : *gazehyps) {
+            batch->push_back(&ghyp);
+        }
+    }
+    const auto start = Metrics::now();
+    TaskJoin::Ptr classified = TaskJoin::create( [frames, start](void) {
+        const auto end = Metrics::now();
+        Metrics::record(Stage::CLASSIFICATION, start, end);
+        for (auto& gazehyps : frames) {
+            gazehyps->stageTime = end;
+            gazehyps->setready(-1);
+        }
+    });
+    if (!batch->empty()) {
+        concurrentClassify(lidlearner, batch, classified);
+        concurrentClassify(gazelearner, batch, classified);
+        concurrentClassify(rellearner, batch, classified);
+        concurrentClassify(relativeGazeLearner, batch, classified);
+        concurrentClassify(vglearner, batch, classified);
     }
-    tpool.wait_for_all_tasks();
-    gazehyps->setready(-1);
+    classified->done();
 }
 
 
 void RegressionWorker::thread() {
+    Trace::setThreadName("regression_dispatch");
     try {
         while (!should_stop()) {
-            _hypsqueue.waitAccept();
+            {
+                Trace::Scope scope("wait_accept");
+                _hypsqueue.waitAccept();
+            }
             _inqueue.peek()->waitready();
             GazeHypsPtr ghyps = _inqueue.pop();
+            Metrics::record(Stage::REGRESSION_WAIT, ghyps->stageTime);
             ghyps->setready(1);
-            tpool.add_task_by_value(  [ghyps, this](void) {runTasks(ghyps);} );
+            TaskJoin::Ptr extracted = TaskJoin::create( [ghyps, this](void) {queueClassification(ghyps);} );
+            int face = 0;
+            for (auto& ghyp : *ghyps) {
+                scheduleFace(ghyps, ghyp, face++, extracted);
+            }
+            extracted->done();
             _hypsqueue.push(ghyps);
         }
     } catch(QueueInterruptedException) {}
     _hypsqueue.interrupt();
-    tpool.wait_for_all_tasks();
+    scheduler.waitIdle();
 }
 
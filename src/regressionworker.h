@@ -4,36 +4,43 @@
 #include <dlib/threads.h>
 #include "imageprovider.h"
 #include "gazehyps.h"
-#include "blockingqueue.h"
 #include "mutualgazelearner.h"
 #include "relativeeyelidlearner.h"
 #include "relativegazelearner.h"
 #include "verticalgazelearner.h"
 #include "eyelidlearner.h"
 #include "featureextractor.h"
+#include "taskscheduler.h"
 
 class RegressionWorker : public dlib::multithreaded_object
 {
 public:
-    RegressionWorker(BlockingQueue<GazeHypsPtr>& inqueue, EyeLidLearner& eoc,
+    RegressionWorker(GazeHypsQueue& inqueue, EyeLidLearner& eoc,
                 MutualGazeLearner& glearner, RelativeGazeLearner& rglearner,
-                RelativeEyeLidLearner &rellearner, VerticalGazeLearner& vglearner, int threadcount);
+                RelativeEyeLidLearner &rellearner, VerticalGazeLearner& vglearner, int threadcount,
+                PupilFinder::SearchStrategy pupilSearch = PupilFinder::SearchStrategy::EXHAUSTIVE);
     ~RegressionWorker();
-    BlockingQueue<GazeHypsPtr>& hypsqueue();
+    GazeHypsQueue& hypsqueue();
 
 private:
-    dlib::thread_pool tpool;
-    BlockingQueue<GazeHypsPtr>& _inqueue;
-    BlockingQueue<GazeHypsPtr> _hypsqueue;
+    TaskScheduler scheduler;
+    GazeHypsQueue& _inqueue;
+    GazeHypsQueue _hypsqueue;
     EyeLidLearner& lidlearner;
     MutualGazeLearner& gazelearner;
     RelativeGazeLearner& relativeGazeLearner;
     RelativeEyeLidLearner& rellearner;
     VerticalGazeLearner& vglearner;
     FeatureExtractor featureExtractor;
+    PupilFinder::SearchStrategy pupilSearch;
     std::mutex allocmutex;
+    std::mutex pendingmutex;
+    std::vector<GazeHypsPtr> pendingFrames;
+    bool dispatchScheduled = false;
     void thread();
-    void runTasks(GazeHypsPtr gazehyps);
+    void scheduleFace(GazeHypsPtr gazehyps, GazeHyp& ghyp, int face, TaskJoin::Ptr frameJoin);
+    void queueClassification(GazeHypsPtr gazehyps);
+    void dispatchClassification();
     template<typename T1>
-    void concurrentClassify(T1& learner, GazeHyp& ghyp);
+    void concurrentClassify(T1& learner, std::shared_ptr<std::vector<GazeHyp*>> batch, TaskJoin::Ptr join);
 };
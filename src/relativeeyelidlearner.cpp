@@ -22,25 +22,27 @@ void RelativeEyeLidLearner::loadClassifier(const string &filename)
     _loadClassifier(filename, learned_function);
 }
 
-boost::optional<dlib::matrix<double,0,1>> RelativeEyeLidLearner::getFeatureVector(GazeHyp& ghyp) {
-    auto result = boost::optional<dlib::matrix<double,0,1>>();
-    if (ghyp.faceFeatures.size() && ghyp.lidFeatures.size()) {
-        switch (trainParams.featureSet.get_value_or(FeatureSetConfig::ALL)) {
-        case FeatureSetConfig::ALL:
-        case FeatureSetConfig::HOGPOS:
-            result = dlib::join_cols(dlib::rowm(ghyp.faceFeatures, dlib::range(0, ghyp.faceFeatures.nr()-5)), ghyp.eyeHogFeatures);
-            break;
-        case FeatureSetConfig::HOG:
-            result = ghyp.eyeHogFeatures;
-            break;
-        case FeatureSetConfig::POSITIONAL:
-            result = dlib::rowm(ghyp.faceFeatures, dlib::range(0, ghyp.faceFeatures.nr()-5));
-            break;
-        default:
-            throw std::runtime_error("feature-set not implemented");
-        }
+FeatureLayout RelativeEyeLidLearner::featureLayout() {
+    FeatureLayout fl;
+    fl.required = {FeatureSegment::FACE, FeatureSegment::LID};
+    //face features without both pupils
+    const FeatureRange positional = {FeatureSegment::FACE, 0, 4};
+    const FeatureRange hog = {FeatureSegment::EYE_HOG, 0, 0};
+    switch (trainParams.featureSet.get_value_or(FeatureSetConfig::ALL)) {
+    case FeatureSetConfig::ALL:
+    case FeatureSetConfig::HOGPOS:
+        fl.ranges = {positional, hog};
+        break;
+    case FeatureSetConfig::HOG:
+        fl.ranges = {hog};
+        break;
+    case FeatureSetConfig::POSITIONAL:
+        fl.ranges = {positional};
+        break;
+    default:
+        throw std::runtime_error("feature-set not implemented");
     }
-    return result;
+    return fl;
 }
 
 void RelativeEyeLidLearner::classify(GazeHyp &ghyp)
@@ -48,6 +50,13 @@ void RelativeEyeLidLearner::classify(GazeHyp &ghyp)
     _classify(ghyp, learned_function, ghyp.eyeLidClassification);
 }
 
+void RelativeEyeLidLearner::classifyBatch(const std::vector<GazeHyp*>& ghyps)
+{
+    for (auto& r : _classifyBatch(ghyps, learned_function, use_pca)) {
+        r.first->eyeLidClassification = r.second;
+    }
+}
+
 
 void RelativeEyeLidLearner::train(const string &outfilename)
 {
@@ -55,9 +64,15 @@ void RelativeEyeLidLearner::train(const string &outfilename)
     _train(outfilename, learned_function, trainer, true);
 }
 
+void RelativeEyeLidLearner::compileClassifier(const string &outfilename)
+{
+    CompiledModel::write(outfilename, _compile(learned_function, use_pca));
+}
+
 void RelativeEyeLidLearner::visualize(GazeHyp &ghyp)
 {
-    if (!ghyp.eyeLidClassification.is_initialized() || !learned_function.basis_vectors.size()) return;
+    if (!ghyp.eyeLidClassification.is_initialized()) return;
+    if (!compiled && !learned_function.basis_vectors.size()) return;
     auto eoclass = ghyp.eyeLidClassification.get();
     if (!std::isfinite(eoclass)) return;
     int color = ghyp.isLidClosed.get_value_or(false) ? 255 : 80;
@@ -15,7 +15,9 @@ public:
     virtual ~RelativeEyeLidLearner();
     virtual void loadClassifier(const std::string& filename);
     virtual void classify(GazeHyp &ghyp);
+    virtual void classifyBatch(const std::vector<GazeHyp*>& ghyps);
     virtual void train(const std::string &outfilename);
+    virtual void compileClassifier(const std::string& outfilename);
     virtual void visualize(GazeHyp& ghyp);
     virtual std::string getId();
 
@@ -23,5 +25,5 @@ protected:
     typedef dlib::linear_kernel<sample_type> kernel_type;
     typedef dlib::decision_function<kernel_type> dec_funct_type;
     dec_funct_type learned_function;
-    boost::optional<dlib::matrix<double,0,1>> getFeatureVector(GazeHyp& ghyp);
+    FeatureLayout featureLayout();
 };
@@ -15,36 +15,38 @@ RelativeGazeLearner::~RelativeGazeLearner()
 
 }
 
-boost::optional<dlib::matrix<double,0,1>> RelativeGazeLearner::getFeatureVector(GazeHyp& ghyp) {
-    auto result = boost::optional<dlib::matrix<double,0,1>>();
-    if (ghyp.horizGazeFeatures.size() && ghyp.faceFeatures.size() && ghyp.eyeHogFeatures.size()) {
-        switch (trainParams.featureSet.get_value_or(FeatureSetConfig::ALL)) {
-        case FeatureSetConfig::ALL:
-            result = dlib::join_cols(dlib::join_cols(ghyp.horizGazeFeatures, ghyp.faceFeatures), ghyp.eyeHogFeatures);
-            break;
-        case FeatureSetConfig::POSREL:
-            result = dlib::join_cols(ghyp.horizGazeFeatures, ghyp.faceFeatures);
-            break;
-        case FeatureSetConfig::RELATIONAL:
-            result = ghyp.horizGazeFeatures;
-            break;
-        case FeatureSetConfig::HOG:
-            result = ghyp.eyeHogFeatures;
-            break;
-        case FeatureSetConfig::HOGREL:
-            result = dlib::join_cols(ghyp.horizGazeFeatures, ghyp.eyeHogFeatures);
-            break;
-        case FeatureSetConfig::HOGPOS:
-            result = dlib::join_cols(ghyp.faceFeatures, ghyp.eyeHogFeatures);
-            break;
-        case FeatureSetConfig::POSITIONAL:
-            result = ghyp.faceFeatures;
-            break;
-        default:
-            throw std::runtime_error("feature-set not implemented");
-        }
+FeatureLayout RelativeGazeLearner::featureLayout() {
+    FeatureLayout fl;
+    fl.required = {FeatureSegment::HORIZ_GAZE, FeatureSegment::FACE, FeatureSegment::EYE_HOG};
+    const FeatureRange relational = {FeatureSegment::HORIZ_GAZE, 0, 0};
+    const FeatureRange positional = {FeatureSegment::FACE, 0, 0};
+    const FeatureRange hog = {FeatureSegment::EYE_HOG, 0, 0};
+    switch (trainParams.featureSet.get_value_or(FeatureSetConfig::ALL)) {
+    case FeatureSetConfig::ALL:
+        fl.ranges = {relational, positional, hog};
+        break;
+    case FeatureSetConfig::POSREL:
+        fl.ranges = {relational, positional};
+        break;
+    case FeatureSetConfig::RELATIONAL:
+        fl.ranges = {relational};
+        break;
+    case FeatureSetConfig::HOG:
+        fl.ranges = {hog};
+        break;
+    case FeatureSetConfig::HOGREL:
+        fl.ranges = {relational, hog};
+        break;
+    case FeatureSetConfig::HOGPOS:
+        fl.ranges = {positional, hog};
+        break;
+    case FeatureSetConfig::POSITIONAL:
+        fl.ranges = {positional};
+        break;
+    default:
+        throw std::runtime_error("feature-set not implemented");
     }
-    return result;
+    return fl;
 }
 
 void RelativeGazeLearner::classify(GazeHyp& ghyp){
@@ -52,12 +54,24 @@ void RelativeGazeLearner::classify(GazeHyp& ghyp){
     //cerr << ghyp.relativeGazeClassification << endl;
 }
 
+void RelativeGazeLearner::classifyBatch(const std::vector<GazeHyp*>& ghyps)
+{
+    for (auto& r : _classifyBatch(ghyps, learned_function, use_pca)) {
+        r.first->horizontalGazeEstimation = r.second;
+    }
+}
+
 
 void RelativeGazeLearner::train(const string& outfilename) {
     dlib::svr_trainer<kernel_type> trainer;
     _train(outfilename, learned_function, trainer);
 }
 
+void RelativeGazeLearner::compileClassifier(const string &outfilename)
+{
+    CompiledModel::write(outfilename, _compile(learned_function, use_pca));
+}
+
 void RelativeGazeLearner::visualize(GazeHyp& ghyp, double mutualGazeTolerance)
 {
     if (!ghyp.horizontalGazeEstimation.is_initialized()) return;
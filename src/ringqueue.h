@@ -0,0 +1,199 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "blockingqueue.h"
+
+/**
+ * @brief Bounded lock-free multi-producer multi-consumer queue with the interface and
+ * the capacity and interrupt semantics of BlockingQueue.
+ *
+ * Cells carry a sequence number that tells producers and consumers whether a cell is free
+ * or filled for their position, so no lock is taken on the fast path. Waiting threads spin
+ * for a short while before they park on a condition variable, and the mutex is only
+ * touched for notification if a thread is actually parked.
+ * peek() is only valid while a single thread consumes from the queue.
+ */
+template <class T>
+class RingQueue {
+
+public:
+    RingQueue() : RingQueue(1) {
+
+    }
+
+    RingQueue(size_t capacity) : _slots(capacity+1), _cells(new Cell[capacity+1]) {
+        // like BlockingQueue, a queue accepts elements as long as it holds at most capacity
+        for (size_t i = 0; i < _slots; i++) {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~RingQueue() {
+
+    }
+
+    void waitAccept() {
+        waitFor([this]() { return size() < _slots; });
+        if (interrupted) throw QueueInterruptedException("queue interrupted");
+    }
+
+    bool offer(T t) {
+        if (!tryPush(t)) {
+            return false;
+        }
+        wake();
+        return true;
+    }
+
+    void push(T t) {
+        bool pushed = false;
+        if (!interrupted) {
+            waitFor([this, &t, &pushed]() { return (pushed = tryPush(t)); });
+        }
+        if (!pushed) throw QueueInterruptedException("queue interrupted");
+        wake();
+    }
+
+    T peek() {
+        T val;
+        bool found = false;
+        waitFor([this, &val, &found]() { return (found = tryPeek(val)); });
+        if (!found && !tryPeek(val)) {
+            throw QueueInterruptedException("queue interrupted");
+        }
+        return val;
+    }
+
+    T pop() {
+        T val;
+        bool popped = false;
+        waitFor([this, &val, &popped]() { return (popped = tryPop(val)); });
+        if (!popped && !tryPop(val)) {
+            throw QueueInterruptedException("queue interrupted");
+        }
+        wake();
+        return val;
+    }
+
+    size_t size() {
+        size_t deq = _dequeuePos.load(std::memory_order_acquire);
+        size_t enq = _enqueuePos.load(std::memory_order_acquire);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    void interrupt() {
+        interrupted = true;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _condition.notify_all();
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    static constexpr int SPIN_ITERATIONS = 128;
+    static constexpr int YIELD_ITERATIONS = 16;
+
+    const size_t _slots;
+    std::unique_ptr<Cell[]> _cells;
+    alignas(64) std::atomic<size_t> _enqueuePos{0};
+    alignas(64) std::atomic<size_t> _dequeuePos{0};
+    alignas(64) std::atomic<int> _sleepers{0};
+    std::atomic<bool> interrupted{false};
+    std::mutex _mutex;
+    std::condition_variable _condition;
+
+    bool tryPush(T& t) {
+        Cell* cell;
+        size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &_cells[pos % _slots];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (_enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(t);
+        cell->sequence.store(pos+1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& t) {
+        Cell* cell;
+        size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &_cells[pos % _slots];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+            if (dif == 0) {
+                if (_dequeuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = _dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        t = std::move(cell->data);
+        // do not keep the element alive in the cell
+        cell->data = T();
+        cell->sequence.store(pos+_slots, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPeek(T& t) {
+        size_t pos = _dequeuePos.load(std::memory_order_acquire);
+        Cell& cell = _cells[pos % _slots];
+        if (cell.sequence.load(std::memory_order_acquire) != pos+1) {
+            return false;
+        }
+        t = cell.data;
+        return true;
+    }
+
+    static void relax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_ia32_pause();
+#endif
+    }
+
+    // returns as soon as ready() holds or the queue is interrupted
+    template<typename Pred>
+    void waitFor(Pred ready) {
+        for (int i = 0; i < SPIN_ITERATIONS + YIELD_ITERATIONS; i++) {
+            if (ready() || interrupted) return;
+            if (i < SPIN_ITERATIONS) {
+                relax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _sleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!ready() && !interrupted) {
+            _condition.wait(lock);
+        }
+        _sleepers.fetch_sub(1);
+    }
+
+    void wake() {
+        // pairs with the fence in waitFor: either the sleeper sees the new state or we see the sleeper
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_sleepers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _condition.notify_all();
+        }
+    }
+};
@@ -1,4 +1,5 @@
 #include "shapedetectionworker.h"
+#include "trace.h"
 
 #include <dlib/threads.h>
 #include <dlib/image_processing/frontal_face_detector.h>
@@ -10,9 +11,8 @@
 
 using namespace std;
 
-ShapeDetectionWorker::ShapeDetectionWorker(BlockingQueue<GazeHypsPtr>& inqueue, const std::string &modelfilename, int threadcount)
-    : _inqueue(inqueue), _hypsqueue(threadcount), _workqueue(threadcount) {
-    dlib::deserialize(modelfilename) >> _shapePredictor; // read face model from file
+ShapeDetectionWorker::ShapeDetectionWorker(GazeHypsQueue& inqueue, const std::string &modelfilename, int threadcount)
+    : _inqueue(inqueue), _hypsqueue(threadcount), _workqueue(threadcount), _shapePredictor(modelfilename) {
     register_thread(*this, &ShapeDetectionWorker::thread);
     for (int i = 0; i < threadcount; i++) {
         register_thread(*this, &ShapeDetectionWorker::alignFaces);
@@ -27,31 +27,46 @@ ShapeDetectionWorker::~ShapeDetectionWorker() {
     wait();
 }
 
-BlockingQueue<GazeHypsPtr>& ShapeDetectionWorker::hypsqueue()
+GazeHypsQueue& ShapeDetectionWorker::hypsqueue()
 {
     return _hypsqueue;
 }
 
 void ShapeDetectionWorker::alignFaces() {
-    //working with thread individual copy, since the detector is not thread safe.
-    dlib::shape_predictor sp = _shapePredictor;
+    //the predictor is shared read-only by all threads, it only keeps thread local scratch buffers.
+    Trace::setThreadName("alignment");
     try {
         while (true) {
-            GazeHypsPtr gazehyps = _workqueue.pop();
+            GazeHypsPtr gazehyps;
+            {
+                Trace::Scope scope("wait_input");
+                gazehyps = _workqueue.pop();
+            }
+            const auto start = Metrics::now();
+            Metrics::record(Stage::ALIGNMENT_WAIT, gazehyps->stageTime, start);
+            const dlib::cv_image<unsigned char> img(gazehyps->grayframe);
+            int face = 0;
             for (auto& ghyp : *gazehyps) {
-                dlib::full_object_detection shape = sp(gazehyps->dlibimage, ghyp.faceDetection);
+                Trace::Scope scope("align", gazehyps->sequence, face++);
+                dlib::full_object_detection shape = _shapePredictor(img, ghyp.faceDetection);
                 ghyp.shape = shape;
                 ghyp.faceParts = FaceParts(shape);
             }
+            gazehyps->stageTime = Metrics::now();
+            Metrics::record(Stage::ALIGNMENT, start, gazehyps->stageTime);
             gazehyps->setready(-1);
         }
     } catch (QueueInterruptedException) {}
 }
 
 void ShapeDetectionWorker::thread() {
+    Trace::setThreadName("alignment_dispatch");
     try {
         while (!should_stop()) {
-            _hypsqueue.waitAccept();
+            {
+                Trace::Scope scope("wait_accept");
+                _hypsqueue.waitAccept();
+            }
             _inqueue.peek()->waitready();
             GazeHypsPtr ghyps = _inqueue.pop();
             ghyps->setready(1);
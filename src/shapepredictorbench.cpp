@@ -0,0 +1,93 @@
+#include <iostream>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+#include <opencv2/opencv.hpp>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <dlib/image_processing.h>
+#include <dlib/opencv.h>
+
+#include "flatshapepredictor.h"
+#include "imageprovider.h"
+
+using namespace std;
+
+// faces are cropped with some margin, so the predictors sample the same pixels as on the full frame
+static constexpr double CROP_PADDING = 0.5;
+
+struct FaceCrop {
+    std::unique_ptr<dlib::array2d<unsigned char>> image;
+    dlib::rectangle rect;
+};
+
+static vector<FaceCrop> collectCrops(const string& batchfile) {
+    dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+    BatchImageProvider images(batchfile);
+    vector<FaceCrop> crops;
+    cv::Mat frame;
+    while (images.get(frame)) {
+        dlib::array2d<unsigned char> gray;
+        dlib::assign_image(gray, dlib::cv_image<dlib::bgr_pixel>(frame));
+        for (const auto& facerect : detector(gray)) {
+            dlib::rectangle roi = dlib::get_rect(gray).intersect(dlib::grow_rect(facerect,
+                                  CROP_PADDING*max(facerect.width(), facerect.height())));
+            FaceCrop crop;
+            crop.image.reset(new dlib::array2d<unsigned char>(roi.height(), roi.width()));
+            for (long r = 0; r < roi.height(); r++) {
+                for (long c = 0; c < roi.width(); c++) {
+                    (*crop.image)[r][c] = gray[roi.top() + r][roi.left() + c];
+                }
+            }
+            crop.rect = dlib::translate_rect(facerect, -roi.tl_corner());
+            crops.push_back(std::move(crop));
+        }
+    }
+    return crops;
+}
+
+template<typename Predictor>
+static double timePredictor(const Predictor& predictor, const vector<FaceCrop>& crops, int repetitions,
+                            vector<dlib::full_object_detection>& shapes) {
+    shapes.clear();
+    auto tstart = chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; r++) {
+        for (const auto& crop : crops) {
+            dlib::full_object_detection shape = predictor(*crop.image, crop.rect);
+            if (r == 0) shapes.push_back(shape);
+        }
+    }
+    double elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - tstart).count();
+    return elapsed / (repetitions*max<size_t>(1, crops.size()));
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 4) {
+        cerr << "usage: " << argv[0] << " <batchfile> <shape model .dat> [repetitions]" << endl;
+        return 1;
+    }
+    int repetitions = argc > 3 ? boost::lexical_cast<int>(argv[3]) : 5;
+    vector<FaceCrop> crops = collectCrops(argv[1]);
+    auto tload = chrono::steady_clock::now();
+    dlib::shape_predictor dlibPredictor;
+    dlib::deserialize(argv[2]) >> dlibPredictor;
+    double dlibLoad = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - tload).count();
+    tload = chrono::steady_clock::now();
+    FlatShapePredictor flatPredictor(argv[2]);
+    double flatLoad = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - tload).count();
+
+    vector<dlib::full_object_detection> dlibShapes, flatShapes;
+    double dlibTime = timePredictor(dlibPredictor, crops, repetitions, dlibShapes);
+    double flatTime = timePredictor(flatPredictor, crops, repetitions, flatShapes);
+    long mismatches = 0;
+    for (size_t i = 0; i < crops.size(); i++) {
+        for (unsigned long p = 0; p < dlibShapes[i].num_parts(); p++) {
+            if (dlibShapes[i].part(p) != flatShapes[i].part(p)) mismatches++;
+        }
+    }
+    cout << "faces: " << crops.size() << endl;
+    cout << "predictor\tload_ms\tus_per_face\tspeedup\tmismatched_points" << endl;
+    cout << "dlib\t" << dlibLoad << "\t" << dlibTime << "\t1\t0" << endl;
+    cout << "flat\t" << flatLoad << "\t" << flatTime << "\t" << dlibTime/max(1e-9, flatTime) << "\t" << mismatches << endl;
+    return mismatches ? 2 : 0;
+}
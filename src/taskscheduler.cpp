@@ -0,0 +1,126 @@
+#include "taskscheduler.h"
+#include "trace.h"
+
+using namespace std;
+
+// the scheduler and worker index of the calling thread, if it is a worker
+static thread_local TaskScheduler* currentScheduler = nullptr;
+static thread_local size_t currentWorker = 0;
+
+TaskScheduler::TaskScheduler(int threadcount)
+{
+    for (int i = 0; i < max(1, threadcount); i++) {
+        workers.emplace_back(new Worker());
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        threads.emplace_back(&TaskScheduler::run, this, i);
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    waitIdle();
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void TaskScheduler::spawn(Task task)
+{
+    pending++;
+    size_t index = currentScheduler == this ? currentWorker : nextWorker++ % workers.size();
+    {
+        lock_guard<std::mutex> lock(workers[index]->mutex);
+        workers[index]->tasks.push_back(std::move(task));
+    }
+    {
+        lock_guard<std::mutex> lock(mutex);
+        queued++;
+    }
+    wakeup.notify_one();
+}
+
+void TaskScheduler::waitIdle()
+{
+    unique_lock<std::mutex> lock(mutex);
+    while (pending > 0) {
+        idle.wait(lock);
+    }
+}
+
+bool TaskScheduler::take(size_t index, Task& task)
+{
+    {
+        Worker& own = *workers[index];
+        lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker& victim = *workers[(index + i) % workers.size()];
+        lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::run(size_t index)
+{
+    currentScheduler = this;
+    currentWorker = index;
+    Trace::setThreadName("scheduler");
+    Task task;
+    while (true) {
+        if (take(index, task)) {
+            queued--;
+            task();
+            task = nullptr;
+            if (--pending == 0) {
+                lock_guard<std::mutex> lock(mutex);
+                idle.notify_all();
+            }
+            continue;
+        }
+        unique_lock<std::mutex> lock(mutex);
+        while (queued <= 0 && !stopping) {
+            wakeup.wait(lock);
+        }
+        if (stopping && queued <= 0) {
+            return;
+        }
+    }
+}
+
+TaskJoin::TaskJoin(function<void()> continuation)
+    : continuation(std::move(continuation))
+{
+}
+
+TaskJoin::Ptr TaskJoin::create(function<void()> continuation)
+{
+    return Ptr(new TaskJoin(std::move(continuation)));
+}
+
+void TaskJoin::add()
+{
+    count++;
+}
+
+void TaskJoin::done()
+{
+    if (--count == 0) {
+        continuation();
+    }
+}
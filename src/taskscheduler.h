@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+/**
+ * @brief Work-stealing thread pool for small task graphs.
+ *
+ * Every worker owns a deque. Tasks spawned from a worker go to its own deque and are taken
+ * newest first, so follow-up tasks of a graph stay on the thread that produced their input.
+ * Idle workers steal the oldest tasks of the others. Tasks spawned from other threads are
+ * distributed round robin.
+ */
+class TaskScheduler
+{
+public:
+    typedef std::function<void()> Task;
+
+    TaskScheduler(int threadcount);
+    ~TaskScheduler();
+    void spawn(Task task);
+    void waitIdle();
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> nextWorker{0};
+    std::atomic<int> queued{0};
+    std::atomic<int> pending{0};
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable idle;
+
+    bool take(size_t index, Task& task);
+    void run(size_t index);
+};
+
+/**
+ * @brief Runs a continuation after all tasks added to it are done.
+ *
+ * The join starts with one hold for its creator, which has to call done() as well
+ * once it added all tasks.
+ */
+class TaskJoin
+{
+public:
+    typedef std::shared_ptr<TaskJoin> Ptr;
+
+    static Ptr create(std::function<void()> continuation);
+    void add();
+    void done();
+
+private:
+    TaskJoin(std::function<void()> continuation);
+    std::function<void()> continuation;
+    std::atomic<int> count{1};
+};
@@ -0,0 +1,239 @@
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+static constexpr size_t CHUNK_EVENTS = 1024;
+static constexpr int FLUSH_MS = 100;
+
+namespace {
+
+struct Event {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    long frame;
+    int face;
+};
+
+struct Chunk {
+    unsigned session;
+    int tid;
+    const char* threadName;
+    size_t count = 0;
+    Chunk* next = nullptr;
+    Event events[CHUNK_EVENTS];
+};
+
+atomic<bool> active{false};
+// chunks recorded during an earlier session are dropped
+atomic<unsigned> currentSession{0};
+// chunks ready for writing, pushed by the recording threads, taken as a whole by the writer
+atomic<Chunk*> fullChunks{nullptr};
+atomic<int> nextTid{1};
+chrono::steady_clock::time_point origin;
+
+struct Writer {
+    ofstream out;
+    set<int> namedThreads;
+    bool first = true;
+    bool stopping = false;
+    std::mutex writemutex;
+    condition_variable wakeup;
+    std::thread writerThread;
+};
+Writer* writer = nullptr;
+
+void publish(Chunk* chunk) {
+    chunk->next = fullChunks.load(memory_order_relaxed);
+    while (!fullChunks.compare_exchange_weak(chunk->next, chunk, memory_order_release, memory_order_relaxed)) {}
+}
+
+struct ThreadBuffer;
+// All live thread buffers, so a closing session can collect the chunks that are not full yet.
+// Never destroyed, pooled threads may end after static destruction.
+struct Registry {
+    std::mutex registrymutex;
+    set<ThreadBuffer*> buffers;
+};
+Registry& registry() {
+    static Registry* instance = new Registry();
+    return *instance;
+}
+
+struct ThreadBuffer {
+    const int tid = nextTid++;
+    const char* name = nullptr;
+    Chunk* chunk = nullptr;
+    // only contended while a session collects the partial chunks
+    std::mutex chunkMutex;
+
+    ThreadBuffer() {
+        lock_guard<std::mutex> lock(registry().registrymutex);
+        registry().buffers.insert(this);
+    }
+
+    ~ThreadBuffer() {
+        {
+            lock_guard<std::mutex> lock(registry().registrymutex);
+            registry().buffers.erase(this);
+        }
+        lock_guard<std::mutex> lock(chunkMutex);
+        handOff();
+    }
+
+    void add(const Event& event) {
+        lock_guard<std::mutex> lock(chunkMutex);
+        if (!chunk) {
+            chunk = new Chunk();
+            chunk->session = currentSession.load(memory_order_relaxed);
+            chunk->tid = tid;
+        }
+        chunk->events[chunk->count++] = event;
+        if (chunk->count == CHUNK_EVENTS) handOff();
+    }
+
+    // chunkMutex has to be held
+    void handOff() {
+        if (!chunk) return;
+        if (!active.load(memory_order_acquire) || chunk->session != currentSession.load(memory_order_relaxed)) {
+            delete chunk;
+        } else {
+            chunk->threadName = name;
+            publish(chunk);
+        }
+        chunk = nullptr;
+    }
+};
+
+ThreadBuffer& threadBuffer() {
+    static thread_local ThreadBuffer buffer;
+    return buffer;
+}
+
+// hands the partial chunks of all threads to the writer, including pooled threads that outlive the session
+void collectChunks() {
+    lock_guard<std::mutex> registryLock(registry().registrymutex);
+    for (ThreadBuffer* buffer : registry().buffers) {
+        lock_guard<std::mutex> lock(buffer->chunkMutex);
+        buffer->handOff();
+    }
+}
+
+uint64_t sinceOrigin() {
+    // never zero, zero marks scopes that started while tracing was off
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count() + 1;
+}
+
+void writeChunks(Writer& w) {
+    Chunk* chunks = fullChunks.exchange(nullptr, memory_order_acquire);
+    // oldest first
+    Chunk* ordered = nullptr;
+    while (chunks) {
+        Chunk* next = chunks->next;
+        chunks->next = ordered;
+        ordered = chunks;
+        chunks = next;
+    }
+    const int pid = getpid();
+    while (ordered) {
+        Chunk* chunk = ordered;
+        if (chunk->threadName && w.namedThreads.insert(chunk->tid).second) {
+            w.out << (w.first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+                  << ",\"tid\":" << chunk->tid << ",\"args\":{\"name\":\"" << chunk->threadName << "\"}}";
+            w.first = false;
+        }
+        for (size_t i = 0; i < chunk->count; i++) {
+            const Event& e = chunk->events[i];
+            w.out << (w.first ? "\n" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":" << pid
+                  << ",\"tid\":" << chunk->tid << ",\"ts\":" << e.start/1e3 << ",\"dur\":" << e.duration/1e3;
+            if (e.frame >= 0 || e.face >= 0) {
+                w.out << ",\"args\":{";
+                if (e.frame >= 0) w.out << "\"frame\":" << e.frame << (e.face >= 0 ? "," : "");
+                if (e.face >= 0) w.out << "\"face\":" << e.face;
+                w.out << "}";
+            }
+            w.out << "}";
+            w.first = false;
+        }
+        ordered = chunk->next;
+        delete chunk;
+    }
+}
+
+void writeLoop(Writer& w) {
+    unique_lock<std::mutex> lock(w.writemutex);
+    while (!w.stopping) {
+        w.wakeup.wait_for(lock, chrono::milliseconds(FLUSH_MS));
+        writeChunks(w);
+    }
+    writeChunks(w);
+}
+
+}
+
+Trace::Session::Session(const string& filename)
+{
+    if (writer) throw logic_error("only one trace session can be active");
+    writer = new Writer();
+    writer->out.open(filename, ios::out | ios::trunc);
+    if (!writer->out.is_open()) {
+        delete writer;
+        writer = nullptr;
+        throw runtime_error("Error: Cannot write trace " + filename);
+    }
+    writer->out.precision(15);
+    writer->out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    origin = chrono::steady_clock::now();
+    currentSession++;
+    active.store(true, memory_order_release);
+    writer->writerThread = std::thread(writeLoop, std::ref(*writer));
+}
+
+Trace::Session::~Session()
+{
+    collectChunks();
+    active.store(false, memory_order_release);
+    {
+        lock_guard<std::mutex> lock(writer->writemutex);
+        writer->stopping = true;
+    }
+    writer->wakeup.notify_all();
+    writer->writerThread.join();
+    writer->out << "\n]}\n";
+    delete writer;
+    writer = nullptr;
+}
+
+Trace::Scope::Scope(const char* name, long frame, int face)
+    : name(name), frame(frame), face(face), start(enabled() ? sinceOrigin() : 0)
+{
+}
+
+Trace::Scope::~Scope()
+{
+    if (start && enabled()) {
+        threadBuffer().add(Event{name, start, sinceOrigin() - start, frame, face});
+    }
+}
+
+bool Trace::enabled()
+{
+    return active.load(memory_order_acquire);
+}
+
+void Trace::setThreadName(const char* name)
+{
+    ThreadBuffer& buffer = threadBuffer();
+    lock_guard<std::mutex> lock(buffer.chunkMutex);
+    buffer.name = name;
+}
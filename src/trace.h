@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Timeline of the pipeline in the Chrome trace event format.
+ *
+ * Scopes are recorded as complete events into a chunk owned by the recording thread, behind
+ * a lock that is only contended when the session ends. Full chunks are handed to a writer
+ * thread through a lock-free list and written off the hot path. When the session ends, the
+ * partial chunks of all threads are collected, also of pooled threads that are still alive.
+ * The file opens in chrome://tracing or Perfetto.
+ */
+class Trace
+{
+public:
+    // events of all threads are written to filename while the session exists
+    class Session {
+    public:
+        Session(const std::string& filename);
+        ~Session();
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+    };
+
+    class Scope {
+    public:
+        Scope(const char* name, long frame = -1, int face = -1);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        const char* name;
+        long frame;
+        int face;
+        uint64_t start;
+    };
+
+    static bool enabled();
+    // shown as the thread name in the timeline, name has to be a string literal
+    static void setThreadName(const char* name);
+};
@@ -20,37 +20,38 @@ void VerticalGazeLearner::loadClassifier(const string &filename)
     _loadClassifier(filename, learned_function);
 }
 
-boost::optional<dlib::matrix<double,0,1>> VerticalGazeLearner::getFeatureVector(GazeHyp& ghyp) {
-    auto result = boost::optional<dlib::matrix<double,0,1>>();
-    if (ghyp.lidFeatures.size() && ghyp.faceFeatures.size() && ghyp.vertGazeFeatures.size()) {
-        switch (trainParams.featureSet.get_value_or(FeatureSetConfig::ALL)) {
-        case FeatureSetConfig::ALL:
-            result = dlib::join_cols(dlib::join_cols(ghyp.vertGazeFeatures, ghyp.faceFeatures), ghyp.eyeHogFeatures);
-            break;
-        case FeatureSetConfig::POSREL:
-            result = dlib::join_cols(ghyp.vertGazeFeatures, ghyp.faceFeatures);
-            break;
-        case FeatureSetConfig::RELATIONAL:
-            result = ghyp.vertGazeFeatures;
-            break;
-        case FeatureSetConfig::HOG:
-            result = ghyp.eyeHogFeatures;
-            break;
-        case FeatureSetConfig::HOGREL:
-            result = dlib::join_cols(ghyp.vertGazeFeatures, ghyp.eyeHogFeatures);
-            break;
-        case FeatureSetConfig::HOGPOS:
-            result = dlib::join_cols(ghyp.faceFeatures, ghyp.eyeHogFeatures);
-            break;
-        case FeatureSetConfig::POSITIONAL:
-            result = ghyp.faceFeatures;
-            break;
-        default:
-            throw std::runtime_error("feature-set not implemented");
-        }
+FeatureLayout VerticalGazeLearner::featureLayout() {
+    FeatureLayout fl;
+    fl.required = {FeatureSegment::LID, FeatureSegment::FACE, FeatureSegment::VERT_GAZE};
+    const FeatureRange relational = {FeatureSegment::VERT_GAZE, 0, 0};
+    const FeatureRange positional = {FeatureSegment::FACE, 0, 0};
+    const FeatureRange hog = {FeatureSegment::EYE_HOG, 0, 0};
+    switch (trainParams.featureSet.get_value_or(FeatureSetConfig::ALL)) {
+    case FeatureSetConfig::ALL:
+        fl.ranges = {relational, positional, hog};
+        break;
+    case FeatureSetConfig::POSREL:
+        fl.ranges = {relational, positional};
+        break;
+    case FeatureSetConfig::RELATIONAL:
+        fl.ranges = {relational};
+        break;
+    case FeatureSetConfig::HOG:
+        fl.ranges = {hog};
+        break;
+    case FeatureSetConfig::HOGREL:
+        fl.ranges = {relational, hog};
+        break;
+    case FeatureSetConfig::HOGPOS:
+        fl.ranges = {positional, hog};
+        break;
+    case FeatureSetConfig::POSITIONAL:
+        fl.ranges = {positional};
+        break;
+    default:
+        throw std::runtime_error("feature-set not implemented");
     }
-    return result;
-
+    return fl;
 }
 
 
@@ -60,6 +61,13 @@ void VerticalGazeLearner::classify(GazeHyp &ghyp)
     //cerr << ghyp.verticalGazeEstimation.get() << endl;
 }
 
+void VerticalGazeLearner::classifyBatch(const std::vector<GazeHyp*>& ghyps)
+{
+    for (auto& r : _classifyBatch(ghyps, learned_function, use_pca)) {
+        r.first->verticalGazeEstimation = r.second;
+    }
+}
+
 
 void VerticalGazeLearner::train(const string &outfilename)
 {
@@ -68,6 +76,11 @@ void VerticalGazeLearner::train(const string &outfilename)
 
 }
 
+void VerticalGazeLearner::compileClassifier(const string &outfilename)
+{
+    CompiledModel::write(outfilename, _compile(learned_function, use_pca));
+}
+
 void VerticalGazeLearner::visualize(GazeHyp &ghyp, double mutualGazeTolerance)
 {
     if (!ghyp.verticalGazeEstimation.is_initialized()) return;
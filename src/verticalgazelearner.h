@@ -16,7 +16,9 @@ public:
     virtual void loadClassifier(const std::string& filename);
     //virtual void extractFeatures(GazeHyp &ghyp);
     virtual void classify(GazeHyp &ghyp);
+    virtual void classifyBatch(const std::vector<GazeHyp*>& ghyps);
     virtual void train(const std::string &outfilename);
+    virtual void compileClassifier(const std::string& outfilename);
     virtual void visualize(GazeHyp& ghyp, double mutualGazeTolerance);
     virtual std::string getId();
 
@@ -24,5 +26,5 @@ protected:
     typedef dlib::linear_kernel<sample_type> kernel_type;
     typedef dlib::decision_function<kernel_type> dec_funct_type;
     dec_funct_type learned_function;
-    boost::optional<dlib::matrix<double,0,1> > getFeatureVector(GazeHyp &ghyp);
+    FeatureLayout featureLayout();
 };
@@ -1,7 +1,11 @@
 #include "workerthread.h"
 
 #include <opencv2/opencv.hpp>
+#include <cstdio>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
 #include <boost/lexical_cast.hpp>
 #include <boost/accumulators/accumulators.hpp>
 #include <boost/accumulators/statistics/stats.hpp>
@@ -21,6 +25,9 @@
 #include "regressionworker.h"
 #include "eyepatcher.h"
 #include "rlssmoother.h"
+#include "facetracker.h"
+#include "metrics.h"
+#include "trace.h"
 
 #ifdef ENABLE_YARP_SUPPORT
     #include "yarpsupport.h"
@@ -29,6 +36,11 @@
 using namespace std;
 using namespace boost::accumulators;
 
+// frames decoded ahead per prefetch thread
+static constexpr int PREFETCH_FRAMES_PER_THREAD = 4;
+// frames queued for the estimate writer thread before the consumer waits
+static constexpr size_t ESTIMATE_QUEUE_FRAMES = 1024;
+
 
 class TemporalStats {
 private:
@@ -60,12 +72,60 @@ public:
     void printStats(GazeHypsPtr gazehyps) {
         if (gazehyps->frameCounter % 10 == 0)  {
             cerr << "fps: " << round(gazehyps->fps) << " | lat: " << round(gazehyps->latency)
-                 << " | cnt: " << gazehyps->frameCounter << endl;
+                 << " | cnt: " << gazehyps->frameCounter;
+            if (gazehyps->droppedFrames) cerr << " | drop: " << gazehyps->droppedFrames;
+            cerr << endl;
+        }
+    }
+};
+
+
+class TrackSmoothers {
+private:
+    struct Smoothers {
+        RlsSmoother horizGaze;
+        RlsSmoother vertGaze;
+        RlsSmoother lid = RlsSmoother(5, 0.95, 0.09);
+        int lastSeen = 0;
+    };
+    const int maxAge;
+    int counter = 0;
+    std::map<int, Smoothers> smoothers;
+
+public:
+    TrackSmoothers(int maxAge) : maxAge(maxAge) {}
+    void operator()(GazeHyp& ghyp) {
+        Smoothers& s = smoothers[ghyp.trackId];
+        s.lastSeen = counter;
+        s.horizGaze.smoothValue(ghyp.horizontalGazeEstimation);
+        s.vertGaze.smoothValue(ghyp.verticalGazeEstimation);
+        s.lid.smoothValue(ghyp.eyeLidClassification);
+    }
+    void nextFrame() {
+        for (auto it = smoothers.begin(); it != smoothers.end();) {
+            if (counter - it->second.lastSeen > maxAge) {
+                it = smoothers.erase(it);
+            } else {
+                ++it;
+            }
         }
+        counter++;
     }
 };
 
 
+struct LearnerSet {
+    MutualGazeLearner glearner;
+    RelativeGazeLearner rglearner;
+    EyeLidLearner eoclearner;
+    RelativeEyeLidLearner rellearner;
+    VerticalGazeLearner vglearner;
+
+    LearnerSet(TrainingParameters params)
+        : glearner(params), rglearner(params), eoclearner(params), rellearner(params), vglearner(params) {}
+};
+
+
 WorkerThread::WorkerThread(QObject *parent) :
     QObject(parent)
 {
@@ -93,6 +153,12 @@ std::unique_ptr<ImageProvider> WorkerThread::getImageProvider() {
     } else {
         throw runtime_error("invalid input type " + inputType);
     }
+    if (realtime) {
+        imgProvider.reset(new LatestFrameProvider(std::move(imgProvider)));
+    } else if (prefetchThreads > 0 && inputType != "camera" && inputType != "port") {
+        imgProvider.reset(new PrefetchingImageProvider(std::move(imgProvider), prefetchThreads,
+                                                       PREFETCH_FRAMES_PER_THREAD*prefetchThreads));
+    }
     return imgProvider;
 }
 
@@ -112,41 +178,32 @@ void WorkerThread::dumpPpm(ofstream& fout, const cv::Mat& frame) {
     }
 }
 
-void WorkerThread::writeEstHeader(ofstream& fout) {
-    fout << "Frame" << "\t"
-         << "Id" << "\t"
-         << "Label" << "\t"
-         << "Lid" << "\t"
-         << "HorizGaze" << "\t"
-         << "VertGaze" << "\t"
-         << "MutualGaze"
-         << endl;
+// Estimates are written on their own thread, a file that cannot be opened only disables the output.
+unique_ptr<EstimateWriter> WorkerThread::openEstimates(const string& filename, const string& format) {
+    try {
+        return unique_ptr<EstimateWriter>(new AsyncEstimateWriter(EstimateWriter::create(filename, format),
+                                                                  ESTIMATE_QUEUE_FRAMES));
+    } catch (runtime_error& e) {
+        cerr << "Warning: " << e.what() << endl;
+        return nullptr;
+    }
 }
 
-void WorkerThread::dumpEst(ofstream& fout, GazeHypsPtr gazehyps) {
-    if (fout.is_open()) {
-        double lid = std::nan("not set");
-        double gazeest = std::nan("not set");
-        double vertest = std::nan("not set");
-        bool mutgaze = false;
-        if (gazehyps->size()) {
-            GazeHyp& ghyp = gazehyps->hyps(0);
-            lid = ghyp.eyeLidClassification.get_value_or(lid);
-            gazeest = ghyp.horizontalGazeEstimation.get_value_or(gazeest);
-            vertest = ghyp.verticalGazeEstimation.get_value_or(vertest);
-            mutgaze = ghyp.isMutualGaze.get_value_or(false);
-        }
-        fout << gazehyps->frameCounter << "\t"
-             << gazehyps->id << "\t"
-             << gazehyps->label << "\t"
-             << lid << "\t"
-             << gazeest << "\t"
-             << vertest << "\t"
-             << mutgaze
-             << endl;
+static void finishEstimates(unique_ptr<EstimateWriter>& estimates) {
+    if (!estimates) return;
+    try {
+        estimates->finish();
+    } catch (runtime_error& e) {
+        cerr << e.what() << endl;
     }
 }
 
+static void keepRawEstimates(GazeHyp& ghyp) {
+    ghyp.rawEyeLidClassification = ghyp.eyeLidClassification;
+    ghyp.rawHorizontalGazeEstimation = ghyp.horizontalGazeEstimation;
+    ghyp.rawVerticalGazeEstimation = ghyp.verticalGazeEstimation;
+}
+
 void WorkerThread::stop() {
     shouldStop = true;
 }
@@ -188,6 +245,17 @@ void WorkerThread::interpretHyp(GazeHyp& ghyp) {
     }
 }
 
+void WorkerThread::assignTracks(FaceTracker& tracker, GazeHypsPtr gazehyps) {
+    std::vector<dlib::rectangle> faces;
+    for (const auto& ghyp : *gazehyps) {
+        faces.push_back(ghyp.faceDetection);
+    }
+    auto ids = tracker.update(faces);
+    for (size_t i = 0; i < ids.size(); i++) {
+        gazehyps->hyps(i).trackId = ids[i];
+    }
+}
+
 template<typename T>
 static void tryLoadModel(T& learner, const string& filename) {
     try {
@@ -198,22 +266,308 @@ static void tryLoadModel(T& learner, const string& filename) {
     }
 }
 
+template<typename T>
+static void tryCompileModel(T& learner, const string& filename, const string& suffix) {
+    if (filename.empty() || suffix.empty() || !learner.isInitialized()) return;
+    try {
+        learner.compileClassifier(filename + suffix);
+        cerr << "Compiled " << filename << " to " << filename + suffix << endl;
+    } catch (std::exception &e) {
+        cerr << filename << ":" << e.what() << endl;
+    }
+}
+
+void WorkerThread::loadModels(LearnerSet& learners) {
+    tryLoadModel(learners.glearner, classifyGaze);
+    tryLoadModel(learners.eoclearner, classifyLid);
+    tryLoadModel(learners.rglearner, estimateGaze);
+    tryLoadModel(learners.rellearner, estimateLid);
+    tryLoadModel(learners.vglearner, estimateVerticalGaze);
+}
+
+void WorkerThread::accumulateSamples(LearnerSet& learners, const FeatureBlock& features, const string& label) {
+    if (!trainLid.empty()) learners.eoclearner.accumulate(features, label);
+    if (!trainGaze.empty()) learners.glearner.accumulate(features, label);
+    if (!trainGazeEstimator.empty()) learners.rglearner.accumulate(features, label);
+    if (!trainLidEstimator.empty()) learners.rellearner.accumulate(features, label);
+    if (!trainVerticalGazeEstimator.empty()) learners.vglearner.accumulate(features, label);
+}
+
+void WorkerThread::trainModels(LearnerSet& learners) {
+    if (learners.glearner.sampleCount() > 0) {
+        learners.glearner.train(trainGaze);
+    }
+    if (learners.eoclearner.sampleCount() > 0) {
+        learners.eoclearner.train(trainLid);
+    }
+    if (learners.vglearner.sampleCount() > 0) {
+        learners.vglearner.train(trainVerticalGazeEstimator);
+    }
+    if (learners.rglearner.sampleCount() > 0) {
+        learners.rglearner.train(trainGazeEstimator);
+    }
+    if (learners.rellearner.sampleCount() > 0) {
+        learners.rellearner.train(trainLidEstimator);
+    }
+}
+
+// One pipeline without display output over a part of the batch list, frames are numbered from firstFrame.
+// With a cache writer the features are stored instead of accumulated.
+void WorkerThread::processShard(LearnerSet& learners, std::unique_ptr<ImageProvider> images, int firstFrame,
+                                int threads, EstimateWriter* estimates, FeatureCache::Writer* cache) {
+    FaceDetectionWorker faceworker(std::move(images), threads, keyframeInterval, minTrackingConfidence,
+                                    detectionSplit, detectionScale, minFaceSize, maxFaceSize);
+    ShapeDetectionWorker shapeworker(faceworker.hypsqueue(), modelfile, max(1, threads/2));
+    RegressionWorker regressionWorker(shapeworker.hypsqueue(), learners.eoclearner, learners.glearner,
+                                      learners.rglearner, learners.rellearner, learners.vglearner,
+                                      max(1, threads), pupilSearch);
+    FaceTracker faceTracker(0.3, trackMaxAge);
+    TrackSmoothers trackSmoothers(trackMaxAge);
+    int frameCounter = firstFrame;
+    Trace::setThreadName("shard_consumer");
+    while(!shouldStop) {
+        GazeHypsPtr gazehyps;
+        try {
+            Trace::Scope scope("wait_output");
+            gazehyps = regressionWorker.hypsqueue().peek();
+            gazehyps->waitready();
+        } catch(QueueInterruptedException) {
+            break;
+        }
+        Trace::Scope scope("output", gazehyps->sequence);
+        const auto consumeStart = Metrics::now();
+        Metrics::record(Stage::OUTPUT_WAIT, gazehyps->stageTime, consumeStart);
+        assignTracks(faceTracker, gazehyps);
+        vector<const FeatureBlock*> faces;
+        for (auto& ghyp : *gazehyps) {
+            keepRawEstimates(ghyp);
+            if (smoothingEnabled) trackSmoothers(ghyp);
+            interpretHyp(ghyp);
+            if (cache) {
+                faces.push_back(&ghyp.features);
+            } else {
+                accumulateSamples(learners, ghyp.features, gazehyps->label);
+            }
+        }
+        if (cache) cache->add(gazehyps->id, gazehyps->label, FeatureCache::stamp(gazehyps->id), faces);
+        trackSmoothers.nextFrame();
+        gazehyps->frameCounter = frameCounter++;
+        if (estimates) estimates->write(EstimateFrame::fromHyps(*gazehyps));
+        Metrics::record(Stage::CONSUMER, consumeStart);
+        Metrics::record(Stage::END_TO_END, gazehyps->captureTime);
+        Metrics::setGauge(Gauge::DETECTION_QUEUE, faceworker.hypsqueue().size());
+        Metrics::setGauge(Gauge::SHAPE_QUEUE, shapeworker.hypsqueue().size());
+        Metrics::setGauge(Gauge::REGRESSION_QUEUE, regressionWorker.hypsqueue().size());
+        regressionWorker.hypsqueue().pop();
+    }
+    regressionWorker.hypsqueue().interrupt();
+    regressionWorker.wait();
+}
+
+// The batch list is cut into contiguous shards that run as independent pipelines. Appending
+// the estimates and training samples of the shards in shard order keeps the order of the list,
+// so the results do not depend on how the shards were scheduled. With a cache prefix every shard
+// writes the features of its frames to a cache part, the parts are returned in list order.
+vector<string> WorkerThread::processShards(LearnerSet& learners, const BatchImageProvider& list,
+                                           const string& cachePrefix) {
+    const size_t count = max<size_t>(1, min<size_t>(shards, list.size()));
+    const int shardThreads = max(1, threadcount/(int)count);
+    vector<unique_ptr<LearnerSet>> shardLearners;
+    for (size_t i = 0; i < count; i++) {
+        shardLearners.emplace_back(new LearnerSet(trainingParameters));
+        loadModels(*shardLearners.back());
+    }
+    vector<string> parts;
+    for (size_t i = 0; i < count && !cachePrefix.empty(); i++) {
+        parts.push_back(cachePrefix + to_string(i));
+    }
+    // every shard writes binary estimates to a part file, the parts are converted in list order
+    vector<string> estimateParts;
+    for (size_t i = 0; i < count && !dumpEstimates.empty(); i++) {
+        estimateParts.push_back(dumpEstimates + ".part" + to_string(i));
+    }
+    vector<exception_ptr> errors(count);
+    vector<std::thread> threads;
+    for (size_t i = 0; i < count; i++) {
+        const size_t begin = list.size()*i/count;
+        const size_t end = list.size()*(i + 1)/count;
+        threads.emplace_back([this, &list, &shardLearners, &estimateParts, &parts, &errors, i, begin, end, shardThreads]() {
+            try {
+                std::unique_ptr<ImageProvider> images(new BatchImageProvider(list, begin, end));
+                if (prefetchThreads > 0) {
+                    images.reset(new PrefetchingImageProvider(std::move(images), prefetchThreads,
+                                                              PREFETCH_FRAMES_PER_THREAD*prefetchThreads));
+                }
+                unique_ptr<FeatureCache::Writer> cache;
+                if (!parts.empty()) cache.reset(new FeatureCache::Writer(parts[i], featureCacheKey()));
+                unique_ptr<EstimateWriter> estimates;
+                if (!estimateParts.empty()) {
+                    estimates.reset(new AsyncEstimateWriter(unique_ptr<EstimateWriter>(
+                                        new BinaryEstimateWriter(estimateParts[i])), ESTIMATE_QUEUE_FRAMES));
+                }
+                processShard(*shardLearners[i], std::move(images), begin, shardThreads, estimates.get(), cache.get());
+                if (cache) cache->finish();
+                if (estimates) estimates->finish();
+                cerr << "Shard " << i << " finished " << end - begin << " frames" << endl;
+            } catch (...) {
+                errors[i] = current_exception();
+                shouldStop = true;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto& error : errors) {
+        if (error) {
+            for (const string& part : estimateParts) remove(part.c_str());
+            rethrow_exception(error);
+        }
+    }
+    unique_ptr<EstimateWriter> estimates;
+    if (!estimateParts.empty()) estimates = openEstimates(dumpEstimates, estimatesFormat);
+    for (const string& part : estimateParts) {
+        if (estimates) {
+            ifstream in(part, ios::in | ios::binary);
+            BinaryEstimateWriter::readHeader(in, part);
+            EstimateFrame frame;
+            while (BinaryEstimateWriter::read(in, frame)) estimates->write(frame);
+        }
+        remove(part.c_str());
+    }
+    finishEstimates(estimates);
+    for (const auto& shard : shardLearners) {
+        learners.glearner.appendSamples(shard->glearner);
+        learners.eoclearner.appendSamples(shard->eoclearner);
+        learners.rglearner.appendSamples(shard->rglearner);
+        learners.rellearner.appendSamples(shard->rellearner);
+        learners.vglearner.appendSamples(shard->vglearner);
+    }
+    return parts;
+}
+
+// everything the cached features depend on besides the images
+uint64_t WorkerThread::featureCacheKey() {
+    const FeatureCache::FileStamp model = FeatureCache::stamp(modelfile);
+    ostringstream settings;
+    settings << modelfile << "|" << model.mtime << "|" << model.size
+             << "|" << PupilFinder::strategyName(pupilSearch)
+             << "|" << keyframeInterval << "|" << minTrackingConfidence << "|" << detectionSplit
+             << "|" << detectionScale << "|" << minFaceSize << "|" << maxFaceSize;
+    return FeatureCache::pipelineKey(settings.str());
+}
+
+// Only the images that are new or changed since the cache was written go through the pipeline.
+// The cache is then rewritten in list order from the reused entries and the new parts.
+void WorkerThread::updateFeatureCache(LearnerSet& learners) {
+    const uint64_t key = featureCacheKey();
+    BatchImageProvider list(inputParam);
+    unique_ptr<FeatureCache> previous;
+    if (FeatureCache::isCache(featureCache)) {
+        previous.reset(new FeatureCache(featureCache));
+        if (previous->key() != key) {
+            cerr << "Feature cache " << featureCache << " was written with other models or settings, rebuilding it" << endl;
+            previous.reset();
+        }
+    }
+    vector<long> cached(list.size(), -1);
+    vector<size_t> missing;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (previous) cached[i] = previous->find(list.filename(i), FeatureCache::stamp(list.filename(i)));
+        if (cached[i] < 0) missing.push_back(i);
+    }
+    cerr << list.size() - missing.size() << " of " << list.size() << " images found in feature cache" << endl;
+    vector<unique_ptr<FeatureCache>> parts;
+    if (!missing.empty()) {
+        for (const string& part : processShards(learners, BatchImageProvider(list, missing), featureCache + ".part")) {
+            parts.emplace_back(new FeatureCache(part));
+            remove(part.c_str());
+        }
+    }
+    FeatureCache::Writer writer(featureCache, key);
+    size_t part = 0, entry = 0;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (cached[i] >= 0) {
+            //labels are not part of the image key, a relabeled list keeps its cached features
+            writer.add(*previous, cached[i], list.label(i));
+            continue;
+        }
+        while (part < parts.size() && entry == parts[part]->entryCount()) {
+            part++;
+            entry = 0;
+        }
+        if (part == parts.size() || parts[part]->path(entry) != list.filename(i)) {
+            throw runtime_error("feature cache parts do not match " + inputParam);
+        }
+        writer.add(*parts[part], entry++, list.label(i));
+    }
+    writer.finish();
+}
+
+void WorkerThread::accumulateFromCache(LearnerSet& learners, const string& filename) {
+    FeatureCache cache(filename);
+    FeatureArena arena;
+    FeatureBlock features;
+    for (size_t row = 0; row < cache.rowCount(); row++) {
+        arena.reset();
+        cache.load(row, arena, features);
+        accumulateSamples(learners, features, cache.label(cache.rowEntry(row)));
+    }
+    cerr << "Read " << cache.rowCount() << " faces of " << cache.entryCount() << " images from " << filename << endl;
+}
+
 void WorkerThread::process() {
-    MutualGazeLearner glearner(trainingParameters);
-    RelativeGazeLearner rglearner(trainingParameters);
-    EyeLidLearner eoclearner(trainingParameters);
-    RelativeEyeLidLearner rellearner(trainingParameters);
-    VerticalGazeLearner vglearner(trainingParameters);
-    tryLoadModel(glearner, classifyGaze);
-    tryLoadModel(eoclearner, classifyLid);
-    tryLoadModel(rglearner, estimateGaze);
-    tryLoadModel(rellearner, estimateLid);
-    tryLoadModel(vglearner, estimateVerticalGaze);
+    // closed after all workers of this function have stopped recording
+    unique_ptr<Trace::Session> traceSession;
+    if (!traceFile.empty()) traceSession.reset(new Trace::Session(traceFile));
+    unique_ptr<MetricsExporter> metricsExporter;
+    if (!metricsTarget.empty()) {
+        metricsExporter.reset(new MetricsExporter(metricsTarget, metricsFormat == "prometheus", metricsInterval));
+    }
+    LearnerSet learners(trainingParameters);
+    MutualGazeLearner& glearner = learners.glearner;
+    RelativeGazeLearner& rglearner = learners.rglearner;
+    EyeLidLearner& eoclearner = learners.eoclearner;
+    RelativeEyeLidLearner& rellearner = learners.rellearner;
+    VerticalGazeLearner& vglearner = learners.vglearner;
+    loadModels(learners);
+    tryCompileModel(glearner, classifyGaze, compileModelSuffix);
+    tryCompileModel(eoclearner, classifyLid, compileModelSuffix);
+    tryCompileModel(rglearner, estimateGaze, compileModelSuffix);
+    tryCompileModel(rellearner, estimateLid, compileModelSuffix);
+    tryCompileModel(vglearner, estimateVerticalGaze, compileModelSuffix);
+    if (!compileModelSuffix.empty() && !FlatShapePredictor::isCompiled(modelfile)) {
+        try {
+            FlatShapePredictor(modelfile).write(modelfile + compileModelSuffix);
+            cerr << "Compiled " << modelfile << " to " << modelfile + compileModelSuffix << endl;
+        } catch (std::exception &e) {
+            cerr << modelfile << ":" << e.what() << endl;
+        }
+    }
+    if (inputType == "features" || !featureCache.empty() || shards > 1) {
+        emit statusmsg("Processing without display...");
+        if (inputType == "features") {
+            accumulateFromCache(learners, inputParam);
+        } else if (!featureCache.empty()) {
+            updateFeatureCache(learners);
+            accumulateFromCache(learners, featureCache);
+        } else {
+            cerr << "Processing frames in " << shards << " shards..." << endl;
+            processShards(learners, BatchImageProvider(inputParam), "");
+        }
+        cerr << "Frames processed..." << endl;
+        trainModels(learners);
+        emit finished();
+        cerr << "Primary worker thread finished processing" << endl;
+        return;
+    }
     emit statusmsg("Setting up detector threads...");
     std::unique_ptr<ImageProvider> imgProvider(getImageProvider());
-    FaceDetectionWorker faceworker(std::move(imgProvider), threadcount);
+    FaceDetectionWorker faceworker(std::move(imgProvider), threadcount, keyframeInterval, minTrackingConfidence,
+                                    detectionSplit, detectionScale, minFaceSize, maxFaceSize);
     ShapeDetectionWorker shapeworker(faceworker.hypsqueue(), modelfile, max(1, threadcount/2));
-    RegressionWorker regressionWorker(shapeworker.hypsqueue(), eoclearner, glearner, rglearner, rellearner, vglearner, max(1, threadcount));
+    RegressionWorker regressionWorker(shapeworker.hypsqueue(), eoclearner, glearner, rglearner, rellearner, vglearner,
+                                      max(1, threadcount), pupilSearch);
     emit statusmsg("Detector threads started");
 #ifdef ENABLE_YARP_SUPPORT
     unique_ptr<YarpSender> yarpSender;
@@ -225,37 +579,32 @@ void WorkerThread::process() {
     if (!streamppm.empty()) {
         ppmout.open(streamppm);
     }
-    ofstream estimateout;
-    if (!dumpEstimates.empty()) {
-        estimateout.open(dumpEstimates);
-        if (estimateout.is_open()) {
-            writeEstHeader(estimateout);
-        } else {
-            cerr << "Warning: could not open " << dumpEstimates << endl;
-        }
-    }
-    RlsSmoother horizGazeSmoother;
-    RlsSmoother vertGazeSmoother;
-    RlsSmoother lidSmoother(5, 0.95, 0.09);
+    unique_ptr<EstimateWriter> estimates;
+    if (!dumpEstimates.empty()) estimates = openEstimates(dumpEstimates, estimatesFormat);
+    FaceTracker faceTracker(0.3, trackMaxAge);
+    TrackSmoothers trackSmoothers(trackMaxAge);
     emit statusmsg("Entering processing loop...");
     cerr << "Processing frames..." << endl;
     TemporalStats temporalStats;
+    Trace::setThreadName("consumer");
     while(!shouldStop) {
         GazeHypsPtr gazehyps;
         try {
+            Trace::Scope scope("wait_output");
             gazehyps = regressionWorker.hypsqueue().peek();
             gazehyps->waitready();
         } catch(QueueInterruptedException) {
             break;
         }
+        Trace::Scope scope("output", gazehyps->sequence);
+        const auto consumeStart = Metrics::now();
+        Metrics::record(Stage::OUTPUT_WAIT, gazehyps->stageTime, consumeStart);
         cv::Mat frame = gazehyps->frame;
 
+        assignTracks(faceTracker, gazehyps);
         for (auto& ghyp : *gazehyps) {
-            if (smoothingEnabled) {
-                horizGazeSmoother.smoothValue(ghyp.horizontalGazeEstimation);
-                vertGazeSmoother.smoothValue(ghyp.verticalGazeEstimation);
-                lidSmoother.smoothValue(ghyp.eyeLidClassification);
-            }
+            keepRawEstimates(ghyp);
+            if (smoothingEnabled) trackSmoothers(ghyp);
             interpretHyp(ghyp);
             auto& pupils = ghyp.pupils;
             auto& faceparts = ghyp.faceParts;
@@ -266,15 +615,12 @@ void WorkerThread::process() {
             rellearner.visualize(ghyp);
             vglearner.visualize(ghyp, verticalGazeTolerance);
             rglearner.visualize(ghyp, horizGazeTolerance);
-            if (!trainLid.empty()) eoclearner.accumulate(ghyp);
-            if (!trainGaze.empty()) glearner.accumulate(ghyp);
-            if (!trainGazeEstimator.empty()) rglearner.accumulate(ghyp);
-            if (!trainLidEstimator.empty()) rellearner.accumulate(ghyp);
-            if (!trainVerticalGazeEstimator.empty()) vglearner.accumulate(ghyp);
+            accumulateSamples(learners, ghyp.features, gazehyps->label);
         }
+        trackSmoothers.nextFrame();
         temporalStats(gazehyps);
         dumpPpm(ppmout, frame);
-        dumpEst(estimateout, gazehyps);
+        if (estimates) estimates->write(EstimateFrame::fromHyps(*gazehyps));
         if (showstats) temporalStats.printStats(gazehyps);
 #ifdef ENABLE_YARP_SUPPORT
         if (yarpSender) yarpSender->sendGazeHypotheses(gazehyps);
@@ -284,26 +630,18 @@ void WorkerThread::process() {
         if (limitFps > 0) {
             usleep(1e6/limitFps);
         }
+        Metrics::record(Stage::CONSUMER, consumeStart);
+        Metrics::record(Stage::END_TO_END, gazehyps->captureTime);
+        Metrics::setGauge(Gauge::DETECTION_QUEUE, faceworker.hypsqueue().size());
+        Metrics::setGauge(Gauge::SHAPE_QUEUE, shapeworker.hypsqueue().size());
+        Metrics::setGauge(Gauge::REGRESSION_QUEUE, regressionWorker.hypsqueue().size());
         regressionWorker.hypsqueue().pop();
     }
     regressionWorker.hypsqueue().interrupt();
     regressionWorker.wait();
+    finishEstimates(estimates);
     cerr << "Frames processed..." << endl;
-    if (glearner.sampleCount() > 0) {
-        glearner.train(trainGaze);
-    }
-    if (eoclearner.sampleCount() > 0) {
-        eoclearner.train(trainLid);
-    }
-    if (vglearner.sampleCount() > 0) {
-        vglearner.train(trainVerticalGazeEstimator);
-    }
-    if (rglearner.sampleCount() > 0) {
-        rglearner.train(trainGazeEstimator);
-    }
-    if (rellearner.sampleCount() > 0) {
-        rellearner.train(trainLidEstimator);
-    }
+    trainModels(learners);
     emit finished();
     cerr << "Primary worker thread finished processing" << endl;
 }
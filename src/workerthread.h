@@ -1,7 +1,9 @@
 #pragma once
 
 #include <QObject>
+#include <atomic>
 #include <memory>
+#include <ostream>
 #include <vector>
 #include <string>
 
@@ -10,22 +12,36 @@
 #include "pupilfinder.h"
 #include "gazehyps.h"
 #include "abstractlearner.h"
+#include "facetracker.h"
+#include "featurecache.h"
+#include "estimatewriter.h"
 
 Q_DECLARE_METATYPE(std::string)
 
+struct LearnerSet;
+
 class WorkerThread : public QObject
 {
     Q_OBJECT
 
 private:
-    bool shouldStop = false;
+    std::atomic<bool> shouldStop{false};
     std::unique_ptr<ImageProvider> getImageProvider();
     void normalizeMat(const cv::Mat &in, cv::Mat &out);
     void dumpPpm(std::ofstream &fout, const cv::Mat &frame);
-    void dumpEst(std::ofstream &fout, GazeHypsPtr gazehyps);
-    void writeEstHeader(std::ofstream& fout);
+    std::unique_ptr<EstimateWriter> openEstimates(const std::string& filename, const std::string& format);
     void interpretHyp(GazeHyp &ghyp);
-    void smoothHyp(GazeHyp& ghyp);
+    void assignTracks(FaceTracker& tracker, GazeHypsPtr gazehyps);
+    void loadModels(LearnerSet& learners);
+    void accumulateSamples(LearnerSet& learners, const FeatureBlock& features, const std::string& label);
+    void trainModels(LearnerSet& learners);
+    std::vector<std::string> processShards(LearnerSet& learners, const BatchImageProvider& list,
+                                           const std::string& cachePrefix);
+    void processShard(LearnerSet& learners, std::unique_ptr<ImageProvider> images, int firstFrame,
+                      int threads, EstimateWriter* estimates, FeatureCache::Writer* cache);
+    uint64_t featureCacheKey();
+    void updateFeatureCache(LearnerSet& learners);
+    void accumulateFromCache(LearnerSet& learners, const std::string& filename);
 
 public:
     explicit WorkerThread(QObject *parent = 0);
@@ -47,10 +63,28 @@ public:
     std::string estimateVerticalGaze;
     std::string estimateLid;
     std::string dumpEstimates;
+    std::string estimatesFormat = "tsv";
+    std::string compileModelSuffix;
+    std::string featureCache;
+    std::string metricsTarget;
+    std::string metricsFormat = "json";
+    double metricsInterval = 5;
+    std::string traceFile;
+    int keyframeInterval = 1;
+    double minTrackingConfidence = 0.3;
+    int detectionSplit = 0;
+    int detectionScale = 1;
+    int minFaceSize = 0;
+    int maxFaceSize = 0;
+    int trackMaxAge = 10;
+    PupilFinder::SearchStrategy pupilSearch = PupilFinder::SearchStrategy::EXHAUSTIVE;
     double limitFps = 0;
     double horizGazeTolerance = 5;
     double verticalGazeTolerance = 5;
     bool smoothingEnabled = false;
+    bool realtime = false;
+    int prefetchThreads = 0;
+    int shards = 0;
     bool showstats = true;
     TrainingParameters trainingParameters;
 
@@ -35,6 +35,11 @@ string YarpImageProvider::getId()
     return "";
 }
 
+void YarpImageProvider::interrupt()
+{
+    imagePort.interrupt();
+}
+
 YarpImageProvider::~YarpImageProvider()
 {
     imagePort.close();
@@ -57,6 +62,10 @@ void YarpSender::sendGazeHypotheses(GazeHypsPtr hyps)
     for (GazeHyp& ghyp : *hyps) {
         Bottle& bghyp = allfaces.addList();
         bghyp.addString("face");
+        {   Bottle& btrack = bghyp.addList();
+            btrack.addString("track");
+            btrack.addInt32(ghyp.trackId);
+        }
         {   Bottle& bfacerect = bghyp.addList();
             auto fr = ghyp.pupils.faceRect();
             bfacerect.addString("facerect");
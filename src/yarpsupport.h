@@ -15,6 +15,7 @@ public:
     virtual bool get(cv::Mat& frame);
     virtual std::string getLabel();
     virtual std::string getId();
+    virtual void interrupt();
     virtual ~YarpImageProvider();
 
 protected: